@@ -0,0 +1,81 @@
+#ifndef ADAPTIVE_SORT_H
+#define ADAPTIVE_SORT_H
+
+#include <cstdint>
+#include <input_source.h>
+#include <string>
+
+/**
+ * @brief Order already present in an input, estimated from evenly spaced sample windows.
+ * @param windows Number of windows sampled, each a block of consecutive elements.
+ * @param descent_ratio Fraction of adjacent pairs inside the windows with a[i] > a[i+1].
+ * @param ascent_ratio Fraction of adjacent pairs inside the windows with a[i] < a[i+1].
+ * @param duplicate_ratio Fraction of sampled elements equal to another sampled element.
+ * @param inversion_ratio Fraction of inverted pairs among the first elements of the
+ * windows: 0 if the windows appear in ascending order, 1 if in descending order.
+ * @param estimated_run_length Average length of the ascending runs inside the windows.
+ */
+struct Presortedness {
+    int64_t sampled_elements = 0;
+    int64_t windows = 0;
+    double descent_ratio = 0;
+    double ascent_ratio = 0;
+    double duplicate_ratio = 0;
+    double inversion_ratio = 0;
+    double estimated_run_length = 0;
+};
+
+/**
+ * @brief How adaptive_sort sorts an input.
+ * @details COPY and REVERSE_COPY check the order while they copy and fall back to
+ * NATURAL_MERGE if the sample was misleading. They write a single file, so adaptive_sort
+ * replaces them by NATURAL_MERGE and MERGESORT when the output is sharded.
+ */
+enum class SortPlan { COPY, REVERSE_COPY, NATURAL_MERGE, MERGESORT, QUICKSORT };
+
+/**
+ * @brief Plan picked by choose_sort_plan, with the statistics and the reason behind it.
+ */
+struct PlanChoice {
+    SortPlan plan = SortPlan::MERGESORT;
+    std::string reason;
+    Presortedness stats;
+};
+
+/** sort_plan_name
+ * @brief Name of a plan, used in logs and results.
+ */
+std::string sort_plan_name(SortPlan plan);
+
+/** estimate_presortedness
+ * @brief Samples up to PRESORT_SAMPLE_WINDOWS blocks of input, without moving its stream.
+ * @param io_operations Incremented by the blocks read if the input is stored.
+ * @return The statistics, windows == 0 if the input is empty or has no random access.
+ */
+Presortedness estimate_presortedness(InputSource &input, int64_t &io_operations);
+
+/** choose_sort_plan
+ * @brief Picks the cheapest plan for an input with the given statistics.
+ */
+PlanChoice choose_sort_plan(const Presortedness &stats);
+
+/** adaptive_sort
+ * @brief Samples the input, logs the plan picked and its reasons, and runs it.
+ * @param input Source of the data to sort.
+ * @param output_file Path of the sorted output file.
+ * @param arity Arity used by the merge or the partitioning.
+ * @param choice If not null, receives the plan that was finally run.
+ * @return Total number of I/O operations performed, sampling included.
+ */
+int64_t adaptive_sort(
+    InputSource &input, const std::string &output_file, int64_t arity, PlanChoice *choice = nullptr
+);
+
+/** adaptive_sort
+ * @brief adaptive_sort over a file of the current storage backend.
+ */
+int64_t adaptive_sort(
+    const std::string &input_file, const std::string &output_file, int64_t arity, PlanChoice *choice = nullptr
+);
+
+#endif
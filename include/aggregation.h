@@ -0,0 +1,119 @@
+#ifndef AGGREGATION_H
+#define AGGREGATION_H
+
+#include <cstdint>
+#include <input_source.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief What the sorts do with repeated keys.
+ * @details NONE keeps every value. DISTINCT writes each key once. COUNT writes a
+ * (key, count) pair of int64_t per key. Duplicates are collapsed as soon as they meet: when
+ * a run is formed, at every k_way_merge output and at every leaf of the quicksort, so
+ * duplicate-heavy inputs shrink at each pass. Intermediate runs hold the same records as
+ * the output.
+ */
+enum class Aggregation { NONE, DISTINCT, COUNT };
+
+/** aggregation
+ * @brief Mode of the sorts, NONE unless set_aggregation was called.
+ */
+Aggregation aggregation();
+
+/** set_aggregation
+ * @brief Makes external_mergesort, external_quicksort and adaptive_sort collapse duplicates.
+ * @warning The sharded output (set_output_shards) only supports NONE, see check_aggregation_shards.
+ */
+void set_aggregation(Aggregation mode);
+
+/** check_aggregation_shards
+ * @brief Exits with error unless the output of a sort in mode can be split in shards files.
+ * @details Only NONE can: the sharded paths don't collapse duplicates, so the sorts call it
+ * before they start instead of writing an output that isn't aggregated.
+ */
+void check_aggregation_shards(Aggregation mode, int64_t shards);
+
+/** parse_aggregation
+ * @brief Parses none, distinct or count.
+ * @warning Exits with error on an unknown name.
+ */
+Aggregation parse_aggregation(const std::string &name);
+
+/** aggregation_name
+ * @brief Name of mode, as parse_aggregation reads it.
+ */
+std::string aggregation_name(Aggregation mode);
+
+/** record_elements
+ * @brief int64_t values per record of the current mode: 2 for COUNT, 1 otherwise.
+ */
+int64_t record_elements();
+
+/** aggregate_sorted
+ * @brief Replaces the sorted keys data[0, n) by the records of the current mode, packed at
+ * the start of data, and resizes data to them.
+ * @details With COUNT every key may become a pair, so data grows to 2n values while they
+ * are formed: reserve them to stay within the memory budget.
+ */
+void aggregate_sorted(std::vector<int64_t> &data, int64_t n);
+
+/**
+ * @brief Collapses a sorted stream of records into the records of the current mode, for
+ * the loops that produce their output a record at a time.
+ * @details The last record is held back until a larger key arrives, so its count can still
+ * grow; flush() lets it out.
+ */
+class RecordCollapser {
+  public:
+    /** add
+     * @brief Adds count occurrences of key, not smaller than the keys added before.
+     * @return Number of values of the record released into out, 0 if key was the held one.
+     */
+    int64_t add(int64_t key, int64_t count, int64_t *out) {
+        if (held_ && key == key_) {
+            count_ += count;
+            return 0;
+        }
+        int64_t released = release(out);
+        key_ = key;
+        count_ = count;
+        held_ = true;
+        return released;
+    }
+
+    /** flush
+     * @brief Releases the held record into out.
+     * @return Number of values released.
+     */
+    int64_t flush(int64_t *out) {
+        int64_t released = release(out);
+        held_ = false;
+        return released;
+    }
+
+  private:
+    int64_t release(int64_t *out) const {
+        if (!held_)
+            return 0;
+        out[0] = key_;
+        if (counts_)
+            out[1] = count_;
+        return counts_ ? 2 : 1;
+    }
+
+    bool counts_ = aggregation() == Aggregation::COUNT;
+    bool held_ = false;
+    int64_t key_ = 0;
+    int64_t count_ = 0;
+};
+
+/** verify_aggregated_output
+ * @brief Checks that the keys of path are strictly ascending and, for COUNT, that the keys
+ * repeated by their counts have the expected fingerprint. For DISTINCT only the order and
+ * that there are at most expected.count keys can be checked.
+ * @return true if all checks pass.
+ */
+bool verify_aggregated_output(const std::string &path, const Fingerprint &expected);
+
+#endif
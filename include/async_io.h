@@ -0,0 +1,176 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <storage.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief How an AsyncIO serves its requests.
+ * @details SYNC serves each request inside the call that submits it, one request in flight
+ * like plain read_at/write_at. THREADS hands the requests to queue_depth threads that call
+ * read_at/write_at. IO_URING submits them to the kernel through an io_uring ring of
+ * queue_depth entries, with the registered buffers as fixed buffers; files without
+ * descriptors (memory, mmap, simulated) still go to threads. AUTO is IO_URING when the
+ * kernel allows it and THREADS otherwise.
+ */
+enum class IOEngine { SYNC, THREADS, IO_URING, AUTO };
+
+/**
+ * @brief Asynchronous I/O settings of the sorts.
+ * @param engine Engine of the merge reads and the partition writes.
+ * @param queue_depth Most requests in flight at once.
+ */
+struct IOConfig {
+    IOEngine engine = IOEngine::SYNC;
+    int64_t queue_depth = 8;
+};
+
+/** io_config
+ * @brief I/O settings of the sorts, SYNC unless others were set.
+ */
+const IOConfig &io_config();
+
+/** set_io_config
+ * @brief Replaces the I/O settings of the sorts.
+ */
+void set_io_config(const IOConfig &config);
+
+/** parse_io_engine
+ * @brief Parses an engine name: "sync", "threads", "io_uring" or "auto".
+ * @warning Exits with error if the name is unknown.
+ */
+IOEngine parse_io_engine(const std::string &name);
+
+/** io_engine_name
+ * @brief Name of an engine, as parse_io_engine takes it.
+ */
+std::string io_engine_name(IOEngine engine);
+
+/** io_uring_available
+ * @brief true if this build and the running kernel support io_uring.
+ */
+bool io_uring_available();
+
+/**
+ * @brief Queue of positioned reads and writes kept in flight while the caller works.
+ * @details read() and write() return a ticket at once, blocking only while queue_depth
+ * requests are already in flight; wait() returns the bytes the request transferred. A
+ * request split over several extents of a spill counts once per extent. Buffers must stay
+ * untouched until their request is waited for.
+ * @warning Not thread-safe: one thread submits and waits.
+ */
+class AsyncIO {
+  public:
+    explicit AsyncIO(const IOConfig &config = io_config());
+
+    /**
+     * @brief Waits for every request in flight.
+     */
+    ~AsyncIO();
+
+    AsyncIO(const AsyncIO &) = delete;
+    AsyncIO &operator=(const AsyncIO &) = delete;
+
+    /** read
+     * @brief Queues a read of up to bytes bytes of file at offset into buffer.
+     * @return Ticket of the request.
+     */
+    int64_t read(StorageFile &file, void *buffer, int64_t bytes, int64_t offset);
+
+    /** write
+     * @brief Queues a write of bytes bytes of buffer to file at offset.
+     * @return Ticket of the request.
+     */
+    int64_t write(StorageFile &file, const void *buffer, int64_t bytes, int64_t offset);
+
+    /** wait
+     * @brief Blocks until the request of ticket is done.
+     * @return Bytes transferred, short at the end of a file for reads.
+     */
+    int64_t wait(int64_t ticket);
+
+    /** drain
+     * @brief Waits for every request in flight, their results are dropped.
+     */
+    void drain();
+
+    /** register_buffer
+     * @brief Registers memory that requests will use, so io_uring pins it once instead of
+     * on every request.
+     * @details Waits for the requests in flight. Other engines ignore it, and so does
+     * io_uring if the kernel refuses (for example over the locked memory limit). The
+     * memory must outlive the AsyncIO.
+     */
+    void register_buffer(void *buffer, int64_t bytes);
+
+    /** engine
+     * @brief Engine in use, AUTO already resolved.
+     */
+    IOEngine engine() const;
+
+    /** queue_depth
+     * @brief Most requests in flight at once.
+     */
+    int64_t queue_depth() const;
+
+    /** peak_in_flight
+     * @brief Largest number of requests that were in flight at once.
+     */
+    int64_t peak_in_flight();
+
+  private:
+    friend bool io_uring_available();
+    struct Ring;
+
+    /**
+     * @brief A request handed to the threads.
+     */
+    struct Job {
+        int64_t ticket;
+        StorageFile *file;
+        char *buffer;
+        int64_t bytes;
+        int64_t offset;
+        bool write;
+    };
+
+    /**
+     * @brief Progress of a ticket: parts still in flight and bytes transferred so far.
+     */
+    struct Request {
+        int64_t parts = 0;
+        int64_t bytes = 0;
+    };
+
+    int64_t submit(StorageFile &file, char *buffer, int64_t bytes, int64_t offset, bool write);
+    void submit_to_threads(const Job &job);
+    void start_threads();
+    void worker_loop();
+    void reap_ring();
+
+    IOEngine engine_;
+    int64_t queue_depth_;
+    std::unique_ptr<Ring> ring_;
+    std::vector<NativeRange> ranges_;
+
+    std::mutex mutex_;
+    std::condition_variable job_ready_;
+    std::condition_variable job_done_;
+    std::deque<Job> jobs_;
+    std::vector<std::thread> workers_;
+    std::map<int64_t, Request> requests_;
+    int64_t next_ticket_ = 0;
+    int64_t thread_in_flight_ = 0;
+    int64_t peak_in_flight_ = 0;
+    bool stop_ = false;
+};
+
+#endif
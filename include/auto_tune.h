@@ -0,0 +1,92 @@
+#ifndef AUTO_TUNE_H
+#define AUTO_TUNE_H
+
+#include <cstdint>
+#include <simulate_io.h>
+#include <storage.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Mean latency of a random read of one size, measured by probe_device.
+ */
+struct ProbePoint {
+    int64_t request_bytes = 0;
+    double seconds = 0;
+};
+
+/**
+ * @brief Speed of the device behind a directory.
+ * @param device Identifier of the device ("major:minor"), the key of the cache.
+ * @param profile Cost of a request: seek_seconds is the fixed latency of a random read,
+ * bandwidth_bytes the sequential read rate.
+ * @param write_bandwidth_bytes Sequential write rate, fsync included.
+ * @param random_reads Latencies the fixed cost was fitted from, empty if cached.
+ * @param cached true if it was read from the cache instead of measured.
+ */
+struct DeviceProbe {
+    std::string device;
+    DeviceProfile profile;
+    double write_bandwidth_bytes = 0;
+    std::vector<ProbePoint> random_reads;
+    bool cached = false;
+};
+
+/**
+ * @brief Plan picked by tune_sort, with the times the cost model predicts for it.
+ * @param merge_buffer_bytes Largest buffer per run of the merge (set_merge_buffer_bytes).
+ */
+struct TunedSort {
+    int64_t mergesort_arity = 0;
+    int64_t quicksort_arity = 0;
+    int64_t merge_buffer_bytes = 0;
+    double mergesort_seconds = 0;
+    double quicksort_seconds = 0;
+};
+
+/** device_id
+ * @brief Identifier ("major:minor") of the device holding directory.
+ * @warning Exits with error if directory doesn't exist.
+ */
+std::string device_id(const std::string &directory);
+
+/** probe_device
+ * @brief Measures the device behind directory with a PROBE_BYTES scratch file: sequential
+ * write and read bandwidth and the latency of random reads of several sizes, with the page
+ * cache of the file dropped before each read phase.
+ * @details Takes about a second on a disk. The fixed cost of a request is the smallest
+ * excess of a random read over its transfer at the sequential rate.
+ * @warning Exits with error if the scratch file can't be written.
+ */
+DeviceProbe probe_device(const std::string &directory);
+
+/** device_probe
+ * @brief Probe of the device behind directory, from cache_path if that device was probed
+ * before, otherwise measured with probe_device and appended to cache_path.
+ */
+DeviceProbe device_probe(
+    const std::string &directory, const std::string &cache_path = "results/device_profiles.csv"
+);
+
+/** simulated_device_probe
+ * @brief Probe of a SimulatedStorage, its profile as is, so the tuner can be checked
+ * against the virtual clock.
+ */
+DeviceProbe simulated_device_probe(const DeviceProfile &profile);
+
+/** predicted_seconds
+ * @brief Time the cost model gives to a simulated sort: one fixed cost per request plus
+ * the blocks read and written at the sequential rates.
+ */
+double predicted_seconds(const SimulatedIO &io, const DeviceProbe &device);
+
+/** tune_sort
+ * @brief Picks the merge arity, the merge buffer size and the quicksort arity with the
+ * lowest predicted time for an input of file_size bytes and the current memory budget.
+ * @details Replays both sorts with simulate_io for every arity in [2, 512] and every
+ * buffer size in MERGE_BUFFER_CANDIDATES; takes a few hundred milliseconds.
+ * @warning Changes the merge buffer size while it searches and restores it at the end.
+ */
+TunedSort tune_sort(const DeviceProbe &device, int64_t file_size);
+
+#endif
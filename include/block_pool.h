@@ -0,0 +1,114 @@
+#ifndef BLOCK_POOL_H
+#define BLOCK_POOL_H
+
+#include <async_io.h>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <storage.h>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed set of small, equally sized frames shared by all the partitions of one level.
+ * @details A partition takes frames only when it has data to buffer, so skewed
+ * partitions get many frames and empty ones none. A partition hands a chain of frames to
+ * the write-behind thread, which gathers it into one large sequential write and gives
+ * the frames back to the pool while partitioning continues.
+ */
+class BlockPool {
+  public:
+    /**
+     * @param frame_elements Number of int64_t per frame.
+     * @param num_frames Number of frames, at least 1.
+     * @param max_write_elements Largest write issued, a longer chain is written in pieces.
+     * @param io Engine of the writes. With one other than SYNC the gather buffer is split in
+     * queue_depth slots (of at least one frame), and a write is queued as soon as a slot is
+     * gathered, so up to queue_depth writes are in flight.
+     */
+    BlockPool(
+        int64_t frame_elements, int64_t num_frames, int64_t max_write_elements,
+        const IOConfig &io = io_config()
+    );
+
+    /**
+     * @brief Waits for the pending writes and stops the writer thread.
+     */
+    ~BlockPool();
+
+    BlockPool(const BlockPool &) = delete;
+    BlockPool &operator=(const BlockPool &) = delete;
+
+    /** frame_elements
+     * @brief Number of int64_t per frame.
+     */
+    int64_t frame_elements() const;
+
+    /** try_acquire
+     * @brief Takes a free frame, waiting for in-flight writes to return one if needed.
+     * @return The frame, or nullptr if every frame is held by a caller.
+     */
+    int64_t *try_acquire();
+
+    /** write_behind
+     * @brief Queues the first elements stored across frames to be written to file at offset.
+     * @details Every frame but the last must be full. The frames return to the pool once
+     * written and must not be used again by the caller.
+     */
+    void write_behind(StorageFile *file, int64_t offset, const std::vector<int64_t *> &frames, int64_t elements);
+
+    /** drain
+     * @brief Waits until every queued write is done.
+     */
+    void drain();
+
+    /** writes
+     * @brief Number of write requests issued so far.
+     */
+    int64_t writes();
+
+  private:
+    struct PendingWrite {
+        StorageFile *file;
+        int64_t offset;
+        std::vector<int64_t *> frames;
+        int64_t elements;
+    };
+
+    /**
+     * @brief A write queued in the I/O engine: the gather slot it uses or the frame it writes
+     * in place, and whether it ends its chain.
+     */
+    struct QueuedWrite {
+        int64_t ticket;
+        int64_t *slot;
+        int64_t *frame;
+        bool last;
+    };
+
+    void writer_loop();
+    int64_t write_chain(const PendingWrite &write);
+    int64_t queue_chain(const PendingWrite &write);
+    void complete_oldest();
+
+    int64_t frame_elements_;
+    std::vector<int64_t> memory_;
+    std::vector<int64_t> gather_;
+    std::vector<int64_t *> free_frames_;
+    std::unique_ptr<AsyncIO> io_;
+    int64_t slot_elements_;
+    std::vector<int64_t *> free_slots_;
+    std::deque<QueuedWrite> queued_writes_;
+    std::deque<PendingWrite> queue_;
+    int64_t in_flight_ = 0;
+    int64_t writes_ = 0;
+    bool stop_ = false;
+    std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable frame_returned_;
+    std::thread writer_;
+};
+
+#endif
@@ -8,6 +8,7 @@
 #include <iostream>
 #include <limits>
 #include <queue>
+#include <storage.h>
 #include <string>
 #include <vector>
 
@@ -16,10 +17,13 @@
  * @param filename Name of the file to read.
  * @param start_block Index of the first block to read.
  * @param num_blocks_to_read Number of blocks to read.
+ * @param backend Backend holding the file.
  * @return Vector with integers read from the blocks.
  */
-std::vector<int64_t>
-read_multiple_blocks(const std::string &filename, int64_t start_block, int64_t num_blocks_to_read);
+std::vector<int64_t> read_multiple_blocks(
+    const std::string &filename, int64_t start_block, int64_t num_blocks_to_read,
+    StorageBackend &backend = storage()
+);
 
 /**
  * @brief Writes a block of data to a binary file.
@@ -51,18 +55,26 @@ void remove_directory(const std::string &dir);
  * @brief Copies a file from source to destination.
  * @param src Path of the source file.
  * @param dst Path of the destination file.
+ * @param src_backend Backend holding src.
+ * @param dst_backend Backend where dst is created.
  */
-void copy_file(const std::string &src, const std::string &dst);
+void copy_file(
+    const std::string &src, const std::string &dst, StorageBackend &src_backend = storage(),
+    StorageBackend &dst_backend = storage()
+);
 
 /**
  * @brief Performs a k-way merge of multiple sorted files.
  * @param input_files Vector with paths of input files.
  * @param output_file Path of the merged output file.
  * @param arity The maximum number of files to merge at once.
+ * @param backend Backend holding the input and output files.
  * @return Total number of I/O operations performed.
  */
-int64_t
-k_way_merge(const std::vector<std::string> &input_files, const std::string &output_file, int64_t arity);
+int64_t k_way_merge(
+    const std::vector<std::string> &input_files, const std::string &output_file, int64_t arity,
+    StorageBackend &backend
+);
 
 /**
  * @brief Implements the External Merge Sort algorithm with configurable arity.
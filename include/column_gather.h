@@ -0,0 +1,102 @@
+#ifndef COLUMN_GATHER_H
+#define COLUMN_GATHER_H
+
+#include <cstdint>
+#include <external_sorter.h>
+#include <memory>
+#include <sort_keys.h>
+#include <storage.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A column of fixed-width rows to reorder by an argsort permutation.
+ * @param input File whose row i belongs to the key at position i of the sorted input.
+ * @param width Bytes per row.
+ * @param output File the reordered rows are written to.
+ */
+struct GatherColumn {
+    std::string input;
+    int64_t width = 0;
+    std::string output;
+};
+
+/** parse_gather_columns
+ * @brief Parses a comma separated list of input:width:output.
+ * @warning Exits with error if an entry is malformed.
+ */
+std::vector<GatherColumn> parse_gather_columns(const std::string &spec);
+
+/**
+ * @brief Applies a permutation to column files: row i of each output is row positions[i]
+ * of its input.
+ * @details Positions are buffered batch_rows at a time. A batch is sorted by position, so
+ * each column is read front to back: rows less than GATHER_GAP_BYTES apart share one read
+ * of up to GATHER_READ_BYTES. The rows are then copied to their place in the batch and
+ * written with a single sequential write. The larger the batch, the denser its positions
+ * and the fewer the reads.
+ * @warning Not thread-safe. Errors come back as SortStatus, as in ExternalSorter.
+ */
+class ColumnGather {
+  public:
+    /**
+     * @brief Opens the inputs and creates the outputs, in backend.
+     */
+    ColumnGather(
+        const std::vector<GatherColumn> &columns, int64_t batch_rows, StorageBackend &backend = storage()
+    );
+
+    /** add
+     * @brief Appends count positions of the permutation.
+     */
+    SortStatus add(const uint64_t *positions, int64_t count);
+
+    /** finish
+     * @brief Gathers the last batch and closes the outputs.
+     */
+    SortStatus finish();
+
+    /** rows
+     * @brief Rows written to each output so far.
+     */
+    int64_t rows() const;
+
+    /** io_operations
+     * @brief Blocks read and written plus one per read request.
+     */
+    int64_t io_operations() const;
+
+    /** status
+     * @brief First error found, OK if none.
+     */
+    const SortStatus &status() const;
+
+  private:
+    /**
+     * @brief An open input column and its output.
+     */
+    struct Column {
+        GatherColumn spec;
+        std::unique_ptr<StorageFile> input;
+        int64_t input_rows = 0;
+        std::unique_ptr<StorageFile> output;
+    };
+
+    SortStatus fail(SortStatus::Code code, const std::string &message);
+    void gather_batch();
+    bool gather_column(Column &column);
+
+    std::vector<Column> columns_;
+    int64_t batch_rows_;
+    std::vector<uint64_t> pending_;
+    // Position in the high half, slot in the batch in the low one
+    std::vector<uint128_t> order_;
+    std::vector<char> rows_;
+    std::vector<char> read_buffer_;
+    int64_t rows_written_ = 0;
+    int64_t io_operations_ = 0;
+    bool finished_ = false;
+    SortStatus status_;
+};
+
+#endif
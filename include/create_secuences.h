@@ -13,11 +13,89 @@
 #include <vector>
 
 /**
- * @brief Calls the random_vector_int64() and write_vector_to_file() functions
+ * @brief Distribution of the generated values.
+ * @details UNIFORM covers the whole int64_t range, NEARLY_SORTED is SORTED with 1% random
+ * values, FEW_UNIQUE uses 16 distinct values and ZIPF draws from 10^6 values with skew 1.1.
+ */
+enum class Distribution { UNIFORM, SORTED, REVERSE_SORTED, NEARLY_SORTED, FEW_UNIQUE, ZIPF, ALL_EQUAL };
+
+/**
+ * @brief Parameters of a generated sequence.
+ * @param distribution Distribution of the values.
+ * @param seed Seed of the counter-based generator, same seed gives the same file.
+ * @param threads Worker threads filling chunks, 0 uses every hardware thread.
+ */
+struct SequenceConfig {
+    Distribution distribution = Distribution::UNIFORM;
+    uint64_t seed = 1;
+    int64_t threads = 0;
+};
+
+/**
+ * @brief Splittable counter-based PRNG.
+ * @details The i-th value of a stream is a hash of (seed, stream, i), so any stream can be
+ * evaluated at any position without sharing state between threads.
+ */
+struct CounterRng {
+    uint64_t key;
+    uint64_t counter = 0;
+
+    CounterRng(uint64_t seed, uint64_t stream);
+
+    /** at
+     * @brief i-th value of the stream.
+     */
+    uint64_t at(uint64_t i) const;
+
+    /** next
+     * @brief Next value of the stream.
+     */
+    uint64_t next() {
+        return at(counter++);
+    }
+};
+
+/** parse_distribution
+ * @brief Parses a distribution name (uniform, sorted, reverse, nearly_sorted, few_unique,
+ * zipf, all_equal).
+ * @warning If the name is unknown, the program exits with error
+ */
+Distribution parse_distribution(const std::string &name);
+
+/** sequence_value
+ * @brief Value at position index of a sequence of n elements.
+ * @details Pure function of (config, index, n), used by the file generator and any
+ * on-the-fly source that must reproduce the same sequence.
+ */
+int64_t sequence_value(const SequenceConfig &config, int64_t index, int64_t n);
+
+/** fill_sequence
+ * @brief Writes positions [first, first + count) of a sequence of n elements into out.
+ */
+void fill_sequence(const SequenceConfig &config, int64_t first, int64_t count, int64_t n, int64_t *out);
+
+/** generate_sequence_file
+ * @brief Writes a sequence of n elements to filename.
+ * @details The file is preallocated, chunks are filled in parallel and written with large
+ * sequential writes.
+ * @warning If the file can't be opened, the program exits with error
+ */
+void generate_sequence_file(const std::string &filename, int64_t n, const SequenceConfig &config);
+
+/**
+ * @brief Creates n_secuences files of m_mult * M bytes each with the given config
+ * @details Sequence j uses seed config.seed + j
+ * @param m_mult Size multiplier for M
+ * @param n_secuences Number of sequences to create
+ * @param config Distribution, seed and threads of the generator
+ */
+void create_and_write_M(int64_t m_mult, int64_t n_secuences, const SequenceConfig &config);
+
+/**
+ * @brief Creates n_secuences uniform random files of m_mult * M bytes each
  * @param m_mult Size multiplier for M
  * @param n_secuences Number of sequences to create
  * @returns void
- * @note The for loop ends after m_mult*BLOCKS_PER_M iterations
  */
 void create_and_write_M(int64_t m_mult, int64_t n_secuences);
 
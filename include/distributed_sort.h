@@ -0,0 +1,68 @@
+#ifndef DISTRIBUTED_SORT_H
+#define DISTRIBUTED_SORT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Outcome of one worker of distributed_sort.
+ * @param elements Number of int64_t in its output shard.
+ * @param sent_bytes Bytes it sent to the other workers.
+ * @param io_operations I/O of the local sort of its key range.
+ * @param exchange_seconds Time spent partitioning its input shard and exchanging buckets.
+ * @param sort_seconds Time spent sorting its key range.
+ */
+struct WorkerReport {
+    int64_t elements = 0;
+    int64_t sent_bytes = 0;
+    int64_t io_operations = 0;
+    double exchange_seconds = 0;
+    double sort_seconds = 0;
+};
+
+/**
+ * @brief Outcome of distributed_sort.
+ * @param output_shards Output shard of every worker, in key order.
+ * @param workers Report of every worker.
+ * @param seconds Wall-clock time from sampling to the last worker finishing.
+ */
+struct DistributedSortResult {
+    std::vector<std::string> output_shards;
+    std::vector<WorkerReport> workers;
+    double seconds = 0;
+};
+
+/** distributed_sort
+ * @brief Sample-partitioned sort by worker processes on the same machine, each one standing
+ * in for a node.
+ * @details The coordinator samples the whole input with select_pivots and broadcasts
+ * workers-1 splitters. Worker w reads its shard (the w-th contiguous slice of the input),
+ * classifies it with a SplitterTree and streams every bucket to the worker owning that key
+ * range over a Unix socket, while its receiver threads append what the others send to its
+ * range file. Then it sorts the range file with external_mergesort or external_quicksort
+ * into output_prefix_w.bin. Concatenating the shards in order gives the sorted input.
+ *
+ * Workers are forked, so the storage backend must be a real file system (file or mmap).
+ * Each one has the memory of a whole node, spills to worker_w inside every spill directory
+ * and logs to output_prefix_w.log.
+ * @param input_file Path of the input file.
+ * @param output_prefix Prefix of the output shards.
+ * @param workers Number of worker processes.
+ * @param arity Arity of the local sorts.
+ * @param algorithm "mergesort" or "quicksort".
+ * @warning Exits with error if a worker fails.
+ */
+DistributedSortResult distributed_sort(
+    const std::string &input_file, const std::string &output_prefix, int64_t workers, int64_t arity,
+    const std::string &algorithm
+);
+
+/** verify_distributed_output
+ * @brief Checks that every shard is sorted, that each shard starts at or above the end of
+ * the previous one, and that together they hold the values of input_file.
+ * @return true if all checks pass.
+ */
+bool verify_distributed_output(const std::string &input_file, const std::vector<std::string> &output_shards);
+
+#endif
@@ -4,8 +4,12 @@
 #include <algorithm>
 #include <cstdint>
 #include <fstream>
+#include <input_source.h>
 #include <iostream>
+#include <memory>
 #include <queue>
+#include <spill_storage.h>
+#include <storage.h>
 #include <string>
 #include <vector>
 
@@ -24,15 +28,136 @@ struct HeapNode {
     }
 };
 
+/** merge_buffer_bytes
+ * @brief Largest buffer per file of a k-way merge, 512KB unless set_merge_buffer_bytes was
+ * called.
+ */
+int64_t merge_buffer_bytes();
+
+/** set_merge_buffer_bytes
+ * @brief Replaces the largest buffer per file of a k-way merge (at least one block), for
+ * devices whose requests pay off at another size.
+ */
+void set_merge_buffer_bytes(int64_t bytes);
+
+/** merge_blocks_per_buffer
+ * @brief Number of blocks each input (and the output) buffer holds during a k-way merge.
+ * @details 90% of memory_limit() split among the buffers, at most merge_buffer_bytes() each.
+ * @param actual_arity Number of input buffers, the files merged at once (twice that plus
+ * one when reading ahead).
+ * @return Blocks per buffer, at least 1.
+ */
+int64_t merge_blocks_per_buffer(int64_t actual_arity);
+
+/** merge_fan_in
+ * @brief Number of files merged at once with the current budget.
+ * @param arity Requested merge arity.
+ * @return arity, lowered while memory elasticity is enabled so each buffer keeps at least
+ * 64KB, and at least 2.
+ */
+int64_t merge_fan_in(int64_t arity);
+
+/** initial_run_blocks
+ * @brief Number of blocks sorted in memory for each Phase 1 run.
+ * @return Blocks per initial run, at least 1.
+ */
+int64_t initial_run_blocks();
+
 /** k_way_merge
  * @brief Performs a k-way merge of multiple sorted files.
+ * @details The heap only orders the heads of the inputs: the input with the smallest head
+ * gives out, in one copy, everything up to the next smallest head, found by galloping.
+ * With an aggregation mode (see set_aggregation) the inputs and the output hold its records
+ * and equal keys are collapsed on the way out.
  * @param input_files Vector with paths of input files.
  * @param output_file Path of the merged output file.
  * @param arity The maximum number of files to merge at once.
+ * @param backend Backend holding the input and output files.
  * @return Total number of I/O operations performed.
  */
-int64_t
-k_way_merge(const std::vector<std::string> &input_files, const std::string &output_file, int64_t arity);
+int64_t k_way_merge(
+    const std::vector<std::string> &input_files, const std::string &output_file, int64_t arity,
+    StorageBackend &backend
+);
+
+/** form_runs
+ * @brief Phase 1: cuts the input into memory-sized chunks, sorts each one and writes it
+ * as a run file in spill.
+ * @details With an aggregation mode each run is collapsed before it is written.
+ * @param input Source of the data to sort.
+ * @param spill Backend where the run files are created.
+ * @param run_files Names of the created runs are appended here, in input order.
+ * @return Number of I/O operations performed.
+ */
+int64_t form_runs(InputSource &input, StorageBackend &spill, std::vector<std::string> &run_files);
+
+/** form_natural_runs
+ * @brief Phase 1 by replacement selection: streams the input through a memory-sized heap
+ * and extends the current run while the incoming values are not smaller than the last
+ * one written.
+ * @details Random input gives runs of about twice the memory, input with existing
+ * ascending order gives runs much longer than the memory (a single run if it is sorted).
+ * @param input Source of the data to sort.
+ * @param spill Backend where the run files are created.
+ * @param run_files Names of the created runs are appended here.
+ * @return Number of I/O operations performed.
+ */
+int64_t form_natural_runs(InputSource &input, StorageBackend &spill, std::vector<std::string> &run_files);
+
+/** merge_run_files
+ * @brief Phase 2: merges sorted run files, arity at a time, until one remains and copies
+ * it to output_file. Without runs output_file is created empty.
+ * @param run_files Sorted runs in spill, they are removed as they get merged.
+ * @param spill Backend holding the runs and the intermediate runs.
+ * @param output_file Path of the sorted output file, in the current storage backend.
+ * @param arity Merge arity (number of files to merge simultaneously).
+ * @param keep_runs If true, run_files are left in spill (for RunCache); only the runs made
+ * by the merge are removed.
+ * @return Number of I/O operations performed.
+ */
+int64_t merge_run_files(
+    std::vector<std::string> run_files, StorageBackend &spill, const std::string &output_file,
+    int64_t arity, bool keep_runs = false
+);
+
+/**
+ * @brief Phase 1 runs of a file formed once and merged many times, for experiments that
+ * only change Phase 2 (the arity), since the runs don't depend on it.
+ * @details The runs live in their own spill and are only read by the merges.
+ */
+class RunCache {
+  public:
+    /**
+     * @brief Forms the runs of input_file with form_runs.
+     */
+    explicit RunCache(const std::string &input_file);
+    ~RunCache();
+
+    RunCache(const RunCache &) = delete;
+    RunCache &operator=(const RunCache &) = delete;
+
+    /** merge
+     * @brief Merges the cached runs into output_file, like Phase 2 of external_mergesort.
+     * @return I/O operations of the whole sort: those of Phase 1, measured once, plus those
+     * of this merge, the same total external_mergesort returns.
+     */
+    int64_t merge(const std::string &output_file, int64_t arity);
+
+    /** phase1_io
+     * @brief I/O operations spent forming the runs.
+     */
+    int64_t phase1_io() const;
+
+    /** runs
+     * @brief Names of the runs in their spill, in input order.
+     */
+    const std::vector<std::string> &runs() const;
+
+  private:
+    std::unique_ptr<SpillStorage> spill_;
+    std::vector<std::string> runs_;
+    int64_t phase1_io_ = 0;
+};
 
 /** external_mergesort
  * @brief Implements the External Merge Sort algorithm with configurable arity.
@@ -43,4 +168,13 @@ k_way_merge(const std::vector<std::string> &input_files, const std::string &outp
  */
 int64_t external_mergesort(const std::string &input_file, const std::string &output_file, int64_t arity);
 
+/** external_mergesort
+ * @brief External Merge Sort whose Phase 1 pulls the data from an InputSource.
+ * @param input Source of the data to sort, a file or a generated stream.
+ * @param output_file Path of the sorted output file.
+ * @param arity Merge arity (number of files to merge simultaneously).
+ * @return Total number of I/O operations performed.
+ */
+int64_t external_mergesort(InputSource &input, const std::string &output_file, int64_t arity);
+
 #endif
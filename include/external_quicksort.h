@@ -1,9 +1,82 @@
 #ifndef EXTERNAL_QUICKSORT_H
 #define EXTERNAL_QUICKSORT_H
 
+#include <cstdint>
+#include <input_source.h>
+#include <storage.h>
 #include <string>
 #include <vector>
 
+/**
+ * @PIVOT_SAMPLE_BLOCKS: Blocks sampled by select_pivots unless a partition is resampled.
+ */
+const int64_t PIVOT_SAMPLE_BLOCKS = 10;
+
+/** quicksort_read_buffer_bytes
+ * @brief Size of the read buffer used while partitioning a file.
+ * @return Bytes read from the input per I/O.
+ */
+int64_t quicksort_read_buffer_bytes();
+
+/** quicksort_frame_elements
+ * @brief Size of each frame of the partition block pool.
+ * @return Number of int64_t per frame, the largest write of a partition.
+ */
+int64_t quicksort_frame_elements();
+
+/** quicksort_pool_frames
+ * @brief Number of frames in the partition block pool (70% of the memory).
+ */
+int64_t quicksort_pool_frames();
+
+/** quicksort_partition_buffer_elements
+ * @brief Expected size of each partition write when the input splits evenly.
+ * @param arity Number of partitions sharing the memory.
+ * @return Number of int64_t per write.
+ */
+int64_t quicksort_partition_buffer_elements(int64_t arity);
+
+/** quicksort_level_arity
+ * @brief Number of partitions of a level with the current budget: arity, lowered while
+ * memory elasticity is enabled so each partition keeps 4 frames of the pool, at least 2.
+ */
+int64_t quicksort_level_arity(int64_t arity);
+
+/** quicksort_partitioning_bytes
+ * @brief Memory held while a file is partitioned: read buffer, block pool and gather buffer.
+ */
+int64_t quicksort_partitioning_bytes();
+
+/** set_quicksort_threads
+ * @brief Number of threads external_quicksort sorts partitions with, 0 uses every core.
+ */
+void set_quicksort_threads(int64_t threads);
+
+/** quicksort_in_memory_threshold
+ * @brief Largest file size (in bytes) that is sorted directly in memory.
+ */
+int64_t quicksort_in_memory_threshold();
+
+/** select_pivots
+ * @brief Samples up to sample_blocks blocks of the input and picks arity-1 evenly spaced pivots.
+ * @param input_file Path to the input binary file
+ * @param arity Number of partitions to create (a-way partitioning)
+ * @param sample_blocks Maximum number of blocks sampled
+ * @return Vector of arity-1 sorted pivot values
+ */
+std::vector<int64_t>
+select_pivots(const std::string &input_file, int64_t arity, int64_t sample_blocks = PIVOT_SAMPLE_BLOCKS);
+
+/** select_pivots
+ * @brief Pivot selection over any InputSource with random access
+ * @param input Source to sample, its stream position is not changed
+ * @param arity Number of partitions to create (a-way partitioning)
+ * @param sample_blocks Maximum number of blocks sampled
+ * @return Vector of arity-1 sorted pivot values, repeated if the sample is skewed
+ */
+std::vector<int64_t>
+select_pivots(InputSource &input, int64_t arity, int64_t sample_blocks = PIVOT_SAMPLE_BLOCKS);
+
 /** external_quicksort
  * @brief Implements the External Quick Sort algorithm with configurable arity.
  * @param input_file Path of the input file to sort.
@@ -13,18 +86,48 @@
  */
 int64_t external_quicksort(const std::string &input_file, const std::string &output_file, int64_t arity);
 
+/** external_quicksort
+ * @brief External Quick Sort whose first pass pulls from an InputSource.
+ * @param input Source of the data, a file or a sequence generated on the fly.
+ * @param output_file Path of the sorted output file.
+ * @param arity Partitioning arity (number of partitions to create).
+ * @return Total number of I/O operations performed.
+ */
+int64_t external_quicksort(InputSource &input, const std::string &output_file, int64_t arity);
+
 /** recursive_external_quicksort
  * @brief Recursive function that implements the External Quicksort algorithm
- * @param input_file File to sort
- * @param output_file File where the sorted result will be saved
+ * @details Partitions are never concatenated: every sorted leaf is written straight to
+ * its final byte offset in output.
+ * @param input_file File of spill to sort
+ * @param output Final output file, already sized to hold the whole sorted input
+ * @param output_offset Byte offset in output where the sorted input_file belongs
+ * @param arity Number of partitions to create
+ * @param spill Backend holding the partition files
+ * @param depth Recursion depth (for naming temporary files)
+ * @param sample_blocks Blocks sampled to choose the pivots, more when a skewed partition
+ * is split again
+ * @return Number of I/O operations performed
+ */
+int64_t recursive_external_quicksort(
+    const std::string &input_file, StorageFile &output, int64_t output_offset, int64_t arity,
+    StorageBackend &spill, int64_t depth, int64_t sample_blocks = PIVOT_SAMPLE_BLOCKS
+);
+
+/** recursive_external_quicksort
+ * @brief Recursive external quicksort whose first pass pulls from an InputSource
+ * @param input Source of the data to sort, partitions of deeper levels are files
+ * @param output Final output file, already sized to hold the whole sorted input
+ * @param output_offset Byte offset in output where the sorted input belongs
  * @param arity Number of partitions to create
- * @param temp_dir Directory for temporary files
+ * @param spill Backend holding the partition files
  * @param depth Recursion depth (for naming temporary files)
+ * @param sample_blocks Blocks sampled to choose the pivots
  * @return Number of I/O operations performed
  */
 int64_t recursive_external_quicksort(
-    const std::string &input_file, const std::string &output_file, int64_t arity,
-    const std::string &temp_dir, int64_t depth
+    InputSource &input, StorageFile &output, int64_t output_offset, int64_t arity, StorageBackend &spill,
+    int64_t depth, int64_t sample_blocks = PIVOT_SAMPLE_BLOCKS
 );
 
-#endif
\ No newline at end of file
+#endif
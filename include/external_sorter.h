@@ -0,0 +1,200 @@
+#ifndef EXTERNAL_SORTER_H
+#define EXTERNAL_SORTER_H
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <sort_keys.h>
+#include <spill_storage.h>
+#include <storage.h>
+#include <string>
+#include <task_scheduler.h>
+#include <vector>
+
+/**
+ * @brief Result of an ExternalSorter or SortedStream call.
+ * @details INVALID_ARGUMENT and INVALID_STATE are mistakes of the caller, IO_ERROR means the
+ * spill storage failed or filled up. Once an IO_ERROR is returned every later call
+ * returns it too.
+ */
+struct SortStatus {
+    enum Code { OK, INVALID_ARGUMENT, INVALID_STATE, IO_ERROR };
+
+    Code code = OK;
+    std::string message;
+
+    bool ok() const {
+        return code == OK;
+    }
+};
+
+/**
+ * @brief Settings of an ExternalSorter.
+ * @param memory_bytes Memory for the values buffered before a run is spilled, and for the
+ * merge buffers later.
+ * @param arity Most runs merged at once. Runs beyond it are merged in extra passes
+ * before the final merge.
+ * @param block_bytes Size of a disk block: merge buffers are whole blocks and I/O is
+ * counted in blocks.
+ * @param threads Threads sorting each buffer before it is spilled, 0 uses every core.
+ * @param backend Backend holding the spill files, storage() if null.
+ * @param spill Spill directories and placement.
+ * @param spill_name Name of the spill file created in every spill directory.
+ * @param log Progress messages are written here, nothing is printed if null.
+ */
+struct SorterConfig {
+    int64_t memory_bytes = 40 * 1024 * 1024;
+    int64_t arity = 64;
+    int64_t block_bytes = 4096;
+    int64_t threads = 1;
+    StorageBackend *backend = nullptr;
+    SpillConfig spill = spill_config();
+    std::string spill_name = "temp_sorter";
+    std::ostream *log = nullptr;
+};
+
+template <typename Key> class BasicExternalSorter;
+
+/**
+ * @brief Sorted output of a BasicExternalSorter, pulled in order without writing it anywhere.
+ * @details The last merge runs as the stream is read: each call merges just the values it
+ * returns. Runs are removed from the spill as soon as they are consumed.
+ */
+template <typename Key> class BasicSortedStream {
+  public:
+    /** read
+     * @brief Stores the next values of the sorted output in buffer.
+     * @return Number of values stored, 0 at the end, -1 on error (see status()).
+     */
+    int64_t read(Key *buffer, int64_t max_elements);
+
+    /** next
+     * @brief Reads a single value.
+     * @return false at the end or on error.
+     */
+    bool next(Key &value);
+
+    /** size
+     * @brief Total number of values in the output.
+     */
+    int64_t size() const;
+
+    /** remaining
+     * @brief Number of values not read yet.
+     */
+    int64_t remaining() const;
+
+    /** status
+     * @brief OK unless a read of the spilled runs failed.
+     */
+    const SortStatus &status() const;
+
+    /** io_operations
+     * @brief Blocks read and refills of the merge so far, counted like the mergesort.
+     */
+    int64_t io_operations() const;
+
+  private:
+    friend class BasicExternalSorter<Key>;
+    using Bits = typename KeyTraits<Key>::Bits;
+
+    /**
+     * @brief A sorted run being merged: a file of the spill, or values kept in memory.
+     */
+    struct Run {
+        std::string name;
+        std::unique_ptr<StorageFile> file;
+        int64_t file_bytes = 0;
+        int64_t read_bytes = 0;
+        std::vector<Bits> buffer;
+        size_t position = 0;
+    };
+
+    BasicSortedStream(std::shared_ptr<SpillStorage> spill, int64_t buffer_bytes, int64_t block_bytes);
+    bool add_run(const std::string &name);
+    void add_memory_run(std::vector<Bits> values);
+    bool refill(Run &run);
+    int64_t read_bits(Bits *buffer, int64_t max_elements);
+
+    std::shared_ptr<SpillStorage> spill_;
+    int64_t buffer_elements_;
+    int64_t block_bytes_;
+    std::vector<Run> runs_;
+    std::vector<std::pair<Bits, int64_t>> heap_;
+    int64_t size_ = 0;
+    int64_t remaining_ = 0;
+    int64_t io_operations_ = 0;
+    SortStatus status_;
+};
+
+/**
+ * @brief External sort embeddable in other programs: values are pushed with add() and the
+ * sorted output is pulled from the stream finish() returns.
+ * @tparam Key int32_t, int64_t, uint32_t, uint64_t, float or double, or Indexed<> of one of
+ * them for an argsort. Keys are kept as their KeyTraits bits, so 32-bit keys use half the
+ * memory and I/O of 64-bit ones, and buffers are sorted with the radix_sort of their width.
+ * Indexed keys take 128 bits and come out ordered by key, equal keys by position.
+ * @details Values are buffered up to memory_bytes; each full buffer is sorted and spilled
+ * as a run. If nothing was spilled the output is served from memory. Otherwise runs are
+ * merged arity at a time until at most arity are left, and those are merged while the
+ * output is read, so the sorted data is never written as a whole. The last buffer stays
+ * in memory when it fits next to the merge buffers. Nothing is printed unless a log is
+ * configured, and errors come back as SortStatus instead of ending the program.
+ * @warning Not thread-safe: one thread adds, finishes and reads.
+ */
+template <typename Key> class BasicExternalSorter {
+  public:
+    explicit BasicExternalSorter(const SorterConfig &config = SorterConfig());
+
+    /** add
+     * @brief Adds count values to sort.
+     */
+    SortStatus add(const Key *values, int64_t count);
+
+    /** add
+     * @brief Adds every value of values.
+     */
+    SortStatus add(const std::vector<Key> &values);
+
+    /** finish
+     * @brief Ends the input and hands the sorted output to output.
+     * @details The stream keeps the spill alive, it may outlive the sorter.
+     */
+    SortStatus finish(std::unique_ptr<BasicSortedStream<Key>> &output);
+
+    /** status
+     * @brief First error found, OK if none.
+     */
+    const SortStatus &status() const;
+
+    /** io_operations
+     * @brief Blocks written and read before the final merge, counted like the mergesort.
+     */
+    int64_t io_operations() const;
+
+  private:
+    using Bits = typename KeyTraits<Key>::Bits;
+
+    SortStatus fail(SortStatus::Code code, const std::string &message);
+    void sort_buffer();
+    bool spill_run(const std::vector<Bits> &values);
+    bool merge_runs(const std::vector<std::string> &runs, const std::string &merged, int64_t buffer_bytes);
+    int64_t merge_buffer_bytes(int64_t runs, int64_t memory_bytes) const;
+
+    SorterConfig config_;
+    StorageBackend &backend_;
+    std::shared_ptr<SpillStorage> spill_;
+    std::unique_ptr<TaskScheduler> scheduler_;
+    std::vector<Bits> buffer_;
+    std::vector<std::string> runs_;
+    int64_t next_run_ = 0;
+    int64_t io_operations_ = 0;
+    bool finished_ = false;
+    SortStatus status_;
+};
+
+using SortedStream = BasicSortedStream<int64_t>;
+using ExternalSorter = BasicExternalSorter<int64_t>;
+using ArgSorter = BasicExternalSorter<Indexed<int64_t>>;
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef INPUT_SOURCE_H
+#define INPUT_SOURCE_H
+
+#include <condition_variable>
+#include <create_secuences.h>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <storage.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Sequential stream of int64_t that the first pass of a sort pulls from.
+ * @details Lets the sorts consume a materialized file or data generated on the fly
+ * through the same interface.
+ */
+class InputSource {
+  public:
+    virtual ~InputSource() = default;
+
+    /** read
+     * @brief Reads the next elements of the stream.
+     * @return Number of elements stored in buffer, 0 at the end of the stream.
+     */
+    virtual int64_t read(int64_t *buffer, int64_t max_elements) = 0;
+
+    /** read_at
+     * @brief Reads count elements starting at position index, without moving the stream.
+     * @return Number of elements read, -1 if the source can't be accessed randomly.
+     */
+    virtual int64_t read_at(int64_t index, int64_t *buffer, int64_t count) = 0;
+
+    /** size
+     * @brief Total number of elements, -1 if unknown.
+     */
+    virtual int64_t size() const = 0;
+
+    /** rewind
+     * @brief Moves the stream back to its first element.
+     */
+    virtual void rewind() = 0;
+
+    /** reads_storage
+     * @brief true if pulling from the source costs storage I/O.
+     */
+    virtual bool reads_storage() const = 0;
+
+    /** name
+     * @brief Description used in logs.
+     */
+    virtual std::string name() const = 0;
+};
+
+/**
+ * @brief InputSource over a file of a storage backend, the current one by default.
+ * @warning If the file can't be opened, the program exits with error
+ */
+class FileInputSource : public InputSource {
+  public:
+    explicit FileInputSource(const std::string &path, StorageBackend &backend = storage());
+
+    int64_t read(int64_t *buffer, int64_t max_elements) override;
+    int64_t read_at(int64_t index, int64_t *buffer, int64_t count) override;
+    int64_t size() const override;
+    void rewind() override;
+    bool reads_storage() const override;
+    std::string name() const override;
+
+  private:
+    std::string path_;
+    std::unique_ptr<StorageFile> file_;
+    int64_t size_;
+    int64_t position_ = 0;
+};
+
+/**
+ * @brief Deterministic sequence generated on the fly, never written to storage.
+ * @details Produces exactly the values generate_sequence_file would write for the same
+ * config and length.
+ */
+class GeneratedInputSource : public InputSource {
+  public:
+    GeneratedInputSource(const SequenceConfig &config, int64_t n);
+
+    int64_t read(int64_t *buffer, int64_t max_elements) override;
+    int64_t read_at(int64_t index, int64_t *buffer, int64_t count) override;
+    int64_t size() const override;
+    void rewind() override;
+    bool reads_storage() const override;
+    std::string name() const override;
+
+  private:
+    SequenceConfig config_;
+    int64_t n_;
+    int64_t position_ = 0;
+};
+
+/**
+ * @brief Stream of int64_t read from a pipe or any file descriptor that can't seek.
+ * @details Its size is unknown. A reader thread fills chunks ahead of the consumer, so
+ * reading the descriptor overlaps with whatever the sort does with the previous chunks.
+ * read_values() gives the raw values of other widths (32-bit keys) to callers that
+ * decode them. If the stream ends in the middle of a value or the descriptor fails, the
+ * reads return 0 and error() describes it.
+ * @warning It can only be read once: rewind() exits with error.
+ */
+class PipeInputSource : public InputSource {
+  public:
+    /**
+     * @param fd Descriptor to read, not closed by the source.
+     * @param chunk_bytes Bytes of each chunk the reader thread fills.
+     * @param chunks_ahead Most chunks read and not consumed yet.
+     * @param value_bytes Size of a value of the stream, 8 for int64_t.
+     */
+    explicit PipeInputSource(
+        int fd, int64_t chunk_bytes = 1024 * 1024, int64_t chunks_ahead = 4, int64_t value_bytes = 8
+    );
+    ~PipeInputSource() override;
+
+    int64_t read(int64_t *buffer, int64_t max_elements) override;
+    int64_t read_at(int64_t index, int64_t *buffer, int64_t count) override;
+    int64_t size() const override;
+    void rewind() override;
+    bool reads_storage() const override;
+    std::string name() const override;
+
+    /** read_values
+     * @brief Copies the next values, of value_bytes each, into buffer.
+     * @return Number of values stored, 0 at the end of the stream.
+     */
+    int64_t read_values(void *buffer, int64_t max_values);
+
+    /** error
+     * @brief Description of a read error or a truncated value, empty if none.
+     */
+    std::string error();
+
+    /** elements_read
+     * @brief Number of values consumed so far.
+     */
+    int64_t elements_read() const;
+
+  private:
+    void reader_loop();
+
+    int fd_;
+    int64_t value_bytes_;
+    int64_t chunk_bytes_;
+    int64_t chunks_ahead_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable space_;
+    std::deque<std::vector<char>> chunks_;
+    std::vector<char> current_;
+    size_t position_ = 0;
+    int64_t elements_read_ = 0;
+    bool done_ = false;
+    bool stop_ = false;
+    std::string error_;
+    std::thread reader_;
+};
+
+/** read_full
+ * @brief Reads from input until count elements are stored or the stream ends.
+ * @return Number of elements stored in buffer.
+ */
+int64_t read_full(InputSource &input, int64_t *buffer, int64_t count);
+
+/**
+ * @brief Order-independent digest of a multiset of int64_t.
+ * @details Two streams with the same values in any order have the same fingerprint.
+ */
+struct Fingerprint {
+    int64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t mixed_sum = 0;
+
+    void add(int64_t value);
+
+    /** add
+     * @brief Adds times copies of value at once.
+     */
+    void add(int64_t value, int64_t times);
+
+    bool operator==(const Fingerprint &other) const {
+        return count == other.count && sum == other.sum && mixed_sum == other.mixed_sum;
+    }
+};
+
+/** fingerprint_source
+ * @brief Fingerprints every element of input and rewinds it.
+ */
+Fingerprint fingerprint_source(InputSource &input);
+
+/** verify_sorted_output
+ * @brief Checks that path is in non-decreasing order and has the expected fingerprint.
+ * @return true if both checks pass.
+ */
+bool verify_sorted_output(const std::string &path, const Fingerprint &expected);
+
+#endif
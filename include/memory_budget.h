@@ -0,0 +1,190 @@
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * @brief Global limit on the bytes that concurrent tasks may hold at once.
+ * @details A task acquires the memory it will allocate before allocating it and releases
+ * it when done; acquire blocks while the budget is exhausted. A task must never wait for
+ * other tasks while holding memory, or the admission can deadlock.
+ */
+class MemoryBudget {
+  public:
+    /**
+     * @param total_bytes Bytes available to all tasks together.
+     */
+    explicit MemoryBudget(int64_t total_bytes);
+
+    /** acquire
+     * @brief Blocks until bytes are available and takes them.
+     * @details A request larger than the whole budget waits for the budget to be empty
+     * and then takes all of it.
+     * @return Bytes actually taken, to be passed to release.
+     */
+    int64_t acquire(int64_t bytes);
+
+    /** release
+     * @brief Gives back bytes taken with acquire.
+     */
+    void release(int64_t bytes);
+
+    /** reserve
+     * @brief Takes bytes without waiting.
+     * @details For buffers sized from the budget, which never ask for more than is free
+     * unless the sizing is wrong.
+     * @param what Name of the buffer, for the error message.
+     * @warning Exits with error if fewer than bytes are free.
+     */
+    void reserve(int64_t bytes, const std::string &what);
+
+    /** resize
+     * @brief Changes the size of the budget, for the boundaries between runs, passes or
+     * levels of a sort.
+     * @details Memory already held stays held; while it is over the new size, acquire waits
+     * and reserve fails until it is given back.
+     */
+    void resize(int64_t total_bytes);
+
+    /** total
+     * @brief Size of the budget in bytes.
+     */
+    int64_t total() const;
+
+    /** in_use
+     * @brief Bytes currently held.
+     */
+    int64_t in_use();
+
+    /** peak
+     * @brief Largest number of bytes held at once.
+     */
+    int64_t peak();
+
+    /** reset_peak
+     * @brief Sets the peak back to the bytes currently held, to measure one sort.
+     */
+    void reset_peak();
+
+  private:
+    int64_t total_;
+    int64_t in_use_ = 0;
+    int64_t peak_ = 0;
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+};
+
+/**
+ * @brief Memory taken from a MemoryBudget for the lifetime of the object.
+ * @details With a null budget nothing is reserved, so code can run without admission.
+ */
+class MemoryLease {
+  public:
+    MemoryLease(MemoryBudget *budget, int64_t bytes);
+    ~MemoryLease();
+
+    MemoryLease(const MemoryLease &) = delete;
+    MemoryLease &operator=(const MemoryLease &) = delete;
+
+  private:
+    MemoryBudget *budget_;
+    int64_t bytes_;
+};
+
+/**
+ * @brief Buffer memory reserved from a MemoryBudget for the lifetime of the object.
+ * @details Unlike MemoryLease it never waits: asking for more than is free is an error.
+ */
+class MemoryReservation {
+  public:
+    MemoryReservation(int64_t bytes, const std::string &what, MemoryBudget &budget);
+    ~MemoryReservation();
+
+    MemoryReservation(const MemoryReservation &) = delete;
+    MemoryReservation &operator=(const MemoryReservation &) = delete;
+
+  private:
+    MemoryBudget &budget_;
+    int64_t bytes_;
+};
+
+/** memory_budget
+ * @brief Budget the buffers of the sorts are leased from, of default_memory_limit() bytes
+ * unless set_memory_limit was called.
+ */
+MemoryBudget &memory_budget();
+
+/** set_memory_limit
+ * @brief Replaces the budget of the sorts with one of bytes bytes.
+ * @warning Exits with error if memory is leased from the current one.
+ */
+void set_memory_limit(int64_t bytes);
+
+/** memory_limit
+ * @brief Size in bytes of the budget of the sorts, what adapt_memory_limit left it at.
+ */
+int64_t memory_limit();
+
+/**
+ * @brief Signals that resize the budget of the sorts while they run.
+ * @param enabled Adapt the budget at all; off by default so experiments are repeatable.
+ * @param control_file File holding the MB the sorts may use, read at every boundary and
+ * ignored while it is missing or empty.
+ * @param psi_threshold Percentage of the last 10 seconds stalled on memory ("some avg10" of
+ * the cgroup's memory.pressure or /proc/pressure/memory) above which the budget halves.
+ */
+struct MemoryElasticity {
+    bool enabled = false;
+    std::string control_file;
+    double psi_threshold = 10;
+};
+
+/** memory_elasticity
+ * @brief Elasticity settings of the sorts, disabled unless others were set.
+ */
+const MemoryElasticity &memory_elasticity();
+
+/** set_memory_elasticity
+ * @brief Replaces the elasticity settings of the sorts.
+ */
+void set_memory_elasticity(const MemoryElasticity &elasticity);
+
+/** adapt_memory_limit
+ * @brief Resizes the budget of the sorts from the memory signals; the sorts call it before
+ * each initial run, merge group and partitioning level, and size those from memory_limit().
+ * @details The budget shrinks to the room left under the cgroup's memory.high or memory.max
+ * (counting the working set, not the reclaimable page cache), to the control file, and to
+ * half while memory pressure is over the threshold. It grows back at most doubling per
+ * call, never above the limit set with set_memory_limit (or the default) nor below
+ * MIN_ELASTIC_BYTES. Every change is logged. Does nothing while elasticity is disabled.
+ * @return The budget in bytes after the call.
+ */
+int64_t adapt_memory_limit();
+
+/** cgroup_memory_limit
+ * @brief Memory limit of the cgroup the process runs in (v2 memory.max or v1
+ * memory.limit_in_bytes), -1 if there is none.
+ */
+int64_t cgroup_memory_limit();
+
+/** default_memory_limit
+ * @brief Budget used when none is set: DEFAULT_MEMORY_BYTES, lowered to CGROUP_MEMORY_SHARE
+ * of the cgroup limit inside a smaller container so the sorts aren't OOM killed.
+ */
+int64_t default_memory_limit();
+
+/** peak_rss_bytes
+ * @brief Largest resident set size of the process so far, -1 if unknown.
+ */
+int64_t peak_rss_bytes();
+
+/** memory_summary
+ * @brief One line with the budget, the peak leased from it and the peak RSS, for the
+ * sorts' logs.
+ */
+std::string memory_summary();
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef SHARDED_OUTPUT_H
+#define SHARDED_OUTPUT_H
+
+#include <cstdint>
+#include <input_source.h>
+#include <memory>
+#include <mutex>
+#include <storage.h>
+#include <string>
+#include <vector>
+
+/** output_shards
+ * @brief Number of files the sorts split their output in, 1 (a single output_file) unless
+ * set_output_shards was called.
+ */
+int64_t output_shards();
+
+/** set_output_shards
+ * @brief Makes external_mergesort and external_quicksort write shards shards and a
+ * manifest instead of output_file.
+ * @warning Exits with error if shards is less than 1.
+ */
+void set_output_shards(int64_t shards);
+
+/** shard_path
+ * @brief Path of shard shard of output_file: output_file.shard.
+ */
+std::string shard_path(const std::string &output_file, int64_t shard);
+
+/** shard_manifest_path
+ * @brief Path of the manifest of output_file: output_file.manifest.
+ */
+std::string shard_manifest_path(const std::string &output_file);
+
+/**
+ * @brief Sorted output split in files of contiguous, non-overlapping key ranges, in the
+ * current storage backend.
+ * @details The manifest gets one CSV line per shard (shard,path,elements,first_key,last_key)
+ * as soon as that shard is complete, in the order they complete, so a consumer can start on
+ * a shard once its line is there. Empty shards have no keys.
+ */
+class ShardedOutput {
+  public:
+    /**
+     * @brief Creates the shard files and the manifest with its header.
+     * @warning Exits with error if a file can't be created.
+     */
+    ShardedOutput(const std::string &output_file, int64_t shards);
+
+    ShardedOutput(const ShardedOutput &) = delete;
+    ShardedOutput &operator=(const ShardedOutput &) = delete;
+
+    /** shards
+     * @brief Number of shards.
+     */
+    int64_t shards() const;
+
+    /** file
+     * @brief Open file of shard shard, until it is finished.
+     */
+    StorageFile &file(int64_t shard);
+
+    /** finish
+     * @brief Closes shard shard and appends its line to the manifest. Thread-safe.
+     */
+    void finish(int64_t shard);
+
+  private:
+    std::string output_file_;
+    std::vector<std::unique_ptr<StorageFile>> files_;
+    std::unique_ptr<StorageFile> manifest_;
+    int64_t manifest_size_ = 0;
+    std::mutex mutex_;
+};
+
+/**
+ * @brief Splits a sorted stream of total_elements values into the shards of a ShardedOutput.
+ * @details Shard i ends after (i+1)*total/shards values, moved forward to the next change of
+ * key so equal keys never straddle two shards. A key repeated over several shards' worth of
+ * values leaves the shards it covers empty.
+ */
+class ShardWriter {
+  public:
+    ShardWriter(ShardedOutput &output, int64_t total_elements);
+
+    /** write
+     * @brief Appends count sorted values, none smaller than the ones already written.
+     */
+    void write(const int64_t *values, int64_t count);
+
+    /** finish
+     * @brief Finishes the shard being written and every shard after it.
+     */
+    void finish();
+
+  private:
+    /** next_shard
+     * @brief Finishes the current shard and moves on, skipping shards whose end was passed.
+     */
+    void next_shard();
+
+    ShardedOutput &output_;
+    int64_t total_elements_;
+    int64_t shard_ = 0;
+    int64_t shard_elements_ = 0;
+    int64_t written_ = 0;
+    int64_t last_value_ = 0;
+};
+
+/** verify_sharded_output
+ * @brief Checks that the manifest lists every shard, that each shard is sorted and starts
+ * above the end of the previous one, and that together they have the expected fingerprint.
+ * @return true if all checks pass.
+ */
+bool verify_sharded_output(const std::string &output_file, int64_t shards, const Fingerprint &expected);
+
+/** remove_sharded_output
+ * @brief Removes the shards and the manifest of output_file.
+ */
+void remove_sharded_output(const std::string &output_file, int64_t shards);
+
+#endif
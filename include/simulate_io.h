@@ -0,0 +1,58 @@
+#ifndef SIMULATE_IO_H
+#define SIMULATE_IO_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * @brief I/O counters produced by a dry run of one of the external sorts.
+ * @details total_io uses the same metric returned by the real sorts
+ * (blocks read + blocks written + seeks), so both can be compared directly.
+ */
+struct SimulatedIO {
+    int64_t blocks_read = 0;
+    int64_t blocks_written = 0;
+    int64_t seeks = 0;
+    int64_t passes = 0;
+    int64_t levels = 0;
+    int64_t total_io = 0;
+};
+
+/** simulate_external_mergesort
+ * @brief Replays the Phase 1/Phase 2 control flow of external_mergesort without touching data.
+ * @param file_size Size in bytes of the input file.
+ * @param arity Merge arity (number of files to merge simultaneously).
+ * @return Exact block, seek and pass counts of the real sort.
+ */
+SimulatedIO simulate_external_mergesort(int64_t file_size, int64_t arity);
+
+/** simulate_external_quicksort
+ * @brief Analytic model of external_quicksort assuming the pivots split evenly.
+ * @param file_size Size in bytes of the input file.
+ * @param arity Partitioning arity (number of partitions to create).
+ * @return Estimated block counts and number of partition levels.
+ */
+SimulatedIO simulate_external_quicksort(int64_t file_size, int64_t arity);
+
+/** simulated_arity_sweep
+ * @brief Simulates external_mergesort for every arity in [min_arity, max_arity].
+ * @param file_size Size in bytes of the input file.
+ * @param min_arity Minimum arity to test.
+ * @param max_arity Maximum arity to test.
+ * @param results_path CSV file where one row per arity is written.
+ * @return The arity with the lowest simulated I/O count.
+ */
+int64_t simulated_arity_sweep(
+    int64_t file_size, int64_t min_arity, int64_t max_arity, const std::string &results_path
+);
+
+/** validate_mergesort_model
+ * @brief Runs the real external_mergesort at a few arities and compares it with the simulation.
+ * @param input_file Path of the input file to sort.
+ * @param arities Arities to validate.
+ * @return Number of arities where the simulated and the measured I/O differ.
+ */
+int64_t validate_mergesort_model(const std::string &input_file, const std::vector<int64_t> &arities);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef SORT_KEYS_H
+#define SORT_KEYS_H
+
+#include <cstdint>
+#include <cstring>
+#include <task_scheduler.h>
+
+/**
+ * @brief Order-preserving transform of a key type into unsigned bits of the same width.
+ * @details encode maps keys to Bits so that comparing the Bits as unsigned integers gives
+ * the order of the keys, and decode inverts it exactly. The sorts work on the Bits: the
+ * same radix and classification kernels serve every key type of a width, and 32-bit keys
+ * are stored, spilled and merged in 32 bits.
+ *
+ * Floating point keys follow the IEEE 754 totalOrder: -NaN < -inf < ... < -0.0 < +0.0 < ...
+ * < +inf < +NaN, so NaNs sort at the ends instead of breaking the order and both zeros
+ * keep their sign.
+ */
+template <typename Key> struct KeyTraits;
+
+/**
+ * @brief Signed integers: flipping the sign bit moves the negatives below the positives.
+ */
+template <typename Key, typename UnsignedBits> struct SignedKeyTraits {
+    using Bits = UnsignedBits;
+    static constexpr Bits SIGN = Bits(1) << (sizeof(Bits) * 8 - 1);
+
+    static Bits encode(Key key) {
+        return Bits(key) ^ SIGN;
+    }
+    static Key decode(Bits bits) {
+        return Key(bits ^ SIGN);
+    }
+};
+
+/**
+ * @brief Unsigned integers are already in order.
+ */
+template <typename Key> struct UnsignedKeyTraits {
+    using Bits = Key;
+
+    static Bits encode(Key key) {
+        return key;
+    }
+    static Key decode(Bits bits) {
+        return bits;
+    }
+};
+
+/**
+ * @brief Floating point: positives get the sign bit set, negatives are inverted so a larger
+ * magnitude sorts lower.
+ */
+template <typename Key, typename UnsignedBits> struct FloatKeyTraits {
+    using Bits = UnsignedBits;
+    static constexpr Bits SIGN = Bits(1) << (sizeof(Bits) * 8 - 1);
+
+    static Bits encode(Key key) {
+        Bits bits;
+        std::memcpy(&bits, &key, sizeof(bits));
+        return (bits & SIGN) ? ~bits : bits | SIGN;
+    }
+    static Key decode(Bits bits) {
+        bits = (bits & SIGN) ? bits & ~SIGN : ~bits;
+        Key key;
+        std::memcpy(&key, &bits, sizeof(key));
+        return key;
+    }
+};
+
+template <> struct KeyTraits<int32_t> : SignedKeyTraits<int32_t, uint32_t> {};
+template <> struct KeyTraits<int64_t> : SignedKeyTraits<int64_t, uint64_t> {};
+template <> struct KeyTraits<uint32_t> : UnsignedKeyTraits<uint32_t> {};
+template <> struct KeyTraits<uint64_t> : UnsignedKeyTraits<uint64_t> {};
+template <> struct KeyTraits<float> : FloatKeyTraits<float, uint32_t> {};
+template <> struct KeyTraits<double> : FloatKeyTraits<double, uint64_t> {};
+
+/**
+ * @brief Unsigned 128-bit integer (GCC/Clang extension), the bits of an Indexed key.
+ */
+using uint128_t = unsigned __int128;
+
+/**
+ * @brief A key with its position in the input, the record of an argsort.
+ */
+template <typename Key> struct Indexed {
+    Key key;
+    uint64_t position;
+};
+
+/**
+ * @brief Indexed keys: the key's bits in the high half, the position in the low 64 bits.
+ * @details Positions are unique, so sorting the bits orders equal keys by position: any sort
+ * of them is stable. Narrow keys go to the top bits so radix_sort starts on them.
+ */
+template <typename Key> struct KeyTraits<Indexed<Key>> {
+    using Bits = uint128_t;
+    static constexpr int KEY_SHIFT = 128 - sizeof(typename KeyTraits<Key>::Bits) * 8;
+
+    static Bits encode(Indexed<Key> value) {
+        return (Bits(KeyTraits<Key>::encode(value.key)) << KEY_SHIFT) | value.position;
+    }
+    static Indexed<Key> decode(Bits bits) {
+        using KeyBits = typename KeyTraits<Key>::Bits;
+        return {KeyTraits<Key>::decode(KeyBits(bits >> KEY_SHIFT)), uint64_t(bits)};
+    }
+};
+
+/** radix_sort
+ * @brief In-place MSD radix sort (American flag sort) of unsigned keys, one byte per level.
+ * @details Instantiated for uint32_t (at most 4 levels), uint64_t (at most 8) and the
+ * uint128_t of Indexed keys (at most 16, the last 8 order equal keys by position). A level
+ * where every key has the same byte is skipped, and small buckets fall back to std::sort.
+ * With a scheduler the large buckets of each level are sorted as parallel tasks.
+ */
+template <typename Bits> void radix_sort(Bits *data, int64_t n, TaskScheduler *scheduler = nullptr);
+
+#endif
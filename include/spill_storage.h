@@ -0,0 +1,218 @@
+#ifndef SPILL_STORAGE_H
+#define SPILL_STORAGE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <storage.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A directory the sorts may spill to, usually one per disk or tmpfs.
+ * @param path Directory of the spill file, created if missing.
+ * @param capacity_bytes Most bytes spilled there at once, 0 for no limit.
+ * @param weight Share of the temporary data it gets relative to the other directories.
+ */
+struct SpillDirectory {
+    std::string path;
+    int64_t capacity_bytes = 0;
+    int64_t weight = 1;
+};
+
+/**
+ * @brief How a new run or partition picks its directory.
+ * @details ROUND_ROBIN cycles through the directories in proportion to their weights,
+ * FREE_SPACE takes the one with the most free space per unit of weight.
+ */
+enum class SpillPlacement { ROUND_ROBIN, FREE_SPACE };
+
+/**
+ * @brief Directories and placement policy used by the sorts' SpillStorage.
+ */
+struct SpillConfig {
+    std::vector<SpillDirectory> directories{{".", 0, 1}};
+    SpillPlacement placement = SpillPlacement::ROUND_ROBIN;
+};
+
+/** spill_config
+ * @brief Spill configuration of the sorts, the current directory unless another one was set.
+ */
+const SpillConfig &spill_config();
+
+/** set_spill_config
+ * @brief Replaces the spill configuration of the sorts.
+ */
+void set_spill_config(const SpillConfig &config);
+
+/** parse_spill_directories
+ * @brief Parses a comma separated list of path[:capacity_mb[:weight]].
+ * @warning Exits with error if an entry is malformed.
+ */
+std::vector<SpillDirectory> parse_spill_directories(const std::string &spec);
+
+/** parse_spill_placement
+ * @brief Parses a placement name: "round_robin" or "free_space".
+ * @warning Exits with error if the name is unknown.
+ */
+SpillPlacement parse_spill_placement(const std::string &name);
+
+/**
+ * @brief Contiguous byte range of the spill file of one directory.
+ */
+struct SpillExtent {
+    int64_t device;
+    int64_t offset;
+    int64_t bytes;
+};
+
+/**
+ * @brief A file of SpillStorage: the extents holding it, in order, and its logical size.
+ */
+struct SpillFileData {
+    std::vector<SpillExtent> extents;
+    int64_t capacity = 0;
+    int64_t size = 0;
+};
+
+/**
+ * @brief Temporary files of a sort stored as extents of one file per spill directory.
+ * @details Runs and partitions are named like regular files, but creating, growing and
+ * removing them only updates an in-memory extent table: each spill file is opened once,
+ * preallocated, and unlinked when the SpillStorage is destroyed. Freed extents are merged
+ * with their free neighbours and reused, so the spill files stay close to the peak amount
+ * of live temporary data. A file opened for reading is taken as complete and gives back
+ * the capacity past its size. Directories are implicit, like in MemoryStorage.
+ *
+ * A file is placed in one directory by the placement policy and stays there unless that
+ * directory fills up, so the runs and partitions written or read together are spread
+ * over the devices.
+ */
+class SpillStorage : public StorageBackend {
+  public:
+    /**
+     * @param backing Backend holding the spill files.
+     * @param name Name of the spill file created in every directory, .spill is appended.
+     * @param expected_bytes Bytes preallocated up front (split by weight), usually the
+     * size of the input.
+     * @param config Directories and placement policy.
+     * @param exit_on_error If false, errors are kept in error() instead of ending the
+     * program: a failed constructor leaves ok() false, and writes past the space left come
+     * back short.
+     * @warning By default, if a spill file can't be created or every directory is full,
+     * the program exits with error
+     */
+    SpillStorage(
+        StorageBackend &backing, const std::string &name, int64_t expected_bytes = 0,
+        const SpillConfig &config = spill_config(), bool exit_on_error = true
+    );
+    ~SpillStorage() override;
+
+    std::unique_ptr<StorageFile> open(const std::string &path, StorageMode mode) override;
+    int64_t file_size(const std::string &path) override;
+    bool remove(const std::string &path) override;
+    void create_directories(const std::string &dir) override;
+    void remove_directory(const std::string &dir) override;
+    std::string name() const override;
+
+    /** ok
+     * @brief false once an error was recorded (only when not exiting on errors).
+     */
+    bool ok();
+
+    /** error
+     * @brief Description of the first error recorded, empty if none.
+     */
+    std::string error();
+
+    /** devices
+     * @brief Number of spill directories.
+     */
+    int64_t devices() const;
+
+    /** peak_bytes
+     * @brief Largest number of bytes held by extents at the same time.
+     */
+    int64_t peak_bytes();
+
+    /** device_peak_bytes
+     * @brief Largest number of bytes held at the same time by extents of one directory.
+     */
+    int64_t device_peak_bytes(int64_t device);
+
+    /** file_bytes
+     * @brief Current size of the spill files, including the free extents.
+     */
+    int64_t file_bytes();
+
+    /** extents_allocated
+     * @brief Number of extents handed out so far, growing an extent in place doesn't count.
+     */
+    int64_t extents_allocated();
+
+    /** summary
+     * @brief One line with the peak of spilled data and how it was split among the
+     * directories, for the sorts' logs.
+     */
+    std::string summary();
+
+  private:
+    friend class SpillFile;
+
+    /**
+     * @brief Spill file of one directory and its allocation state.
+     */
+    struct Device {
+        SpillDirectory directory;
+        std::string path;
+        std::unique_ptr<StorageFile> file;
+        std::map<int64_t, int64_t> free;
+        int64_t end = 0;
+        int64_t file_capacity = 0;
+        int64_t in_use = 0;
+        int64_t peak = 0;
+        int64_t credit = 0;
+    };
+
+    /**
+     * @brief Part of a request that falls in one extent.
+     */
+    struct Slice {
+        int64_t device;
+        int64_t physical;
+        int64_t bytes;
+        int64_t buffer_offset;
+    };
+
+    // Called by SpillFile, they take mutex_
+    std::vector<Slice> map_read(SpillFileData &file, int64_t offset, int64_t bytes);
+    std::vector<Slice> map_write(SpillFileData &file, int64_t offset, int64_t bytes);
+    int64_t size_of(SpillFileData &file);
+    void resize_file(SpillFileData &file, int64_t bytes);
+    void reserve_file(SpillFileData &file, int64_t bytes);
+
+    // Expect mutex_ to be held
+    void grow(SpillFileData &file, int64_t capacity);
+    bool extend_last(SpillFileData &file, int64_t want, SpillExtent &extent);
+    bool allocate(int64_t device, int64_t want, SpillExtent &extent);
+    int64_t place(int64_t want);
+    void release(SpillFileData &file);
+    void trim(SpillFileData &file);
+    void free_extent(const SpillExtent &extent);
+    void fail(const std::string &message);
+    std::vector<Slice> slices(const SpillFileData &file, int64_t offset, int64_t bytes);
+
+    StorageBackend &backing_;
+    SpillPlacement placement_;
+    std::vector<Device> devices_;
+    std::mutex mutex_;
+    std::map<std::string, std::shared_ptr<SpillFileData>> files_;
+    bool exit_on_error_;
+    std::string error_;
+    int64_t in_use_ = 0;
+    int64_t peak_ = 0;
+    int64_t extents_ = 0;
+};
+
+#endif
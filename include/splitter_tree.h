@@ -0,0 +1,70 @@
+#ifndef SPLITTER_TREE_H
+#define SPLITTER_TREE_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Classifies values into the buckets delimited by a sorted set of pivots.
+ * @details The pivots are stored as an implicit binary search tree in Eytzinger (BFS)
+ * order, padded to a power of two. Each level is walked with a comparison turned into
+ * an index update instead of a branch, and classify walks several values at once so the
+ * loads of independent values overlap.
+ *
+ * Repeated pivots are kept once in the tree, and each repeated value gets an equality
+ * bucket holding only the values equal to it. Buckets are numbered in key order, so
+ * concatenating them in order gives sorted output. Without repeated pivots bucket i holds
+ * the values v with pivots[i-1] <= v < pivots[i], the same buckets upper_bound gives.
+ * @tparam Value int64_t, or the uint32_t/uint64_t/uint128_t bits of KeyTraits: each width
+ * gets its own tree walk, with twice the pivots per cache line at 32 bits.
+ */
+template <typename Value> class BasicSplitterTree {
+  public:
+    /**
+     * @param pivots Sorted pivots, may be empty (every value goes to bucket 0) and may
+     * contain repeated values.
+     */
+    explicit BasicSplitterTree(const std::vector<Value> &pivots);
+
+    /** num_buckets
+     * @brief Distinct pivots + 1 + number of equality buckets, at most pivots.size() + 1.
+     */
+    int64_t num_buckets() const;
+
+    /** is_equality_bucket
+     * @brief true if every value of bucket holds the same key.
+     */
+    bool is_equality_bucket(int64_t bucket) const;
+
+    /** equality_key
+     * @brief The key held by an equality bucket.
+     */
+    Value equality_key(int64_t bucket) const;
+
+    /** bucket_of
+     * @brief Bucket of a single value.
+     */
+    int64_t bucket_of(Value value) const;
+
+    /** classify
+     * @brief Stores in buckets[i] the bucket of values[i] for i in [0, n).
+     */
+    void classify(const Value *values, int64_t n, uint32_t *buckets) const;
+
+  private:
+    int64_t levels_;
+    int64_t leaves_;
+    int64_t num_buckets_;
+    std::vector<Value> tree_;
+    // Indexed by tree leaf b (the upper_bound over the distinct pivots): the distinct pivot
+    // just below the leaf, the bucket for values equal to it and the bucket for the rest
+    std::vector<Value> lower_;
+    std::vector<uint32_t> equal_bucket_;
+    std::vector<uint32_t> range_bucket_;
+    std::vector<bool> equality_;
+    std::vector<Value> bucket_key_;
+};
+
+using SplitterTree = BasicSplitterTree<int64_t>;
+
+#endif
@@ -0,0 +1,282 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief How a file is opened by a storage backend.
+ * @details READ fails if the file doesn't exist, WRITE creates or truncates it,
+ * READ_WRITE creates it if missing and keeps its contents otherwise.
+ */
+enum class StorageMode { READ, WRITE, READ_WRITE };
+
+/**
+ * @brief Part of a request that falls in a byte range of a file descriptor.
+ * @param fd Descriptor to read or write.
+ * @param offset Byte offset in fd.
+ * @param bytes Length of the range.
+ * @param buffer_offset Offset of the range in the caller's buffer.
+ */
+struct NativeRange {
+    int fd;
+    int64_t offset;
+    int64_t bytes;
+    int64_t buffer_offset;
+};
+
+/**
+ * @brief An open file of a storage backend, accessed with positioned reads and writes.
+ * @details The file is closed when the object is destroyed.
+ */
+class StorageFile {
+  public:
+    virtual ~StorageFile() = default;
+
+    /** read_at
+     * @brief Reads up to bytes bytes starting at offset.
+     * @return Number of bytes read, 0 at end of file.
+     */
+    virtual int64_t read_at(void *buffer, int64_t bytes, int64_t offset) = 0;
+
+    /** write_at
+     * @brief Writes bytes bytes at offset, growing the file if needed.
+     * @return Number of bytes written, fewer on error; nothing is printed.
+     */
+    virtual int64_t write_at(const void *buffer, int64_t bytes, int64_t offset) = 0;
+
+    /** size
+     * @brief Current size of the file in bytes.
+     */
+    virtual int64_t size() = 0;
+
+    /** resize
+     * @brief Grows or shrinks the file to exactly bytes bytes.
+     * @details On error the file is left as it was, the later writes come short.
+     */
+    virtual void resize(int64_t bytes) = 0;
+
+    /** preallocate
+     * @brief Reserves space for bytes bytes so later writes don't fragment the file.
+     * @details Backends without a cheaper way just resize the file.
+     */
+    virtual void preallocate(int64_t bytes) {
+        if (size() < bytes)
+            resize(bytes);
+    }
+
+    /** native_ranges
+     * @brief Maps a request to the descriptor ranges holding it, so an asynchronous I/O
+     * engine can hand it to the kernel instead of calling read_at or write_at.
+     * @details For a write the file is grown as write_at would. A read past the end of the
+     * file comes back short, like read_at.
+     * @return false if the file isn't accessed through descriptors (memory, mmap or
+     * simulated files).
+     */
+    virtual bool native_ranges(
+        int64_t offset, int64_t bytes, bool write, std::vector<NativeRange> &ranges
+    ) {
+        (void)offset;
+        (void)bytes;
+        (void)write;
+        (void)ranges;
+        return false;
+    }
+};
+
+/**
+ * @brief Storage the external sorts read from and spill to.
+ * @details Every byte the sorts move goes through the backend returned by storage(),
+ * so the same algorithms run over the real file system, RAM or a simulated device.
+ */
+class StorageBackend {
+  public:
+    virtual ~StorageBackend() = default;
+
+    /** open
+     * @brief Opens path with the given mode.
+     * @return The open file, or nullptr if it can't be opened.
+     */
+    virtual std::unique_ptr<StorageFile> open(const std::string &path, StorageMode mode) = 0;
+
+    /** file_size
+     * @brief Size in bytes of path, or -1 if it doesn't exist.
+     */
+    virtual int64_t file_size(const std::string &path) = 0;
+
+    /** remove
+     * @brief Deletes path.
+     * @return true if the file existed and was removed.
+     */
+    virtual bool remove(const std::string &path) = 0;
+
+    /** create_directories
+     * @brief Recursively creates directories in the specified path.
+     */
+    virtual void create_directories(const std::string &dir) = 0;
+
+    /** remove_directory
+     * @brief Recursively removes a directory and its contents.
+     */
+    virtual void remove_directory(const std::string &dir) = 0;
+
+    /** free_bytes
+     * @brief Free space of the device holding dir, -1 if the backend doesn't know.
+     */
+    virtual int64_t free_bytes(const std::string &dir) {
+        (void)dir;
+        return -1;
+    }
+
+    /** name
+     * @brief Short name of the backend, used in logs.
+     */
+    virtual std::string name() const = 0;
+};
+
+/**
+ * @brief Real file system accessed with POSIX pread/pwrite.
+ */
+class FileStorage : public StorageBackend {
+  public:
+    std::unique_ptr<StorageFile> open(const std::string &path, StorageMode mode) override;
+    int64_t file_size(const std::string &path) override;
+    bool remove(const std::string &path) override;
+    void create_directories(const std::string &dir) override;
+    void remove_directory(const std::string &dir) override;
+    int64_t free_bytes(const std::string &dir) override;
+    std::string name() const override;
+};
+
+/**
+ * @brief Real file system accessed through memory mappings.
+ * @details Files opened for writing are grown with ftruncate and remapped, and are
+ * truncated to their logical size when closed.
+ */
+class MmapStorage : public FileStorage {
+  public:
+    std::unique_ptr<StorageFile> open(const std::string &path, StorageMode mode) override;
+    std::string name() const override;
+};
+
+/**
+ * @brief Contents of one file held by MemoryStorage.
+ */
+struct MemoryFileData {
+    std::mutex mutex;
+    std::vector<char> bytes;
+};
+
+/**
+ * @brief Files kept in RAM, for fast CI-sized experiments.
+ * @details Directories are implicit: remove_directory drops every file under the prefix.
+ */
+class MemoryStorage : public StorageBackend {
+  public:
+    std::unique_ptr<StorageFile> open(const std::string &path, StorageMode mode) override;
+    int64_t file_size(const std::string &path) override;
+    bool remove(const std::string &path) override;
+    void create_directories(const std::string &dir) override;
+    void remove_directory(const std::string &dir) override;
+    std::string name() const override;
+
+  protected:
+    std::mutex files_mutex_;
+    std::map<std::string, std::shared_ptr<MemoryFileData>> files_;
+};
+
+/**
+ * @brief Latency and bandwidth parameters of a simulated device.
+ * @param seek_seconds Extra latency of a request that doesn't continue the previous one.
+ * @param request_seconds Fixed latency of every request.
+ * @param bandwidth_bytes Transfer rate in bytes per second, shared by all requests.
+ * @param queue_depth Number of requests the device serves concurrently.
+ */
+struct DeviceProfile {
+    std::string name;
+    double seek_seconds;
+    double request_seconds;
+    double bandwidth_bytes;
+    int64_t queue_depth;
+};
+
+/** device_profile
+ * @brief Predefined profiles: "hdd", "ssd" (SATA) and "nvme".
+ * @warning Exits with error if the name is unknown.
+ */
+DeviceProfile device_profile(const std::string &name);
+
+/**
+ * @brief In-memory files served through a latency-modelled device with a virtual clock.
+ * @details Each request waits for a free queue slot, pays request (and seek) latency and
+ * then its transfer on a bandwidth-shared bus. Every thread issues requests at its own
+ * virtual time, so the clock only advances in parallel when several threads keep
+ * requests in flight.
+ */
+class SimulatedStorage : public MemoryStorage {
+  public:
+    explicit SimulatedStorage(const DeviceProfile &profile);
+
+    std::unique_ptr<StorageFile> open(const std::string &path, StorageMode mode) override;
+    std::string name() const override;
+
+    /** account
+     * @brief Advances the virtual clock for one request on file_id.
+     */
+    void account(int64_t file_id, int64_t offset, int64_t bytes);
+
+    /** elapsed_seconds
+     * @brief Virtual time at which the last request completed.
+     */
+    double elapsed_seconds();
+
+    /** seeks
+     * @brief Number of non-sequential requests served.
+     */
+    int64_t seeks();
+
+    /** reset_clock
+     * @brief Sets the virtual clock and the counters back to zero.
+     */
+    void reset_clock();
+
+    /** profile
+     * @brief Latency and bandwidth the device was created with.
+     */
+    const DeviceProfile &profile() const;
+
+  private:
+    DeviceProfile profile_;
+    std::mutex clock_mutex_;
+    std::vector<double> slot_free_;
+    std::map<std::thread::id, double> thread_clock_;
+    double bus_free_ = 0;
+    double elapsed_ = 0;
+    int64_t last_file_ = -1;
+    int64_t last_end_ = -1;
+    int64_t seeks_ = 0;
+    std::map<std::string, int64_t> file_ids_;
+};
+
+/** storage
+ * @brief Backend used by the sorts, FileStorage unless another one was set.
+ */
+StorageBackend &storage();
+
+/** set_storage_backend
+ * @brief Replaces the backend used by the sorts.
+ */
+void set_storage_backend(std::unique_ptr<StorageBackend> backend);
+
+/** make_storage_backend
+ * @brief Creates a backend by name: "file", "mmap", "memory" or a device profile name.
+ * @warning Exits with error if the name is unknown.
+ */
+std::unique_ptr<StorageBackend> make_storage_backend(const std::string &name);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Set of tasks a caller waits for together.
+ */
+struct TaskGroup {
+    std::atomic<int64_t> pending{0};
+};
+
+/**
+ * @brief Work-stealing pool of worker threads.
+ * @details Each worker owns a deque: tasks it spawns are pushed at the back and it pops
+ * from the back (depth first, good locality), while idle workers steal the oldest tasks
+ * from the front of other deques (big subtrees first). A thread waiting for a group keeps
+ * running tasks meanwhile, so nested spawn/wait never blocks a worker.
+ */
+class TaskScheduler {
+  public:
+    /**
+     * @param num_threads Number of worker threads, 0 uses every hardware thread.
+     */
+    explicit TaskScheduler(int64_t num_threads);
+
+    /**
+     * @brief Stops the workers, every group must have been waited for.
+     */
+    ~TaskScheduler();
+
+    TaskScheduler(const TaskScheduler &) = delete;
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    /** spawn
+     * @brief Queues task as part of group.
+     */
+    void spawn(TaskGroup &group, std::function<void()> task);
+
+    /** wait
+     * @brief Runs queued tasks until every task of group is done.
+     */
+    void wait(TaskGroup &group);
+
+    /** num_threads
+     * @brief Number of worker threads.
+     */
+    int64_t num_threads() const;
+
+  private:
+    struct Task {
+        TaskGroup *group;
+        std::function<void()> run;
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void worker_loop(int64_t index);
+    bool run_one(int64_t index);
+    int64_t queue_index();
+
+    int64_t num_threads_;
+    // One queue per worker plus a last one for the threads outside the pool
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<bool> stop_{false};
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_;
+};
+
+#endif
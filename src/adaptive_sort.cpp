@@ -0,0 +1,288 @@
+#include <adaptive_sort.h>
+#include <aggregation.h>
+#include <algorithm>
+#include <external_mergesort.h>
+#include <external_quicksort.h>
+#include <iostream>
+#include <memory_budget.h>
+#include <sharded_output.h>
+#include <spill_storage.h>
+#include <storage.h>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @BLOCK_SIZE: 4096 bytes. Size of a disk block.
+ * @INTS_PER_BLOCK: 512. Number of int64_t that fit in a block, also the size of a window.
+ * @PRESORT_SAMPLE_WINDOWS: Windows sampled by estimate_presortedness.
+ * @COPY_BUFFER_ELEMENTS: 1MB of int64_t moved per request by the copy plans.
+ * @NATURAL_MAX_DESCENTS, NATURAL_MAX_INVERSIONS: Below both the input is nearly sorted and
+ * replacement selection forms few, long runs.
+ * @QUICKSORT_MIN_DUPLICATES: From this duplicate ratio up, equality buckets finish most of
+ * the input in the first partitioning pass.
+ */
+const int64_t BLOCK_SIZE = 4096;
+const int64_t INTS_PER_BLOCK = BLOCK_SIZE / sizeof(int64_t);
+const int64_t PRESORT_SAMPLE_WINDOWS = 64;
+const int64_t COPY_BUFFER_ELEMENTS = 1024 * 1024 / sizeof(int64_t);
+const double NATURAL_MAX_DESCENTS = 0.05;
+const double NATURAL_MAX_INVERSIONS = 0.1;
+const double QUICKSORT_MIN_DUPLICATES = 0.5;
+
+string sort_plan_name(SortPlan plan) {
+    switch (plan) {
+    case SortPlan::COPY:
+        return "copy";
+    case SortPlan::REVERSE_COPY:
+        return "reverse_copy";
+    case SortPlan::NATURAL_MERGE:
+        return "natural_merge";
+    case SortPlan::MERGESORT:
+        return "mergesort";
+    case SortPlan::QUICKSORT:
+        return "quicksort";
+    }
+    return "unknown";
+}
+
+Presortedness estimate_presortedness(InputSource &input, int64_t &io_operations) {
+    Presortedness stats;
+    int64_t n = input.size();
+    if (n <= 0)
+        return stats;
+
+    int64_t windows = min(PRESORT_SAMPLE_WINDOWS, (n + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK);
+    vector<int64_t> heads;
+    vector<int64_t> sample;
+    int64_t pairs = 0, descents = 0, ascents = 0;
+    vector<int64_t> window(INTS_PER_BLOCK);
+
+    for (int64_t w = 0; w < windows; w++) {
+        int64_t start = windows == 1 ? 0 : (n - INTS_PER_BLOCK) * w / (windows - 1);
+        start = max(int64_t(0), start);
+        int64_t count = input.read_at(start, window.data(), min(INTS_PER_BLOCK, n - start));
+        if (count < 0)
+            return Presortedness();
+        if (input.reads_storage())
+            io_operations++;
+        if (count == 0)
+            continue;
+
+        heads.push_back(window[0]);
+        for (int64_t i = 0; i + 1 < count; i++) {
+            descents += window[i] > window[i + 1];
+            ascents += window[i] < window[i + 1];
+            pairs++;
+        }
+        sample.insert(sample.end(), window.begin(), window.begin() + count);
+    }
+
+    int64_t head_pairs = 0, inversions = 0;
+    for (size_t i = 0; i < heads.size(); i++) {
+        for (size_t j = i + 1; j < heads.size(); j++) {
+            inversions += heads[i] > heads[j];
+            head_pairs++;
+        }
+    }
+
+    sort(sample.begin(), sample.end());
+    int64_t duplicates = 0;
+    for (size_t i = 0; i < sample.size(); i++) {
+        bool equal_prev = i > 0 && sample[i] == sample[i - 1];
+        bool equal_next = i + 1 < sample.size() && sample[i] == sample[i + 1];
+        duplicates += equal_prev || equal_next;
+    }
+
+    stats.sampled_elements = sample.size();
+    stats.windows = heads.size();
+    stats.descent_ratio = pairs ? (double)descents / pairs : 0;
+    stats.ascent_ratio = pairs ? (double)ascents / pairs : 0;
+    stats.duplicate_ratio = sample.empty() ? 0 : (double)duplicates / sample.size();
+    stats.inversion_ratio = head_pairs ? (double)inversions / head_pairs : 0;
+    stats.estimated_run_length = (double)(pairs + stats.windows) / (descents + stats.windows);
+    return stats;
+}
+
+PlanChoice choose_sort_plan(const Presortedness &stats) {
+    PlanChoice choice;
+    choice.stats = stats;
+
+    if (stats.windows == 0) {
+        choice.plan = SortPlan::MERGESORT;
+        choice.reason = "input can't be sampled";
+    } else if (stats.descent_ratio == 0 && stats.inversion_ratio == 0) {
+        choice.plan = SortPlan::COPY;
+        choice.reason = "every sampled window is ascending and in order";
+    } else if (stats.ascent_ratio == 0 && stats.inversion_ratio == 1) {
+        choice.plan = SortPlan::REVERSE_COPY;
+        choice.reason = "every sampled window is descending and in reverse order";
+    } else if (stats.descent_ratio <= NATURAL_MAX_DESCENTS && stats.inversion_ratio <= NATURAL_MAX_INVERSIONS) {
+        choice.plan = SortPlan::NATURAL_MERGE;
+        choice.reason = "nearly sorted, ascending runs of ~" + to_string((int64_t)stats.estimated_run_length) +
+                        " elements: replacement selection forms runs much longer than memory";
+    } else if (stats.duplicate_ratio >= QUICKSORT_MIN_DUPLICATES) {
+        choice.plan = SortPlan::QUICKSORT;
+        choice.reason = to_string((int64_t)(stats.duplicate_ratio * 100)) +
+                        "% of the sample is repeated: equality buckets finish it while partitioning";
+    } else {
+        choice.plan = SortPlan::MERGESORT;
+        choice.reason = "no usable order or repetition";
+    }
+    return choice;
+}
+
+/** copy_in_order
+ * @brief Copies input to output_file, reversed if reverse, checking that the result is
+ * ascending.
+ * @details With an aggregation mode the values are collapsed through a staging buffer on
+ * their way out.
+ * @param io_operations Incremented by the blocks read and written.
+ * @return false as soon as an element out of order is found (output_file is incomplete).
+ */
+static bool copy_in_order(InputSource &input, const string &output_file, bool reverse, int64_t &io_operations) {
+    unique_ptr<StorageFile> output = storage().open(output_file, StorageMode::WRITE);
+    if (!output) {
+        cerr << "Error opening output file: " << output_file << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t n = input.size();
+    const int64_t COPY_BUFFER_BYTES = COPY_BUFFER_ELEMENTS * sizeof(int64_t);
+    const bool collapse = aggregation() != Aggregation::NONE;
+    const int64_t RESERVED_BYTES = COPY_BUFFER_BYTES * (collapse ? 2 : 1);
+    MemoryReservation reservation(RESERVED_BYTES, "copy buffer", memory_budget());
+    vector<int64_t> buffer(COPY_BUFFER_ELEMENTS);
+    bool first = true;
+    int64_t previous = 0;
+    int64_t written = 0;
+    input.rewind();
+
+    // Collapsed records wait in staging until it can't take another pair
+    RecordCollapser collapser;
+    vector<int64_t> staging(collapse ? COPY_BUFFER_ELEMENTS : 0);
+    int64_t staged = 0;
+    int64_t output_offset = 0;
+    auto flush_staging = [&]() {
+        if (staged == 0)
+            return;
+        output->write_at(staging.data(), staged * sizeof(int64_t), output_offset);
+        io_operations += (staged + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+        output_offset += staged * sizeof(int64_t);
+        staged = 0;
+    };
+
+    // The reverse copy reads the input from its end, one buffer at a time
+    while (written < n || (!reverse && n < 0)) {
+        int64_t count;
+        if (reverse) {
+            count = min(COPY_BUFFER_ELEMENTS, n - written);
+            count = input.read_at(n - written - count, buffer.data(), count);
+            std::reverse(buffer.begin(), buffer.begin() + max(int64_t(0), count));
+        } else {
+            count = read_full(input, buffer.data(), COPY_BUFFER_ELEMENTS);
+        }
+        if (count <= 0)
+            break;
+        if (input.reads_storage())
+            io_operations += (count + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+
+        for (int64_t i = 0; i < count; i++) {
+            if (!first && buffer[i] < previous)
+                return false;
+            previous = buffer[i];
+            first = false;
+        }
+        if (!collapse) {
+            output->write_at(buffer.data(), count * sizeof(int64_t), written * sizeof(int64_t));
+            io_operations += (count + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+            written += count;
+            continue;
+        }
+        written += count;
+        for (int64_t i = 0; i < count; i++) {
+            if (staged + 2 > COPY_BUFFER_ELEMENTS)
+                flush_staging();
+            staged += collapser.add(buffer[i], 1, staging.data() + staged);
+        }
+    }
+    if (collapse) {
+        if (staged + 2 > COPY_BUFFER_ELEMENTS)
+            flush_staging();
+        staged += collapser.flush(staging.data() + staged);
+        flush_staging();
+    }
+    return true;
+}
+
+/** natural_merge
+ * @brief Replacement selection runs merged arity at a time.
+ */
+static int64_t natural_merge(InputSource &input, const string &output_file, int64_t arity) {
+    SpillStorage spill(storage(), "temp_natural_" + to_string(arity), input.size() * sizeof(int64_t));
+    vector<string> run_files;
+    input.rewind();
+    int64_t io_operations = form_natural_runs(input, spill, run_files);
+    cout << "  Replacement selection formed " << run_files.size() << " runs" << endl;
+    io_operations += merge_run_files(run_files, spill, output_file, arity);
+    return io_operations;
+}
+
+int64_t adaptive_sort(InputSource &input, const string &output_file, int64_t arity, PlanChoice *choice) {
+    check_aggregation_shards(aggregation(), output_shards());
+    int64_t io_operations = 0;
+    PlanChoice plan = choose_sort_plan(estimate_presortedness(input, io_operations));
+    const Presortedness &stats = plan.stats;
+
+    cout << "  Presortedness of " << input.name() << ": " << stats.windows << " windows, descents "
+         << stats.descent_ratio << ", ascents " << stats.ascent_ratio << ", window inversions "
+         << stats.inversion_ratio << ", duplicates " << stats.duplicate_ratio << endl;
+    cout << "  Plan: " << sort_plan_name(plan.plan) << " (" << plan.reason << ")" << endl;
+
+    // The copy plans write a single file: a sharded output is split by the merge instead,
+    // sorted input still making a single run
+    if (output_shards() > 1 && (plan.plan == SortPlan::COPY || plan.plan == SortPlan::REVERSE_COPY)) {
+        plan.plan = plan.plan == SortPlan::COPY ? SortPlan::NATURAL_MERGE : SortPlan::MERGESORT;
+        plan.reason = "the copy plans can't shard their output";
+        cout << "  Plan: " << sort_plan_name(plan.plan) << " (" << plan.reason << ")" << endl;
+    }
+
+    if (plan.plan == SortPlan::COPY || plan.plan == SortPlan::REVERSE_COPY) {
+        int64_t copy_io = 0;
+        if (copy_in_order(input, output_file, plan.plan == SortPlan::REVERSE_COPY, copy_io)) {
+            io_operations += copy_io;
+        } else {
+            // The sample missed an element out of order: the partial copy is thrown away
+            io_operations += copy_io;
+            storage().remove(output_file);
+            plan.plan = SortPlan::NATURAL_MERGE;
+            plan.reason = "copy found an element out of order, falling back";
+            cout << "  Plan: " << sort_plan_name(plan.plan) << " (" << plan.reason << ")" << endl;
+        }
+    }
+
+    input.rewind();
+    switch (plan.plan) {
+    case SortPlan::COPY:
+    case SortPlan::REVERSE_COPY:
+        break;
+    case SortPlan::NATURAL_MERGE:
+        io_operations += natural_merge(input, output_file, arity);
+        break;
+    case SortPlan::MERGESORT:
+        io_operations += external_mergesort(input, output_file, arity);
+        break;
+    case SortPlan::QUICKSORT:
+        io_operations += external_quicksort(input, output_file, arity);
+        break;
+    }
+
+    if (choice)
+        *choice = plan;
+    return io_operations;
+}
+
+int64_t adaptive_sort(const string &input_file, const string &output_file, int64_t arity, PlanChoice *choice) {
+    FileInputSource input(input_file);
+    return adaptive_sort(input, output_file, arity, choice);
+}
@@ -0,0 +1,120 @@
+#include <aggregation.h>
+#include <algorithm>
+#include <iostream>
+#include <storage.h>
+
+using namespace std;
+
+/**
+ * @VERIFY_BUFFER_ELEMENTS: 1MB of int64_t read per request while verifying (whole pairs).
+ */
+const int64_t VERIFY_BUFFER_ELEMENTS = 1024 * 1024 / sizeof(int64_t);
+
+static Aggregation sorts_aggregation = Aggregation::NONE;
+
+Aggregation aggregation() {
+    return sorts_aggregation;
+}
+
+void set_aggregation(Aggregation mode) {
+    sorts_aggregation = mode;
+}
+
+void check_aggregation_shards(Aggregation mode, int64_t shards) {
+    if (mode != Aggregation::NONE && shards > 1) {
+        cerr << "The sharded output can't be aggregated: " << aggregation_name(mode) << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+Aggregation parse_aggregation(const string &name) {
+    if (name == "none")
+        return Aggregation::NONE;
+    if (name == "distinct")
+        return Aggregation::DISTINCT;
+    if (name == "count")
+        return Aggregation::COUNT;
+    cerr << "Unknown aggregation: " << name << endl;
+    exit(EXIT_FAILURE);
+}
+
+string aggregation_name(Aggregation mode) {
+    switch (mode) {
+    case Aggregation::DISTINCT:
+        return "distinct";
+    case Aggregation::COUNT:
+        return "count";
+    default:
+        return "none";
+    }
+}
+
+int64_t record_elements() {
+    return sorts_aggregation == Aggregation::COUNT ? 2 : 1;
+}
+
+void aggregate_sorted(vector<int64_t> &data, int64_t n) {
+    if (sorts_aggregation == Aggregation::NONE) {
+        data.resize(n);
+        return;
+    }
+    if (sorts_aggregation == Aggregation::DISTINCT) {
+        data.resize(unique(data.begin(), data.begin() + n) - data.begin());
+        return;
+    }
+
+    // The pairs are filled from the end of the 2n values, where they never reach the keys
+    // still to be counted, and then moved to the front
+    data.resize(2 * n);
+    int64_t write = 2 * n;
+    int64_t end = n;
+    while (end > 0) {
+        const int64_t key = data[end - 1];
+        int64_t begin = end - 1;
+        while (begin > 0 && data[begin - 1] == key)
+            begin--;
+        write -= 2;
+        data[write] = key;
+        data[write + 1] = end - begin;
+        end = begin;
+    }
+    copy(data.begin() + write, data.begin() + 2 * n, data.begin());
+    data.resize(2 * n - write);
+}
+
+bool verify_aggregated_output(const string &path, const Fingerprint &expected) {
+    if (storage().file_size(path) < 0) {
+        cerr << "Error opening output file: " << path << endl;
+        return false;
+    }
+    const int64_t stride = record_elements();
+    FileInputSource output(path);
+    Fingerprint fingerprint;
+    vector<int64_t> buffer(VERIFY_BUFFER_ELEMENTS);
+    bool ascending = true;
+    bool first = true;
+    int64_t previous = 0;
+    int64_t keys = 0;
+    int64_t n;
+    while ((n = read_full(output, buffer.data(), buffer.size())) > 0) {
+        for (int64_t i = 0; i + stride <= n; i += stride) {
+            if (!first && buffer[i] <= previous)
+                ascending = false;
+            previous = buffer[i];
+            first = false;
+            keys++;
+            if (stride == 2)
+                fingerprint.add(buffer[i], buffer[i + 1]);
+        }
+    }
+    if (!ascending)
+        cerr << "Output keys are not strictly ascending: " << path << endl;
+    if (stride == 1) {
+        if (keys > expected.count)
+            cerr << "Output has more distinct keys than the input has values: " << path << endl;
+        return ascending && keys <= expected.count;
+    }
+    if (!(fingerprint == expected))
+        cerr << "Output counts don't match the input: " << path << endl;
+    return ascending && fingerprint == expected;
+}
@@ -0,0 +1,505 @@
+#include <algorithm>
+#include <async_io.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// io_uring is used through its raw system calls, so only the kernel headers are needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_IO_URING
+#endif
+#endif
+
+#ifdef ASYNC_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+/**
+ * @MAX_RING_REQUEST_BYTES: 1GB. Longest read or write handed to io_uring at once, a longer
+ * range is submitted again for the rest.
+ */
+const int64_t MAX_RING_REQUEST_BYTES = 1 << 30;
+
+static IOConfig current_io_config;
+
+const IOConfig &io_config() {
+    return current_io_config;
+}
+
+void set_io_config(const IOConfig &config) {
+    current_io_config = config;
+}
+
+IOEngine parse_io_engine(const string &name) {
+    if (name == "sync")
+        return IOEngine::SYNC;
+    if (name == "threads")
+        return IOEngine::THREADS;
+    if (name == "io_uring")
+        return IOEngine::IO_URING;
+    if (name == "auto")
+        return IOEngine::AUTO;
+    cerr << "Unknown I/O engine: " << name << " (use sync, threads, io_uring or auto)" << endl;
+    exit(EXIT_FAILURE);
+}
+
+string io_engine_name(IOEngine engine) {
+    switch (engine) {
+    case IOEngine::SYNC:
+        return "sync";
+    case IOEngine::THREADS:
+        return "threads";
+    case IOEngine::IO_URING:
+        return "io_uring";
+    case IOEngine::AUTO:
+        return "auto";
+    }
+    return "sync";
+}
+
+#ifdef ASYNC_IO_URING
+
+/**
+ * @brief An io_uring instance: the mapped submission and completion rings, plus one slot
+ * per request the ring may hold.
+ * @details Each slot keeps the part of a request it is transferring, so a short transfer
+ * is submitted again for the rest and a ticket completes only with all of its bytes.
+ */
+struct AsyncIO::Ring {
+    /**
+     * @brief A descriptor range in flight.
+     */
+    struct Slot {
+        int64_t ticket;
+        int fd;
+        char *buffer;
+        int64_t bytes;
+        int64_t offset;
+        int64_t done;
+        bool write;
+    };
+
+    int fd = -1;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sq_ring_bytes = 0;
+    size_t cq_ring_bytes = 0;
+    size_t sqes_bytes = 0;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+
+    vector<Slot> slots;
+    vector<int64_t> free_slots;
+    vector<iovec> buffers;
+    bool fixed_buffers = false;
+    bool registration_failed = false;
+
+    ~Ring() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_bytes);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_bytes);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_bytes);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    /** open
+     * @brief Creates the ring and maps it.
+     * @return false if the kernel has no io_uring, refuses it, or lacks the opcodes used.
+     */
+    bool open(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (fd < 0)
+            return false;
+
+        sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_bytes = cq_ring_bytes = max(sq_ring_bytes, cq_ring_bytes);
+        const int PROT = PROT_READ | PROT_WRITE;
+        const int FLAGS = MAP_SHARED | MAP_POPULATE;
+        sq_ring = mmap(nullptr, sq_ring_bytes, PROT, FLAGS, fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring = sq_ring;
+        } else {
+            cq_ring = mmap(nullptr, cq_ring_bytes, PROT, FLAGS, fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED)
+                return false;
+        }
+        sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_bytes, PROT, FLAGS, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+
+        char *sq = static_cast<char *>(sq_ring);
+        char *cq = static_cast<char *>(cq_ring);
+        sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        // The probe itself needs a 5.6 kernel, the same one that added plain READ and WRITE
+        const int OPS = IORING_OP_WRITE + 1;
+        vector<char> probe_memory(sizeof(io_uring_probe) + OPS * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(probe_memory.data());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, OPS) < 0)
+            return false;
+        for (int op : {IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_READ, IORING_OP_WRITE}) {
+            if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+
+        slots.resize(params.sq_entries);
+        for (int64_t i = params.sq_entries - 1; i >= 0; i--) {
+            free_slots.push_back(i);
+        }
+        return true;
+    }
+
+    int64_t in_flight() const {
+        return slots.size() - free_slots.size();
+    }
+
+    /** enter
+     * @brief Submits to_submit entries and waits for min_complete completions.
+     */
+    void enter(unsigned to_submit, unsigned min_complete) {
+        unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+        while (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0) < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                cerr << "Error submitting to io_uring: " << strerror(errno) << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    /** push
+     * @brief Queues the rest of the transfer of slot and submits it.
+     */
+    void push(int64_t slot) {
+        Slot &s = slots[slot];
+        int64_t length = min(s.bytes - s.done, MAX_RING_REQUEST_BYTES);
+        char *address = s.buffer + s.done;
+
+        unsigned tail = *sq_tail;
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = s.write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = s.fd;
+        sqe.off = s.offset + s.done;
+        sqe.addr = reinterpret_cast<uint64_t>(address);
+        sqe.len = length;
+        sqe.user_data = slot;
+        for (size_t b = 0; fixed_buffers && b < buffers.size(); b++) {
+            char *begin = static_cast<char *>(buffers[b].iov_base);
+            if (address >= begin && address + length <= begin + buffers[b].iov_len) {
+                sqe.opcode = s.write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+                sqe.buf_index = b;
+                break;
+            }
+        }
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        enter(1, 0);
+    }
+
+    /** reap
+     * @brief Collects the completions posted so far, waiting for one if block and none is.
+     * @param finished (ticket, bytes) of every slot whose transfer is complete.
+     */
+    void reap(bool block, vector<pair<int64_t, int64_t>> &finished) {
+        unsigned head = *cq_head;
+        if (block && head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            enter(0, 1);
+
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        vector<int64_t> resubmit;
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            int64_t slot = cqe.user_data;
+            Slot &s = slots[slot];
+            if (cqe.res < 0) {
+                cerr << "Error " << (s.write ? "writing" : "reading") << " file descriptor " << s.fd
+                     << " through io_uring: " << strerror(-cqe.res) << endl;
+                exit(EXIT_FAILURE);
+            }
+            s.done += cqe.res;
+            // A read stops at the end of the file, anything else short is retried
+            if (s.done < s.bytes && (cqe.res > 0 || s.write)) {
+                resubmit.push_back(slot);
+            } else {
+                finished.push_back({s.ticket, s.done});
+                free_slots.push_back(slot);
+            }
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        for (int64_t slot : resubmit) {
+            push(slot);
+        }
+    }
+
+    /** register_buffers
+     * @brief Registers buffers as the fixed buffers of the ring, it must be idle.
+     */
+    void register_buffers() {
+        if (fixed_buffers)
+            syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+        unsigned n = buffers.size();
+        long result = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), n);
+        fixed_buffers = result == 0;
+        if (!fixed_buffers) {
+            registration_failed = true;
+            buffers.clear();
+        }
+    }
+};
+
+bool io_uring_available() {
+    static const bool available = [] {
+        AsyncIO::Ring probe;
+        return probe.open(2);
+    }();
+    return available;
+}
+
+#else
+
+/**
+ * @brief Placeholder, this build has no io_uring.
+ */
+struct AsyncIO::Ring {};
+
+bool io_uring_available() {
+    return false;
+}
+
+#endif
+
+AsyncIO::AsyncIO(const IOConfig &config)
+    : engine_(config.engine), queue_depth_(max(int64_t(1), config.queue_depth)) {
+    if (engine_ == IOEngine::AUTO)
+        engine_ = io_uring_available() ? IOEngine::IO_URING : IOEngine::THREADS;
+#ifdef ASYNC_IO_URING
+    if (engine_ == IOEngine::IO_URING) {
+        ring_ = make_unique<Ring>();
+        if (!ring_->open(queue_depth_))
+            ring_.reset();
+    }
+#endif
+    if (engine_ == IOEngine::IO_URING && !ring_)
+        engine_ = IOEngine::THREADS;
+}
+
+AsyncIO::~AsyncIO() {
+    drain();
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    job_ready_.notify_all();
+    for (thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+int64_t AsyncIO::read(StorageFile &file, void *buffer, int64_t bytes, int64_t offset) {
+    return submit(file, static_cast<char *>(buffer), bytes, offset, false);
+}
+
+int64_t AsyncIO::write(StorageFile &file, const void *buffer, int64_t bytes, int64_t offset) {
+    return submit(file, static_cast<char *>(const_cast<void *>(buffer)), bytes, offset, true);
+}
+
+/** submit
+ * @brief Serves a request in place (SYNC), splits it over the ring, or queues it for the
+ * threads.
+ */
+int64_t AsyncIO::submit(StorageFile &file, char *buffer, int64_t bytes, int64_t offset, bool write) {
+    int64_t ticket = next_ticket_++;
+    if (engine_ == IOEngine::SYNC) {
+        int64_t n = write ? file.write_at(buffer, bytes, offset) : file.read_at(buffer, bytes, offset);
+        lock_guard<mutex> lock(mutex_);
+        requests_[ticket] = {0, n};
+        peak_in_flight_ = max(peak_in_flight_, int64_t(1));
+        return ticket;
+    }
+
+#ifdef ASYNC_IO_URING
+    ranges_.clear();
+    if (ring_ && file.native_ranges(offset, bytes, write, ranges_)) {
+        {
+            lock_guard<mutex> lock(mutex_);
+            requests_[ticket] = {(int64_t)ranges_.size(), 0};
+        }
+        for (const NativeRange &range : ranges_) {
+            while (ring_->free_slots.empty()) {
+                reap_ring();
+            }
+            int64_t slot = ring_->free_slots.back();
+            ring_->free_slots.pop_back();
+            ring_->slots[slot] = {
+                ticket, range.fd, buffer + range.buffer_offset, range.bytes, range.offset, 0, write
+            };
+            ring_->push(slot);
+            lock_guard<mutex> lock(mutex_);
+            peak_in_flight_ = max(peak_in_flight_, ring_->in_flight() + thread_in_flight_);
+        }
+        return ticket;
+    }
+#endif
+
+    submit_to_threads({ticket, &file, buffer, bytes, offset, write});
+    return ticket;
+}
+
+void AsyncIO::submit_to_threads(const Job &job) {
+    if (workers_.empty())
+        start_threads();
+    unique_lock<mutex> lock(mutex_);
+    job_done_.wait(lock, [this] { return thread_in_flight_ < queue_depth_; });
+    requests_[job.ticket] = {1, 0};
+    jobs_.push_back(job);
+    thread_in_flight_++;
+    int64_t ring_in_flight = 0;
+#ifdef ASYNC_IO_URING
+    if (ring_)
+        ring_in_flight = ring_->in_flight();
+#endif
+    peak_in_flight_ = max(peak_in_flight_, ring_in_flight + thread_in_flight_);
+    job_ready_.notify_one();
+}
+
+void AsyncIO::start_threads() {
+    for (int64_t i = 0; i < queue_depth_; i++) {
+        workers_.emplace_back(&AsyncIO::worker_loop, this);
+    }
+}
+
+/** worker_loop
+ * @brief Serves queued jobs with read_at/write_at until the AsyncIO is destroyed.
+ */
+void AsyncIO::worker_loop() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        job_ready_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty())
+            return;
+        Job job = jobs_.front();
+        jobs_.pop_front();
+        lock.unlock();
+
+        int64_t n = job.write ? job.file->write_at(job.buffer, job.bytes, job.offset)
+                              : job.file->read_at(job.buffer, job.bytes, job.offset);
+
+        lock.lock();
+        Request &request = requests_[job.ticket];
+        request.bytes += n;
+        request.parts--;
+        thread_in_flight_--;
+        job_done_.notify_all();
+    }
+}
+
+/** reap_ring
+ * @brief Waits for at least one completion of the ring and adds every finished part to
+ * its request.
+ */
+void AsyncIO::reap_ring() {
+#ifdef ASYNC_IO_URING
+    vector<pair<int64_t, int64_t>> finished;
+    ring_->reap(true, finished);
+    lock_guard<mutex> lock(mutex_);
+    for (const pair<int64_t, int64_t> &f : finished) {
+        Request &request = requests_[f.first];
+        request.bytes += f.second;
+        request.parts--;
+    }
+#endif
+}
+
+int64_t AsyncIO::wait(int64_t ticket) {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        auto it = requests_.find(ticket);
+        if (it == requests_.end())
+            return 0;
+        if (it->second.parts == 0) {
+            int64_t bytes = it->second.bytes;
+            requests_.erase(it);
+            return bytes;
+        }
+#ifdef ASYNC_IO_URING
+        if (ring_ && ring_->in_flight() > 0) {
+            lock.unlock();
+            reap_ring();
+            lock.lock();
+            continue;
+        }
+#endif
+        job_done_.wait(lock);
+    }
+}
+
+void AsyncIO::drain() {
+#ifdef ASYNC_IO_URING
+    while (ring_ && ring_->in_flight() > 0) {
+        reap_ring();
+    }
+#endif
+    unique_lock<mutex> lock(mutex_);
+    job_done_.wait(lock, [this] { return thread_in_flight_ == 0; });
+    requests_.clear();
+}
+
+void AsyncIO::register_buffer(void *buffer, int64_t bytes) {
+#ifdef ASYNC_IO_URING
+    if (!ring_ || ring_->registration_failed)
+        return;
+    while (ring_->in_flight() > 0) {
+        reap_ring();
+    }
+    ring_->buffers.push_back({buffer, (size_t)bytes});
+    ring_->register_buffers();
+#else
+    (void)buffer;
+    (void)bytes;
+#endif
+}
+
+IOEngine AsyncIO::engine() const {
+    return engine_;
+}
+
+int64_t AsyncIO::queue_depth() const {
+    return queue_depth_;
+}
+
+int64_t AsyncIO::peak_in_flight() {
+    lock_guard<mutex> lock(mutex_);
+    return peak_in_flight_;
+}
@@ -0,0 +1,248 @@
+#include <algorithm>
+#include <auto_tune.h>
+#include <chrono>
+#include <external_mergesort.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory_budget.h>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+using namespace std;
+
+// auto_tune mide el disco de la carpeta temporal una vez por dispositivo y elige la aridad y
+// los buffers con el mismo modelo de simulate_io, ponderando cada pedido y cada bloque por
+// lo que cuestan en ese disco.
+
+/**
+ * @BLOCK_SIZE: 4096 bytes. Size of a disk block.
+ * @PROBE_BYTES: 32MB. Size of the scratch file of probe_device, larger than any request.
+ * @PROBE_CHUNK_BYTES: 1MB. Request size of the sequential phases of the probe.
+ * @PROBE_READS: 16. Random reads timed per request size.
+ * @PROBE_REQUEST_SIZES: Request sizes of the random reads, 4KB to 1MB.
+ * @MERGE_BUFFER_CANDIDATES: Merge buffer sizes tune_sort tries, 128KB to 4MB.
+ * @MIN_ARITY, MAX_ARITY: 2 and 512. Range of arities tune_sort tries, the same as the
+ * simulated sweep.
+ */
+const int64_t BLOCK_SIZE = 4096;
+const int64_t PROBE_BYTES = 32 * 1024 * 1024;
+const int64_t PROBE_CHUNK_BYTES = 1024 * 1024;
+const int64_t PROBE_READS = 16;
+const vector<int64_t> PROBE_REQUEST_SIZES{4096, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024};
+const vector<int64_t> MERGE_BUFFER_CANDIDATES{
+    128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024
+};
+const int64_t MIN_ARITY = 2;
+const int64_t MAX_ARITY = 512;
+
+string device_id(const string &directory) {
+    struct stat info;
+    if (stat(directory.c_str(), &info) != 0) {
+        cerr << "Can't probe missing directory: " << directory << endl;
+        exit(EXIT_FAILURE);
+    }
+    return to_string(major(info.st_dev)) + ":" + to_string(minor(info.st_dev));
+}
+
+/** drop_cache
+ * @brief Asks the kernel to forget the cached pages of fd, so the next reads hit the device.
+ * @details Only clean pages are dropped, the file must have been synced.
+ */
+static void drop_cache(int fd) {
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+    (void)fd;
+#endif
+}
+
+/** seconds_since
+ * @brief Seconds elapsed since start, never 0 so rates stay finite.
+ */
+static double seconds_since(chrono::steady_clock::time_point start) {
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return max(elapsed.count(), 1e-9);
+}
+
+DeviceProbe probe_device(const string &directory) {
+    DeviceProbe probe;
+    probe.device = device_id(directory);
+    string path = directory + "/.device_probe_" + to_string(getpid()) + ".bin";
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "Error creating probe file: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    vector<char> buffer(PROBE_CHUNK_BYTES);
+    mt19937_64 rng(PROBE_BYTES);
+    for (char &byte : buffer)
+        byte = (char)rng();
+
+    // Sequential write, synced so the time includes reaching the device
+    auto start = chrono::steady_clock::now();
+    for (int64_t offset = 0; offset < PROBE_BYTES; offset += PROBE_CHUNK_BYTES) {
+        if (pwrite(fd, buffer.data(), PROBE_CHUNK_BYTES, offset) != PROBE_CHUNK_BYTES) {
+            cerr << "Error writing probe file: " << path << endl;
+            ::close(fd);
+            unlink(path.c_str());
+            exit(EXIT_FAILURE);
+        }
+    }
+    fsync(fd);
+    probe.write_bandwidth_bytes = PROBE_BYTES / seconds_since(start);
+
+    // Sequential read
+    drop_cache(fd);
+    start = chrono::steady_clock::now();
+    for (int64_t offset = 0; offset < PROBE_BYTES; offset += PROBE_CHUNK_BYTES) {
+        if (pread(fd, buffer.data(), PROBE_CHUNK_BYTES, offset) <= 0)
+            break;
+    }
+    double read_bandwidth = PROBE_BYTES / seconds_since(start);
+
+    // Random reads of each size, at offsets aligned to the size
+    for (int64_t request_bytes : PROBE_REQUEST_SIZES) {
+        drop_cache(fd);
+        uniform_int_distribution<int64_t> slot(0, PROBE_BYTES / request_bytes - 1);
+        start = chrono::steady_clock::now();
+        for (int64_t i = 0; i < PROBE_READS; i++) {
+            if (pread(fd, buffer.data(), request_bytes, slot(rng) * request_bytes) <= 0)
+                break;
+        }
+        probe.random_reads.push_back({request_bytes, seconds_since(start) / PROBE_READS});
+    }
+    ::close(fd);
+    unlink(path.c_str());
+
+    // The fixed cost of a request is what a random read takes beyond its transfer at the
+    // sequential rate. The smallest excess is kept: larger reads add readahead and
+    // fragmentation noise on top.
+    double fixed = numeric_limits<double>::infinity();
+    for (const ProbePoint &point : probe.random_reads) {
+        fixed = min(fixed, point.seconds - point.request_bytes / read_bandwidth);
+    }
+
+    probe.profile = {probe.device, max(0.0, fixed), 0, read_bandwidth, 1};
+    return probe;
+}
+
+DeviceProbe device_probe(const string &directory, const string &cache_path) {
+    string device = device_id(directory);
+    ifstream cache(cache_path);
+    string line;
+    while (getline(cache, line)) {
+        // device,seek_seconds,bandwidth_bytes,write_bandwidth_bytes
+        istringstream fields(line);
+        string cached_device, seek, bandwidth, write_bandwidth;
+        if (getline(fields, cached_device, ',') && cached_device == device && getline(fields, seek, ',')
+            && getline(fields, bandwidth, ',') && getline(fields, write_bandwidth, ',')) {
+            DeviceProbe probe;
+            probe.device = device;
+            probe.profile = {device, stod(seek), 0, stod(bandwidth), 1};
+            probe.write_bandwidth_bytes = stod(write_bandwidth);
+            probe.cached = true;
+            return probe;
+        }
+    }
+    cache.close();
+
+    DeviceProbe probe = probe_device(directory);
+    bool exists = ifstream(cache_path).good();
+    ofstream out(cache_path, ios::app);
+    if (!out) {
+        // Not fatal: the next run measures again
+        cerr << "Can't cache the device probe in " << cache_path << endl;
+        return probe;
+    }
+    if (!exists)
+        out << "device,seek_seconds,bandwidth_bytes,write_bandwidth_bytes" << endl;
+    out << device << "," << probe.profile.seek_seconds << "," << probe.profile.bandwidth_bytes << ","
+        << probe.write_bandwidth_bytes << endl;
+    return probe;
+}
+
+DeviceProbe simulated_device_probe(const DeviceProfile &profile) {
+    DeviceProbe probe;
+    probe.device = profile.name;
+    probe.profile = profile;
+    // A random request pays the seek and the fixed latency of every request
+    probe.profile.seek_seconds = profile.seek_seconds + profile.request_seconds;
+    probe.profile.request_seconds = 0;
+    probe.write_bandwidth_bytes = profile.bandwidth_bytes;
+    probe.cached = true;
+    return probe;
+}
+
+double predicted_seconds(const SimulatedIO &io, const DeviceProbe &device) {
+    return io.seeks * device.profile.seek_seconds
+           + io.blocks_read * BLOCK_SIZE / device.profile.bandwidth_bytes
+           + io.blocks_written * BLOCK_SIZE / device.write_bandwidth_bytes;
+}
+
+TunedSort tune_sort(const DeviceProbe &device, int64_t file_size) {
+    TunedSort tuned;
+    tuned.mergesort_seconds = numeric_limits<double>::infinity();
+    tuned.quicksort_seconds = numeric_limits<double>::infinity();
+
+    // Strict comparisons keep the smallest arity and buffer among equal predictions
+    const int64_t original_buffer_bytes = merge_buffer_bytes();
+    for (int64_t buffer_bytes : MERGE_BUFFER_CANDIDATES) {
+        set_merge_buffer_bytes(buffer_bytes);
+        for (int64_t arity = MIN_ARITY; arity <= MAX_ARITY; arity++) {
+            double seconds = predicted_seconds(simulate_external_mergesort(file_size, arity), device);
+            if (seconds < tuned.mergesort_seconds) {
+                tuned.mergesort_seconds = seconds;
+                tuned.mergesort_arity = arity;
+                tuned.merge_buffer_bytes = buffer_bytes;
+            }
+        }
+    }
+    set_merge_buffer_bytes(original_buffer_bytes);
+
+    for (int64_t arity = MIN_ARITY; arity <= MAX_ARITY; arity++) {
+        double seconds = predicted_seconds(simulate_external_quicksort(file_size, arity), device);
+        if (seconds < tuned.quicksort_seconds) {
+            tuned.quicksort_seconds = seconds;
+            tuned.quicksort_arity = arity;
+        }
+    }
+    return tuned;
+}
+
+#ifdef AUTO_TUNE_MAIN
+/**
+ * @brief Probes the device of a directory and prints the plan for an input of m_mult * M bytes.
+ * @details Usage: auto_tune <directory> <m_mult> [memory_mb]
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " <directory> <m_mult> [memory_mb]" << endl;
+        return EXIT_FAILURE;
+    }
+    const int64_t M_SIZE = 50 * 1024 * 1024;
+    if (argc > 3)
+        set_memory_limit(stoll(argv[3]) * 1024 * 1024);
+    DeviceProbe device = device_probe(argv[1]);
+    cout << "Device " << device.device << (device.cached ? " (cached)" : "") << ": random request "
+         << device.profile.seek_seconds * 1e3 << " ms, read " << device.profile.bandwidth_bytes / 1e6
+         << " MB/s, write " << device.write_bandwidth_bytes / 1e6 << " MB/s" << endl;
+    for (const ProbePoint &point : device.random_reads) {
+        cout << "  Random read of " << point.request_bytes / 1024 << " KB: " << point.seconds * 1e3
+             << " ms" << endl;
+    }
+    TunedSort tuned = tune_sort(device, stoll(argv[2]) * M_SIZE);
+    cout << "Mergesort: arity " << tuned.mergesort_arity << ", merge buffer "
+         << tuned.merge_buffer_bytes / 1024 << " KB, predicted " << tuned.mergesort_seconds << " s"
+         << endl;
+    cout << "Quicksort: arity " << tuned.quicksort_arity << ", predicted " << tuned.quicksort_seconds
+         << " s" << endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,209 @@
+#include <algorithm>
+#include <block_pool.h>
+#include <cstring>
+
+using namespace std;
+
+BlockPool::BlockPool(
+    int64_t frame_elements, int64_t num_frames, int64_t max_write_elements, const IOConfig &io
+)
+    : frame_elements_(frame_elements), memory_(frame_elements * num_frames),
+      gather_(max(frame_elements, max_write_elements / frame_elements * frame_elements)) {
+    for (int64_t i = num_frames - 1; i >= 0; i--) {
+        free_frames_.push_back(memory_.data() + i * frame_elements);
+    }
+    slot_elements_ = gather_.size();
+    if (io.engine != IOEngine::SYNC) {
+        io_ = make_unique<AsyncIO>(io);
+        int64_t slots = io_->queue_depth();
+        int64_t slot_frames = gather_.size() / frame_elements / slots;
+        slot_elements_ = max(int64_t(1), slot_frames) * frame_elements;
+        gather_.resize(slot_elements_ * slots);
+        for (int64_t i = slots - 1; i >= 0; i--) {
+            free_slots_.push_back(gather_.data() + i * slot_elements_);
+        }
+        io_->register_buffer(memory_.data(), memory_.size() * sizeof(int64_t));
+        io_->register_buffer(gather_.data(), gather_.size() * sizeof(int64_t));
+    }
+    writer_ = thread(&BlockPool::writer_loop, this);
+}
+
+BlockPool::~BlockPool() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    work_ready_.notify_one();
+    writer_.join();
+}
+
+int64_t BlockPool::frame_elements() const {
+    return frame_elements_;
+}
+
+int64_t *BlockPool::try_acquire() {
+    unique_lock<mutex> lock(mutex_);
+    frame_returned_.wait(lock, [this] { return !free_frames_.empty() || in_flight_ == 0; });
+    if (free_frames_.empty())
+        return nullptr;
+    int64_t *frame = free_frames_.back();
+    free_frames_.pop_back();
+    return frame;
+}
+
+void BlockPool::write_behind(
+    StorageFile *file, int64_t offset, const vector<int64_t *> &frames, int64_t elements
+) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        queue_.push_back({file, offset, frames, elements});
+        in_flight_++;
+    }
+    work_ready_.notify_one();
+}
+
+void BlockPool::drain() {
+    unique_lock<mutex> lock(mutex_);
+    frame_returned_.wait(lock, [this] { return in_flight_ == 0; });
+}
+
+int64_t BlockPool::writes() {
+    lock_guard<mutex> lock(mutex_);
+    return writes_;
+}
+
+/** writer_loop
+ * @brief Writes queued chains in FIFO order, so each partition file grows sequentially.
+ * @details Without an I/O engine each chain is written before the next one is taken. With
+ * one, its requests are queued and completed in order as gather slots are needed, and all
+ * of them before the thread sleeps, so drain() never waits for a write nobody submits.
+ */
+void BlockPool::writer_loop() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+        while (queue_.empty() && !queued_writes_.empty()) {
+            lock.unlock();
+            complete_oldest();
+            lock.lock();
+        }
+        work_ready_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+        if (queue_.empty())
+            return;
+        PendingWrite write = move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+
+        if (io_) {
+            int64_t requests = queue_chain(write);
+            lock.lock();
+            writes_ += requests;
+            continue;
+        }
+
+        int64_t requests = write_chain(write);
+
+        lock.lock();
+        writes_ += requests;
+        in_flight_--;
+        for (int64_t *f : write.frames) {
+            free_frames_.push_back(f);
+        }
+        frame_returned_.notify_all();
+    }
+}
+
+/** write_chain
+ * @brief Writes a chain with blocking writes.
+ * @details A chain of a single frame is written in place, longer chains are copied into
+ * the gather buffer so each request covers up to gather_.size() elements.
+ * @return Number of write requests issued.
+ */
+int64_t BlockPool::write_chain(const PendingWrite &write) {
+    int64_t requests = 0;
+    if (write.frames.size() == 1) {
+        write.file->write_at(write.frames[0], write.elements * sizeof(int64_t), write.offset);
+        return 1;
+    }
+    int64_t done = 0;
+    size_t frame = 0;
+    while (done < write.elements) {
+        int64_t gathered = 0;
+        while (frame < write.frames.size() && gathered < (int64_t)gather_.size() &&
+               done + gathered < write.elements) {
+            int64_t n = min(frame_elements_, write.elements - done - gathered);
+            memcpy(gather_.data() + gathered, write.frames[frame], n * sizeof(int64_t));
+            gathered += n;
+            frame++;
+        }
+        int64_t offset = write.offset + done * sizeof(int64_t);
+        write.file->write_at(gather_.data(), gathered * sizeof(int64_t), offset);
+        done += gathered;
+        requests++;
+    }
+    return requests;
+}
+
+/** queue_chain
+ * @brief Queues the writes of a chain in the I/O engine.
+ * @details A chain of a single frame is written in place and the frame returns to the pool
+ * when its write completes. Longer chains are gathered a slot at a time, and their frames
+ * return to the pool as soon as they are copied.
+ * @return Number of write requests queued.
+ */
+int64_t BlockPool::queue_chain(const PendingWrite &write) {
+    if (write.frames.size() == 1) {
+        int64_t bytes = write.elements * sizeof(int64_t);
+        int64_t ticket = io_->write(*write.file, write.frames[0], bytes, write.offset);
+        queued_writes_.push_back({ticket, nullptr, write.frames[0], true});
+        return 1;
+    }
+    int64_t requests = 0;
+    int64_t done = 0;
+    size_t frame = 0;
+    while (done < write.elements) {
+        while (free_slots_.empty()) {
+            complete_oldest();
+        }
+        int64_t *slot = free_slots_.back();
+        free_slots_.pop_back();
+        int64_t gathered = 0;
+        while (frame < write.frames.size() && gathered < slot_elements_ &&
+               done + gathered < write.elements) {
+            int64_t n = min(frame_elements_, write.elements - done - gathered);
+            memcpy(slot + gathered, write.frames[frame], n * sizeof(int64_t));
+            gathered += n;
+            frame++;
+        }
+        int64_t offset = write.offset + done * sizeof(int64_t);
+        int64_t ticket = io_->write(*write.file, slot, gathered * sizeof(int64_t), offset);
+        done += gathered;
+        requests++;
+        queued_writes_.push_back({ticket, slot, nullptr, done == write.elements});
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    for (int64_t *f : write.frames) {
+        free_frames_.push_back(f);
+    }
+    frame_returned_.notify_all();
+    return requests;
+}
+
+/** complete_oldest
+ * @brief Waits for the oldest queued write and gives back its slot or frame. The chain is
+ * done when its last write completes.
+ */
+void BlockPool::complete_oldest() {
+    QueuedWrite write = queued_writes_.front();
+    queued_writes_.pop_front();
+    io_->wait(write.ticket);
+    if (write.slot)
+        free_slots_.push_back(write.slot);
+
+    lock_guard<mutex> lock(mutex_);
+    if (write.frame)
+        free_frames_.push_back(write.frame);
+    if (write.last)
+        in_flight_--;
+    frame_returned_.notify_all();
+}
@@ -7,20 +7,13 @@
 #include <iostream>
 #include <limits>
 #include <map>
+#include <memory_budget.h>
 #include <queue>
 #include <random>
+#include <storage.h>
 #include <string>
-#include <sys/stat.h>
 #include <vector>
 
-// Windows support
-#ifdef _WIN32
-#include <direct.h>
-#define MKDIR(dir) _mkdir(dir)
-#else
-#define MKDIR(dir) mkdir(dir, 0755)
-#endif
-
 using namespace std;
 
 // create_secuences crea el archivo de tamaño 60M = 3GB con los que se hace el test
@@ -29,12 +22,12 @@ using namespace std;
 /**
  * @BLOCK_SIZE: 4096 bytes. Size of a disk block.
  * @INTS_PER_BLOCK: 512. Number of int64_t that fit in a block.
- * @TOTAL_MEMORY_RAM: 50MB. Memory available for in-memory sorting.
+ * @COPY_BUFFER_SIZE: 1MB. Chunk moved per read/write by copy_file.
  * @results_file: File where experiment results will be written.
  */
 const int64_t BLOCK_SIZE = 4096;
 const int64_t INTS_PER_BLOCK = BLOCK_SIZE / sizeof(int64_t);
-const int64_t TOTAL_MEMORY_RAM = 40 * 1024 * 1024;
+const int64_t COPY_BUFFER_SIZE = 1024 * 1024;
 const string results_file = "results/arity_results.txt";
 
 /** sort_in_memory
@@ -50,15 +43,7 @@ void sort_in_memory(vector<int64_t> &data) {
  * @param dir Path of the directory to create.
  */
 void create_directories(const string &dir) {
-    size_t pos = 0;
-    string path;
-    while ((pos = dir.find('/', pos)) != string::npos) {
-        path = dir.substr(0, pos++);
-        if (path.length() > 0) {
-            MKDIR(path.c_str());
-        }
-    }
-    MKDIR(dir.c_str());
+    storage().create_directories(dir);
 }
 
 /** remove_directory
@@ -66,24 +51,31 @@ void create_directories(const string &dir) {
  * @param dir Path of the directory to remove.
  */
 void remove_directory(const string &dir) {
-    string cmd = "rm -rf " + dir;
-    int result = system(cmd.c_str());
-    if (result != 0) {
-        cerr << "Error removing directory: " << dir << endl;
-    }
+    storage().remove_directory(dir);
 }
 
 /** copy_file
  * @brief Copies a file from source to destination.
  * @param src Path of the source file.
  * @param dst Path of the destination file.
+ * @param src_backend Backend holding src.
+ * @param dst_backend Backend where dst is created.
  */
-void copy_file(const string &src, const string &dst) {
-    ifstream source(src, ios::binary);
-    ofstream dest(dst, ios::binary);
-    dest << source.rdbuf();
-    source.close();
-    dest.close();
+void copy_file(const string &src, const string &dst, StorageBackend &src_backend, StorageBackend &dst_backend) {
+    unique_ptr<StorageFile> source = src_backend.open(src, StorageMode::READ);
+    unique_ptr<StorageFile> dest = dst_backend.open(dst, StorageMode::WRITE);
+    if (!source || !dest) {
+        cerr << "Error copying " << src << " to " << dst << endl;
+        return;
+    }
+    MemoryReservation reservation(COPY_BUFFER_SIZE, "copy buffer", memory_budget());
+    vector<char> buffer(COPY_BUFFER_SIZE);
+    int64_t offset = 0;
+    int64_t bytes_read;
+    while ((bytes_read = source->read_at(buffer.data(), buffer.size(), offset)) > 0) {
+        dest->write_at(buffer.data(), bytes_read, offset);
+        offset += bytes_read;
+    }
 }
 
 /** write_block
@@ -93,22 +85,15 @@ void copy_file(const string &src, const string &dst) {
  * @param buffer Vector of data to write.
  */
 void write_block(const string &filename, int64_t block_index, const vector<int64_t> &buffer) {
-    fstream out(filename, ios::in | ios::out | ios::binary);
+    unique_ptr<StorageFile> out = storage().open(filename, StorageMode::READ_WRITE);
     if (!out) {
-        ofstream create(filename, ios::binary);
-        create.close();
-        out.open(filename, ios::in | ios::out | ios::binary);
-        if (!out) {
-            cerr << "Error opening file " << filename << endl;
-            exit(EXIT_FAILURE);
-        }
+        cerr << "Error opening file " << filename << endl;
+        exit(EXIT_FAILURE);
     }
-    out.seekp(block_index * BLOCK_SIZE);
-    out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(int64_t));
-    if (!out) {
+    int64_t bytes = buffer.size() * sizeof(int64_t);
+    if (out->write_at(buffer.data(), bytes, block_index * BLOCK_SIZE) != bytes) {
         cerr << "Error writing to block in file " << filename << endl;
     }
-    out.close();
 }
 
 /** read_multiple_blocks
@@ -116,41 +101,23 @@ void write_block(const string &filename, int64_t block_index, const vector<int64
  * @param filename Name of the file to read.
  * @param start_block Index of the first block to read.
  * @param num_blocks_to_read Number of blocks to read.
+ * @param backend Backend holding the file.
  * @return Vector with integers read from the blocks.
  */
-vector<int64_t>
-read_multiple_blocks(const string &filename, int64_t start_block, int64_t num_blocks_to_read) {
-    vector<int64_t> buffer;
-    buffer.reserve(num_blocks_to_read * INTS_PER_BLOCK);
-
-    ifstream in(filename, ios::binary);
+vector<int64_t> read_multiple_blocks(
+    const string &filename, int64_t start_block, int64_t num_blocks_to_read, StorageBackend &backend
+) {
+    unique_ptr<StorageFile> in = backend.open(filename, StorageMode::READ);
     if (!in) {
         cerr << "Error opening file " << filename << endl;
         exit(EXIT_FAILURE);
     }
 
-    in.seekg(start_block * BLOCK_SIZE);
-
-    for (int64_t i = 0; i < num_blocks_to_read; i++) {
-        vector<int64_t> temp_buffer(INTS_PER_BLOCK);
-        in.read(reinterpret_cast<char *>(temp_buffer.data()), BLOCK_SIZE);
-
-        if (in.gcount() == 0) {
-            break;
-        }
-
-        if (in.gcount() != BLOCK_SIZE) {
-            temp_buffer.resize(in.gcount() / sizeof(int64_t));
-        }
-
-        buffer.insert(buffer.end(), temp_buffer.begin(), temp_buffer.end());
-
-        if (in.gcount() != BLOCK_SIZE) {
-            break;
-        }
-    }
-
-    in.close();
+    // A single positioned read, it stops at the end of the file like the block by block loop did
+    vector<int64_t> buffer(num_blocks_to_read * INTS_PER_BLOCK);
+    int64_t bytes_read =
+        in->read_at(buffer.data(), num_blocks_to_read * BLOCK_SIZE, start_block * BLOCK_SIZE);
+    buffer.resize(bytes_read / sizeof(int64_t));
     return buffer;
 }
 
@@ -173,6 +140,10 @@ int64_t ternary_search_optimal_arity(int64_t left, int64_t right) {
     ofstream results_out(results_file);
     results_out << "Arity,I/O's" << endl;
 
+    // The runs don't depend on the arity: every trial merges the same cached runs, and its
+    // I/O count includes their formation as if it had formed them
+    RunCache runs(input_file);
+
     while (right - left > 4) {
         cout << "Current search interval: [" << left << ", " << right << "]" << endl;
 
@@ -186,13 +157,15 @@ int64_t ternary_search_optimal_arity(int64_t left, int64_t right) {
 
         cout << "\n  Testing arity: " << m2 << endl;
         string output_file_m2 = "dist/arity_exp/sorted_" + to_string(m2) + ".bin";
-        int64_t io_m2 = external_mergesort(input_file, output_file_m2, m2);
+        int64_t io_m2 = runs.merge(output_file_m2, m2);
+        storage().remove(output_file_m2);
         cout << "  I/O Operations for arity " << m2 << ": " << io_m2 << endl;
         results_out << m2 << "," << io_m2 << endl;
 
         cout << "\n  Testing arity: " << m1 << endl;
         string output_file_m1 = "dist/arity_exp/sorted_" + to_string(m1) + ".bin";
-        int64_t io_m1 = external_mergesort(input_file, output_file_m1, m1);
+        int64_t io_m1 = runs.merge(output_file_m1, m1);
+        storage().remove(output_file_m1);
         cout << "  I/O Operations for arity " << m1 << ": " << io_m1 << endl;
         results_out << m1 << "," << io_m1 << endl;
 
@@ -224,7 +197,8 @@ int64_t ternary_search_optimal_arity(int64_t left, int64_t right) {
 
     for (int64_t arity = right; arity >= left; arity--) {
         string output_file = "dist/arity_exp/sorted_" + to_string(arity) + ".bin";
-        int64_t io_operations = external_mergesort(input_file, output_file, arity);
+        int64_t io_operations = runs.merge(output_file, arity);
+        storage().remove(output_file);
         cout << "  I/O Operations for arity " << arity << ": " << io_operations << endl;
         results_out << arity << "," << io_operations << endl;
         if (io_operations < min_io) {
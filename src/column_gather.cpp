@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <column_gather.h>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+/**
+ * @BLOCK_SIZE: 4096 bytes. I/O is counted in blocks of this size.
+ * @GATHER_READ_BYTES: 1MB. Largest read of a column, unless a single row is larger.
+ * @GATHER_GAP_BYTES: 64KB. Rows closer than this are read together: reading the gap
+ * costs less than another request.
+ */
+const int64_t BLOCK_SIZE = 4096;
+const int64_t GATHER_READ_BYTES = 1024 * 1024;
+const int64_t GATHER_GAP_BYTES = 64 * 1024;
+
+vector<GatherColumn> parse_gather_columns(const string &spec) {
+    vector<GatherColumn> columns;
+    stringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ',')) {
+        stringstream fields(entry);
+        string input, width, output;
+        getline(fields, input, ':');
+        getline(fields, width, ':');
+        getline(fields, output, ':');
+        GatherColumn column;
+        column.input = input;
+        column.output = output;
+        try {
+            column.width = stoll(width);
+        } catch (const exception &) {
+            column.width = 0;
+        }
+        if (input.empty() || output.empty() || column.width <= 0) {
+            cerr << "Invalid gather column: " << entry << endl;
+            exit(EXIT_FAILURE);
+        }
+        columns.push_back(column);
+    }
+    if (columns.empty()) {
+        cerr << "No gather columns in: " << spec << endl;
+        exit(EXIT_FAILURE);
+    }
+    return columns;
+}
+
+ColumnGather::ColumnGather(
+    const vector<GatherColumn> &columns, int64_t batch_rows, StorageBackend &backend
+)
+    : batch_rows_(max(int64_t(1), batch_rows)) {
+    int64_t widest = 0;
+    for (const GatherColumn &spec : columns) {
+        Column column;
+        column.spec = spec;
+        column.input = backend.open(spec.input, StorageMode::READ);
+        if (!column.input) {
+            fail(SortStatus::IO_ERROR, "Error opening column " + spec.input);
+            return;
+        }
+        column.input_rows = column.input->size() / spec.width;
+        column.output = backend.open(spec.output, StorageMode::WRITE);
+        if (!column.output) {
+            fail(SortStatus::IO_ERROR, "Error creating column " + spec.output);
+            return;
+        }
+        widest = max(widest, spec.width);
+        columns_.push_back(move(column));
+    }
+    pending_.reserve(batch_rows_);
+    read_buffer_.resize(max(GATHER_READ_BYTES, widest));
+}
+
+/** fail
+ * @brief Records an error that ends the gather and returns it.
+ */
+SortStatus ColumnGather::fail(SortStatus::Code code, const string &message) {
+    if (status_.ok())
+        status_ = {code, message};
+    return status_;
+}
+
+SortStatus ColumnGather::add(const uint64_t *positions, int64_t count) {
+    if (!status_.ok())
+        return status_;
+    if (finished_)
+        return {SortStatus::INVALID_STATE, "add after finish"};
+    if (count < 0 || (count > 0 && !positions))
+        return {SortStatus::INVALID_ARGUMENT, "invalid positions"};
+
+    int64_t added = 0;
+    while (added < count && status_.ok()) {
+        int64_t take = min(count - added, batch_rows_ - (int64_t)pending_.size());
+        pending_.insert(pending_.end(), positions + added, positions + added + take);
+        added += take;
+        if ((int64_t)pending_.size() == batch_rows_)
+            gather_batch();
+    }
+    return status_;
+}
+
+SortStatus ColumnGather::finish() {
+    if (!status_.ok())
+        return status_;
+    if (finished_)
+        return {SortStatus::INVALID_STATE, "finish called twice"};
+    finished_ = true;
+    if (!pending_.empty())
+        gather_batch();
+    for (Column &column : columns_) {
+        column.input.reset();
+        column.output.reset();
+    }
+    return status_;
+}
+
+/** gather_batch
+ * @brief Sorts the pending positions and gathers their rows into every column.
+ */
+void ColumnGather::gather_batch() {
+    const int64_t n = pending_.size();
+    order_.resize(n);
+    for (int64_t i = 0; i < n; i++) {
+        order_[i] = (uint128_t(pending_[i]) << 64) | uint64_t(i);
+    }
+    radix_sort(order_.data(), n);
+
+    for (Column &column : columns_) {
+        if (!gather_column(column))
+            return;
+    }
+    rows_written_ += n;
+    pending_.clear();
+}
+
+/** gather_column
+ * @brief Reads the rows of the batch from column in position order and writes them in
+ * batch order after the rows already written.
+ * @return false on error.
+ */
+bool ColumnGather::gather_column(Column &column) {
+    const int64_t n = order_.size();
+    const int64_t width = column.spec.width;
+    const int64_t max_read_rows = read_buffer_.size() / width;
+    const int64_t max_gap_rows = GATHER_GAP_BYTES / width;
+    if (n > 0 && int64_t(order_[n - 1] >> 64) >= column.input_rows) {
+        fail(SortStatus::INVALID_ARGUMENT, "Position beyond the end of column " + column.spec.input);
+        return false;
+    }
+    rows_.resize(n * width);
+
+    int64_t i = 0;
+    while (i < n) {
+        // One read covers the following positions while the gaps and the read stay small
+        const int64_t first = order_[i] >> 64;
+        int64_t last = first;
+        int64_t end = i + 1;
+        while (end < n) {
+            int64_t position = order_[end] >> 64;
+            if (position - last > max_gap_rows || position - first >= max_read_rows)
+                break;
+            last = position;
+            end++;
+        }
+        int64_t bytes = (last - first + 1) * width;
+        if (column.input->read_at(read_buffer_.data(), bytes, first * width) != bytes) {
+            fail(SortStatus::IO_ERROR, "Error reading column " + column.spec.input);
+            return false;
+        }
+        io_operations_ += (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE + 1;
+
+        for (; i < end; i++) {
+            int64_t position = order_[i] >> 64;
+            int64_t slot = uint64_t(order_[i]);
+            memcpy(&rows_[slot * width], &read_buffer_[(position - first) * width], width);
+        }
+    }
+
+    int64_t bytes = n * width;
+    if (column.output->write_at(rows_.data(), bytes, rows_written_ * width) != bytes) {
+        fail(SortStatus::IO_ERROR, "Error writing column " + column.spec.output);
+        return false;
+    }
+    io_operations_ += (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return true;
+}
+
+int64_t ColumnGather::rows() const {
+    return rows_written_;
+}
+
+int64_t ColumnGather::io_operations() const {
+    return io_operations_;
+}
+
+const SortStatus &ColumnGather::status() const {
+    return status_;
+}
@@ -1,12 +1,16 @@
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <create_secuences.h>
 #include <ctime>
 #include <fstream>
 #include <iostream>
 #include <limits>
 #include <queue>
 #include <random>
+#include <storage.h>
 #include <string>
+#include <thread>
 
 using namespace std;
 
@@ -29,24 +33,195 @@ void write_vector_to_file(
     const std::string &filename, int64_t block_index, const std::vector<int64_t> &vec
 );
 
+/**
+ * *@GOLDEN_GAMMA: Weyl increment of SplitMix64
+ * *@STREAM_ELEMENTS: 2MB of int64_t. Each chunk of the file is drawn from its own stream
+ * *@MAX_BATCH_CHUNKS: 8. At most 8 chunks (16MB) are generated before each write
+ * *@FEW_UNIQUE_VALUES, ZIPF_VALUES, ZIPF_SKEW: Parameters of the skewed distributions
+ * *@NEARLY_SORTED_NOISE: 1 out of 100 values of NEARLY_SORTED is random
+ */
+const uint64_t GOLDEN_GAMMA = 0x9e3779b97f4a7c15ULL;
+const int64_t STREAM_ELEMENTS = 2 * 1024 * 1024 / sizeof(int64_t);
+const int64_t MAX_BATCH_CHUNKS = 8;
+const uint64_t FEW_UNIQUE_VALUES = 16;
+const double ZIPF_VALUES = 1e6;
+const double ZIPF_SKEW = 1.1;
+const uint64_t NEARLY_SORTED_NOISE = 100;
+
+/** mix64
+ * @brief SplitMix64 finalizer, a bijective 64-bit hash.
+ */
+static uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+CounterRng::CounterRng(uint64_t seed, uint64_t stream) : key(mix64(seed ^ mix64(stream + GOLDEN_GAMMA))) {
+}
+
+uint64_t CounterRng::at(uint64_t i) const {
+    return mix64(key + (i + 1) * GOLDEN_GAMMA);
+}
+
+/** parse_distribution
+ * @brief Parses a distribution name (uniform, sorted, reverse, nearly_sorted, few_unique,
+ * zipf, all_equal).
+ * @warning If the name is unknown, the program exits with error
+ */
+Distribution parse_distribution(const string &name) {
+    if (name == "uniform")
+        return Distribution::UNIFORM;
+    if (name == "sorted")
+        return Distribution::SORTED;
+    if (name == "reverse")
+        return Distribution::REVERSE_SORTED;
+    if (name == "nearly_sorted")
+        return Distribution::NEARLY_SORTED;
+    if (name == "few_unique")
+        return Distribution::FEW_UNIQUE;
+    if (name == "zipf")
+        return Distribution::ZIPF;
+    if (name == "all_equal")
+        return Distribution::ALL_EQUAL;
+    cerr << "Unknown distribution: " << name << endl;
+    exit(EXIT_FAILURE);
+}
+
+/** sorted_value
+ * @brief index-th value of an ascending sequence of n values spread over the int64_t range.
+ * @param r Random bits used to jitter the value inside its slot
+ */
+static int64_t sorted_value(int64_t index, int64_t n, uint64_t r) {
+    uint64_t step = numeric_limits<uint64_t>::max() / max(int64_t(1), n);
+    uint64_t u = (uint64_t)index * step + (step > 1 ? r % step : 0);
+    // Flipping the sign bit maps unsigned order onto signed order
+    return (int64_t)(u ^ (1ULL << 63));
+}
+
+/** distribution_value
+ * @brief Value at position index given the random bits r drawn for it.
+ */
+static int64_t distribution_value(const SequenceConfig &config, int64_t index, int64_t n, uint64_t r) {
+    switch (config.distribution) {
+    case Distribution::UNIFORM:
+        return (int64_t)r;
+    case Distribution::SORTED:
+        return sorted_value(index, n, r);
+    case Distribution::REVERSE_SORTED:
+        return sorted_value(n - 1 - index, n, r);
+    case Distribution::NEARLY_SORTED:
+        if (r % NEARLY_SORTED_NOISE == 0)
+            return (int64_t)mix64(r);
+        return sorted_value(index, n, mix64(r));
+    case Distribution::FEW_UNIQUE:
+        return (int64_t)mix64(config.seed * FEW_UNIQUE_VALUES + r % FEW_UNIQUE_VALUES);
+    case Distribution::ZIPF: {
+        // Inverse CDF of the continuous approximation of Zipf over [1, ZIPF_VALUES]
+        double u = (r >> 11) * 0x1.0p-53;
+        double rank = pow((pow(ZIPF_VALUES, 1 - ZIPF_SKEW) - 1) * u + 1, 1 / (1 - ZIPF_SKEW));
+        return (int64_t)mix64(config.seed ^ (uint64_t)rank);
+    }
+    case Distribution::ALL_EQUAL:
+        return (int64_t)mix64(config.seed);
+    }
+    return 0;
+}
+
+/** sequence_value
+ * @brief Value at position index of a sequence of n elements.
+ * @details Pure function of (config, index, n), used by the file generator and any
+ * on-the-fly source that must reproduce the same sequence.
+ */
+int64_t sequence_value(const SequenceConfig &config, int64_t index, int64_t n) {
+    CounterRng rng(config.seed, index / STREAM_ELEMENTS);
+    return distribution_value(config, index, n, rng.at(index % STREAM_ELEMENTS));
+}
+
+/** fill_sequence
+ * @brief Writes positions [first, first + count) of a sequence of n elements into out.
+ */
+void fill_sequence(const SequenceConfig &config, int64_t first, int64_t count, int64_t n, int64_t *out) {
+    int64_t i = 0;
+    while (i < count) {
+        CounterRng rng(config.seed, (first + i) / STREAM_ELEMENTS);
+        rng.counter = (first + i) % STREAM_ELEMENTS;
+        int64_t in_stream = min(count - i, STREAM_ELEMENTS - (int64_t)rng.counter);
+        for (int64_t j = 0; j < in_stream; j++, i++) {
+            out[i] = distribution_value(config, first + i, n, rng.next());
+        }
+    }
+}
+
+/** generate_sequence_file
+ * @brief Writes a sequence of n elements to filename.
+ * @details The file is preallocated, chunks are filled in parallel and written with large
+ * sequential writes.
+ * @warning If the file can't be opened, the program exits with error
+ */
+void generate_sequence_file(const string &filename, int64_t n, const SequenceConfig &config) {
+    unique_ptr<StorageFile> out = storage().open(filename, StorageMode::WRITE);
+    if (!out) {
+        cerr << "Error opening file " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    out->preallocate(n * sizeof(int64_t));
+
+    int64_t threads = config.threads > 0 ? config.threads : max(1u, thread::hardware_concurrency());
+    int64_t batch_chunks = min(threads, MAX_BATCH_CHUNKS);
+    vector<int64_t> batch(batch_chunks * STREAM_ELEMENTS);
+
+    // This for:
+    // Fills batch_chunks chunks at a time, one thread per chunk, and writes the whole batch
+    // with a single sequential write. Chunks are aligned with the generator streams, so the
+    // file only depends on the seed and not on the number of threads.
+    for (int64_t first = 0; first < n; first += batch_chunks * STREAM_ELEMENTS) {
+        int64_t batch_elements = min(n - first, batch_chunks * STREAM_ELEMENTS);
+        vector<thread> workers;
+        for (int64_t c = 0; c * STREAM_ELEMENTS < batch_elements; c++) {
+            int64_t count = min(STREAM_ELEMENTS, batch_elements - c * STREAM_ELEMENTS);
+            int64_t *chunk = batch.data() + c * STREAM_ELEMENTS;
+            workers.emplace_back([&config, first, c, count, n, chunk]() {
+                fill_sequence(config, first + c * STREAM_ELEMENTS, count, n, chunk);
+            });
+        }
+        for (thread &worker : workers) {
+            worker.join();
+        }
+        int64_t bytes = batch_elements * sizeof(int64_t);
+        if (out->write_at(batch.data(), bytes, first * sizeof(int64_t)) != bytes) {
+            cerr << "Error writing file " << filename << endl;
+        }
+    }
+}
+
 /** create_and_write_M
- * @brief Calls the random_vector_int64() and write_vector_to_file() functions
- * @param n: Number of int64_t to populate
- * @returns void
- * @note the for ends after m_mult*BLOCKS_PER_M loops
+ * @brief Creates n_secuences files of m_mult * M bytes each with the given config
+ * @details Sequence j uses seed config.seed + j
  */
-void create_and_write_M(int64_t m_mult, int64_t n_secuences) {
+void create_and_write_M(int64_t m_mult, int64_t n_secuences, const SequenceConfig &config) {
     for (int j = 0; j < n_secuences; j++) {
         string index = to_string(j + 1);
         string filename = bin_dir + "/m_" + to_string(m_mult) + "/" + "secuence" + "_" + index + ".bin";
+        SequenceConfig sequence_config = config;
+        sequence_config.seed = config.seed + j;
         // * BLOCKS_PER_M multiplied per m_mult to get 4M, 8M... etc.
-        for (int i = 0; i < m_mult * BLOCKS_PER_M; i++) {
-            vector<int64_t> vector = random_vector_int64(INTS_PER_BLOCK);
-            write_vector_to_file(filename, i, vector);
-        }
+        generate_sequence_file(filename, m_mult * BLOCKS_PER_M * INTS_PER_BLOCK, sequence_config);
     }
 }
 
+/** create_and_write_M
+ * @brief Creates n_secuences uniform random files of m_mult * M bytes each
+ * @param m_mult: Size multiplier for M
+ * @param n_secuences: Number of sequences to create
+ * @returns void
+ */
+void create_and_write_M(int64_t m_mult, int64_t n_secuences) {
+    SequenceConfig config;
+    config.seed = m_mult;
+    create_and_write_M(m_mult, n_secuences, config);
+}
+
 /** random_vector_int64
  * @brief Create a vector of size n with random int64_t values
  * @details using numeric_limits of int64_t to avoid writing the values of -2^63 and 2^63-1
@@ -73,32 +248,37 @@ vector<int64_t> random_vector_int64(int64_t n) {
  * @warning If the files doesn't exists, the program exits with error
  */
 void write_vector_to_file(const string &filename, int64_t block_index, const vector<int64_t> &vec) {
-    // If the file it's already created ios::app interface continues writing at EoF
-    ofstream out(filename, ios::binary | ios::app);
+    // If the file it's already created READ_WRITE keeps its contents
+    unique_ptr<StorageFile> out = storage().open(filename, StorageMode::READ_WRITE);
     if (!out) {
         cerr << "Error opening file " << filename << endl;
         exit(EXIT_FAILURE);
     }
-    out.seekp(block_index * BLOCK_SIZE);
-    out.write(reinterpret_cast<const char *>(vec.data()), BLOCK_SIZE);
-    if (!out) {
+    if (out->write_at(vec.data(), BLOCK_SIZE, block_index * BLOCK_SIZE) != BLOCK_SIZE) {
         cerr << "Error writing file " << filename << endl;
     }
-    out.close();
     return;
 }
 
 #ifdef CREATE_SECUENCES_MAIN
 int main(int argc, char *argv[]) {
-    (void)argc;
+    // Usage: create_secuences <m_mult> <n_secuences> [distribution] [seed] [threads]
     int64_t m_mult = stoi(argv[1]);
     int64_t n_secuences = stoi(argv[2]);
+    SequenceConfig config;
+    config.seed = m_mult;
+    if (argc > 3)
+        config.distribution = parse_distribution(argv[3]);
+    if (argc > 4)
+        config.seed = stoull(argv[4]);
+    if (argc > 5)
+        config.threads = stoll(argv[5]);
     cout << "Creating secuences" << endl;
     const auto start_create{chrono::steady_clock::now()};
-    create_and_write_M(m_mult, n_secuences);
+    create_and_write_M(m_mult, n_secuences, config);
     const auto finish_create{chrono::steady_clock::now()};
     const chrono::duration<double> elapsed_seconds_create{finish_create - start_create};
-    cout << "Time used for M=60: " << elapsed_seconds_create.count() << "seconds" << endl;
+    cout << "Time used for M=" << m_mult << ": " << elapsed_seconds_create.count() << " seconds" << endl;
     return 0;
 }
 #endif
\ No newline at end of file
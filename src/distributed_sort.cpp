@@ -0,0 +1,464 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <create_secuences.h>
+#include <cstring>
+#include <distributed_sort.h>
+#include <external_mergesort.h>
+#include <external_quicksort.h>
+#include <fstream>
+#include <input_source.h>
+#include <iostream>
+#include <spill_storage.h>
+#include <splitter_tree.h>
+#include <storage.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+// distributed_sort simula un sort distribuido en una sola máquina: cada worker es un proceso
+// (un "nodo") y los buckets viajan entre ellos por sockets Unix.
+
+/**
+ * @EXCHANGE_BUFFER_ELEMENTS: 32K int64_t (256KB). Values buffered per destination before
+ * they are sent, and bytes read per receive.
+ * @SHARD_READ_ELEMENTS: 128K int64_t (1MB). Values of the input shard read and classified
+ * at a time.
+ */
+const int64_t EXCHANGE_BUFFER_ELEMENTS = 32 * 1024;
+const int64_t SHARD_READ_ELEMENTS = 128 * 1024;
+
+/** send_all
+ * @brief Writes bytes bytes to fd, retrying short writes.
+ * @warning Exits with error if the socket fails.
+ */
+static void send_all(int fd, const void *data, int64_t bytes) {
+    const char *next = static_cast<const char *>(data);
+    while (bytes > 0) {
+        ssize_t n = ::write(fd, next, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            cerr << "Error sending to a worker: " << strerror(errno) << endl;
+            exit(EXIT_FAILURE);
+        }
+        next += n;
+        bytes -= n;
+    }
+}
+
+/** receive_all
+ * @brief Reads exactly bytes bytes from fd.
+ * @return false if the peer closed the socket first.
+ */
+static bool receive_all(int fd, void *data, int64_t bytes) {
+    char *next = static_cast<char *>(data);
+    while (bytes > 0) {
+        ssize_t n = ::read(fd, next, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        next += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+/** shard_path
+ * @brief Path of the file of worker w with the given extension.
+ */
+static string shard_path(const string &output_prefix, int64_t w, const string &extension) {
+    return output_prefix + "_" + to_string(w) + extension;
+}
+
+/**
+ * @brief Range file of a worker, appended to by its own partitioning and by its receivers.
+ * @details Each append reserves its byte range first, so concurrent appends only ever
+ * write whole values at disjoint offsets.
+ */
+struct RangeFile {
+    unique_ptr<StorageFile> file;
+    atomic<int64_t> size{0};
+
+    void append(const int64_t *values, int64_t count) {
+        int64_t bytes = count * sizeof(int64_t);
+        int64_t offset = size.fetch_add(bytes);
+        if (file->write_at(values, bytes, offset) != bytes) {
+            cerr << "Error writing the range file" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+};
+
+/** receive_bucket
+ * @brief Appends to range everything a peer sends on fd until it closes its side.
+ */
+static void receive_bucket(int fd, RangeFile &range) {
+    vector<int64_t> buffer(EXCHANGE_BUFFER_ELEMENTS);
+    char *data = reinterpret_cast<char *>(buffer.data());
+    int64_t filled = 0;
+    while (true) {
+        ssize_t n = ::read(fd, data + filled, EXCHANGE_BUFFER_ELEMENTS * sizeof(int64_t) - filled);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            cerr << "Error receiving from a worker: " << strerror(errno) << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0)
+            break;
+        filled += n;
+
+        // A value split between two reads waits for the rest
+        int64_t whole = filled / sizeof(int64_t);
+        range.append(buffer.data(), whole);
+        int64_t rest = filled - whole * sizeof(int64_t);
+        memmove(data, data + whole * sizeof(int64_t), rest);
+        filled = rest;
+    }
+    if (filled != 0) {
+        cerr << "A worker sent a truncated value" << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/** run_worker
+ * @brief Body of worker w: receives the splitters, exchanges buckets and sorts its range.
+ * @param peers Socket to every other worker, -1 at index w.
+ * @param control Socket to the coordinator.
+ */
+static void run_worker(
+    int64_t w, int64_t workers, const string &input_file, const string &output_prefix, int64_t arity,
+    const string &algorithm, const vector<int> &peers, int control
+) {
+    if (!freopen(shard_path(output_prefix, w, ".log").c_str(), "w", stdout)) {
+        cerr << "Error opening the log of worker " << w << endl;
+        exit(EXIT_FAILURE);
+    }
+    SpillConfig spill = spill_config();
+    for (SpillDirectory &directory : spill.directories)
+        directory.path += "/worker_" + to_string(w);
+    set_spill_config(spill);
+
+    int64_t num_pivots = 0;
+    vector<int64_t> pivots;
+    if (receive_all(control, &num_pivots, sizeof(num_pivots))) {
+        pivots.resize(num_pivots);
+        if (!receive_all(control, pivots.data(), num_pivots * sizeof(int64_t))) {
+            cerr << "Worker " << w << " didn't get the splitters" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    SplitterTree splitters(pivots);
+
+    auto start = chrono::steady_clock::now();
+    WorkerReport report;
+    string range_file = shard_path(output_prefix, w, ".range");
+    RangeFile range;
+    range.file = storage().open(range_file, StorageMode::WRITE);
+    if (!range.file) {
+        cerr << "Error creating range file: " << range_file << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    vector<thread> receivers;
+    for (int64_t p = 0; p < workers; p++) {
+        if (p != w)
+            receivers.emplace_back(receive_bucket, peers[p], ref(range));
+    }
+
+    // Shard w is the w-th contiguous slice of the input
+    FileInputSource input(input_file);
+    int64_t begin = input.size() * w / workers;
+    int64_t end = input.size() * (w + 1) / workers;
+    vector<int64_t> chunk(SHARD_READ_ELEMENTS);
+    vector<uint32_t> buckets(SHARD_READ_ELEMENTS);
+    vector<vector<int64_t>> outgoing(workers);
+    auto flush = [&](int64_t p) {
+        if (p == w) {
+            range.append(outgoing[p].data(), outgoing[p].size());
+        } else {
+            send_all(peers[p], outgoing[p].data(), outgoing[p].size() * sizeof(int64_t));
+            report.sent_bytes += outgoing[p].size() * sizeof(int64_t);
+        }
+        outgoing[p].clear();
+    };
+    for (int64_t index = begin; index < end; index += SHARD_READ_ELEMENTS) {
+        int64_t count = input.read_at(index, chunk.data(), min(SHARD_READ_ELEMENTS, end - index));
+        splitters.classify(chunk.data(), count, buckets.data());
+        for (int64_t i = 0; i < count; i++) {
+            vector<int64_t> &out = outgoing[buckets[i]];
+            out.push_back(chunk[i]);
+            if ((int64_t)out.size() == EXCHANGE_BUFFER_ELEMENTS)
+                flush(buckets[i]);
+        }
+    }
+    for (int64_t p = 0; p < workers; p++) {
+        if (!outgoing[p].empty())
+            flush(p);
+        if (p != w)
+            shutdown(peers[p], SHUT_WR);
+    }
+    for (thread &receiver : receivers)
+        receiver.join();
+    for (int64_t p = 0; p < workers; p++) {
+        if (p != w)
+            close(peers[p]);
+    }
+    range.file.reset();
+    report.exchange_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    string output_shard = shard_path(output_prefix, w, ".bin");
+    report.elements = range.size / sizeof(int64_t);
+    cout << "Worker " << w << ": sorting " << report.elements << " values with " << algorithm << endl;
+    if (algorithm == "quicksort")
+        report.io_operations = external_quicksort(range_file, output_shard, arity);
+    else
+        report.io_operations = external_mergesort(range_file, output_shard, arity);
+    storage().remove(range_file);
+    for (const SpillDirectory &directory : spill.directories)
+        storage().remove_directory(directory.path);
+    report.sort_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout.flush();
+    send_all(control, &report, sizeof(report));
+}
+
+DistributedSortResult distributed_sort(
+    const string &input_file, const string &output_prefix, int64_t workers, int64_t arity,
+    const string &algorithm
+) {
+    if (storage().file_size(input_file) < 0) {
+        cerr << "Error opening input file: " << input_file << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (workers < 1 || (algorithm != "mergesort" && algorithm != "quicksort")) {
+        cerr << "distributed_sort needs at least one worker and mergesort or quicksort" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    DistributedSortResult result;
+    auto start = chrono::steady_clock::now();
+
+    // Global sample: workers-1 splitters. Repeated splitters give fewer buckets than
+    // workers, the last workers then get an empty key range.
+    vector<int64_t> pivots = select_pivots(input_file, workers, PIVOT_SAMPLE_BLOCKS * workers);
+
+    // control[w] links the coordinator with worker w, mesh[i][j] links worker i with j
+    vector<array<int, 2>> control(workers);
+    vector<vector<array<int, 2>>> mesh(workers, vector<array<int, 2>>(workers, {-1, -1}));
+    for (int64_t w = 0; w < workers; w++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, control[w].data()) != 0) {
+            cerr << "Error creating sockets: " << strerror(errno) << endl;
+            exit(EXIT_FAILURE);
+        }
+        for (int64_t p = w + 1; p < workers; p++) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, mesh[w][p].data()) != 0) {
+                cerr << "Error creating sockets: " << strerror(errno) << endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Buffered output would be printed again by every child
+    cout.flush();
+    vector<pid_t> pids(workers);
+    for (int64_t w = 0; w < workers; w++) {
+        pids[w] = fork();
+        if (pids[w] < 0) {
+            cerr << "Error starting worker " << w << ": " << strerror(errno) << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (pids[w] > 0)
+            continue;
+
+        // Worker w keeps only its own ends, so closing them is seen as the end of a bucket
+        vector<int> peers(workers, -1);
+        for (int64_t i = 0; i < workers; i++) {
+            close(control[i][0]);
+            if (i != w)
+                close(control[i][1]);
+            for (int64_t j = i + 1; j < workers; j++) {
+                if (i == w)
+                    peers[j] = mesh[i][j][0];
+                else
+                    close(mesh[i][j][0]);
+                if (j == w)
+                    peers[i] = mesh[i][j][1];
+                else
+                    close(mesh[i][j][1]);
+            }
+        }
+        run_worker(w, workers, input_file, output_prefix, arity, algorithm, peers, control[w][1]);
+        exit(EXIT_SUCCESS);
+    }
+
+    for (int64_t i = 0; i < workers; i++) {
+        close(control[i][1]);
+        for (int64_t j = i + 1; j < workers; j++) {
+            close(mesh[i][j][0]);
+            close(mesh[i][j][1]);
+        }
+    }
+
+    // Broadcast the splitters, then wait for every report
+    int64_t num_pivots = pivots.size();
+    for (int64_t w = 0; w < workers; w++) {
+        send_all(control[w][0], &num_pivots, sizeof(num_pivots));
+        send_all(control[w][0], pivots.data(), num_pivots * sizeof(int64_t));
+    }
+    bool failed = false;
+    result.workers.resize(workers);
+    for (int64_t w = 0; w < workers; w++) {
+        if (!receive_all(control[w][0], &result.workers[w], sizeof(WorkerReport)))
+            failed = true;
+        close(control[w][0]);
+        result.output_shards.push_back(shard_path(output_prefix, w, ".bin"));
+    }
+    for (int64_t w = 0; w < workers; w++) {
+        int status = 0;
+        waitpid(pids[w], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = true;
+    }
+    if (failed) {
+        cerr << "A worker failed, see " << output_prefix << "_<worker>.log" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+bool verify_distributed_output(const string &input_file, const vector<string> &output_shards) {
+    FileInputSource input(input_file);
+    Fingerprint expected = fingerprint_source(input);
+
+    Fingerprint found;
+    bool sorted = true;
+    bool any = false;
+    int64_t previous = 0;
+    vector<int64_t> chunk(SHARD_READ_ELEMENTS);
+    for (const string &shard : output_shards) {
+        FileInputSource output(shard);
+        int64_t n;
+        while ((n = output.read(chunk.data(), chunk.size())) > 0) {
+            for (int64_t i = 0; i < n; i++) {
+                if (any && chunk[i] < previous)
+                    sorted = false;
+                previous = chunk[i];
+                any = true;
+                found.add(chunk[i]);
+            }
+        }
+    }
+    return sorted && found == expected;
+}
+
+#ifdef DISTRIBUTED_SORT_MAIN
+/** run_scaling
+ * @brief Sorts input_file with each number of workers in counts and appends a row per run,
+ * labelled input_name, to results.
+ * @return false if an output was wrong.
+ */
+static bool run_scaling(
+    ofstream &results, const string &input_name, const string &input_file, const vector<int64_t> &counts,
+    int64_t arity, const string &algorithm
+) {
+    cout << "Input " << input_name << ": " << input_file << endl;
+    double base_seconds = 0;
+    for (int64_t workers : counts) {
+        DistributedSortResult result =
+            distributed_sort(input_file, "dist/distributed/sorted", workers, arity, algorithm);
+        bool ok = verify_distributed_output(input_file, result.output_shards);
+
+        double max_exchange = 0, max_sort = 0;
+        int64_t exchanged = 0, io = 0;
+        int64_t largest = 0, smallest = result.workers[0].elements;
+        for (const WorkerReport &report : result.workers) {
+            max_exchange = max(max_exchange, report.exchange_seconds);
+            max_sort = max(max_sort, report.sort_seconds);
+            exchanged += report.sent_bytes;
+            io += report.io_operations;
+            largest = max(largest, report.elements);
+            smallest = min(smallest, report.elements);
+        }
+        if (workers == 1)
+            base_seconds = result.seconds;
+        double speedup = base_seconds / result.seconds;
+
+        cout << "Workers " << workers << ": " << result.seconds << " s (speedup " << speedup
+             << "), exchange " << max_exchange << " s, sort " << max_sort << " s, "
+             << exchanged / (1024 * 1024) << " MB exchanged, shards " << smallest << ".." << largest
+             << (ok ? " (OK)" : " (WRONG OUTPUT)") << endl;
+        results << input_name << "," << workers << "," << result.seconds << "," << speedup << ","
+                << max_exchange << "," << max_sort << "," << exchanged << "," << largest << "," << smallest
+                << "," << io << endl;
+
+        for (const string &shard : result.output_shards)
+            storage().remove(shard);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Sorts an input with 1, 2, 4, ... up to max_workers worker processes and writes
+ * the times to results/distributed_scaling.csv.
+ * @details Usage: distributed_sort <input_file> <max_workers> [mergesort|quicksort] [arity]
+ * The same sweep is then run over all_equal and few_unique inputs of the same size, where
+ * the splitters repeat and most workers get an empty key range.
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " <input_file> <max_workers> [mergesort|quicksort] [arity]" << endl;
+        return EXIT_FAILURE;
+    }
+    string input_file = argv[1];
+    int64_t max_workers = stoll(argv[2]);
+    string algorithm = argc > 3 ? argv[3] : "mergesort";
+    int64_t arity = argc > 4 ? stoll(argv[4]) : 16;
+
+    vector<int64_t> counts;
+    for (int64_t w = 1; w < max_workers; w *= 2)
+        counts.push_back(w);
+    counts.push_back(max_workers);
+
+    storage().create_directories("dist/distributed");
+    ofstream results("results/distributed_scaling.csv");
+    if (!results) {
+        cerr << "Error opening results file: results/distributed_scaling.csv" << endl;
+        return EXIT_FAILURE;
+    }
+    results << "input,workers,seconds,speedup,max_exchange_seconds,max_sort_seconds,exchanged_bytes,"
+               "largest_shard,smallest_shard,IO_operations"
+            << endl;
+
+    if (!run_scaling(results, "input", input_file, counts, arity, algorithm))
+        return EXIT_FAILURE;
+
+    // Duplicate-heavy inputs of the same size
+    int64_t elements = max(int64_t(0), storage().file_size(input_file)) / (int64_t)sizeof(int64_t);
+    for (Distribution distribution : {Distribution::ALL_EQUAL, Distribution::FEW_UNIQUE}) {
+        string name = distribution == Distribution::ALL_EQUAL ? "all_equal" : "few_unique";
+        string generated = "dist/distributed/" + name + ".bin";
+        SequenceConfig config;
+        config.distribution = distribution;
+        generate_sequence_file(generated, elements, config);
+        bool ok = run_scaling(results, name, generated, counts, arity, algorithm);
+        storage().remove(generated);
+        if (!ok)
+            return EXIT_FAILURE;
+    }
+    cout << "Results saved to results/distributed_scaling.csv" << endl;
+    return 0;
+}
+#endif
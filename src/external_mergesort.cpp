@@ -1,11 +1,20 @@
+#include <aggregation.h>
 #include <algorithm>
+#include <async_io.h>
 #include <calculate_arity.h>
 #include <chrono>
 #include <external_mergesort.h>
 #include <fstream>
+#include <functional>
+#include <input_source.h>
 #include <iostream>
 #include <limits>
+#include <memory_budget.h>
 #include <queue>
+#include <set>
+#include <sharded_output.h>
+#include <spill_storage.h>
+#include <storage.h>
 #include <string>
 #include <vector>
 
@@ -13,65 +22,247 @@ using namespace std;
 
 const int64_t BLOCK_SIZE = 4096;
 const int64_t INTS_PER_BLOCK = BLOCK_SIZE / sizeof(int64_t);
-const int64_t TOTAL_MEMORY_RAM = (40 * 1024 * 1024);
+/**
+ * @NATURAL_RUN_BUFFER_BYTES: 1MB. Input and output buffers of form_natural_runs, the rest of
+ * the memory is its heap.
+ */
+const int64_t NATURAL_RUN_BUFFER_BYTES = 1024 * 1024;
+/**
+ * @MIN_MERGE_BUFFER_BYTES: 64KB. Smallest buffer per file merge_fan_in lets a shrunken
+ * budget leave, below it a merge pays a seek every few blocks.
+ */
+const int64_t MIN_MERGE_BUFFER_BYTES = 64 * 1024;
+
+static int64_t max_merge_buffer_bytes = 512 * 1024;
 
-vector<int64_t>
-read_multiple_blocks(const string &filename, int64_t start_block, int64_t num_blocks_to_read);
 void sort_in_memory(vector<int64_t> &data);
-void create_directories(const string &dir);
-void remove_directory(const string &dir);
-void copy_file(const string &src, const string &dst);
+
+/** merge_buffer_bytes
+ * @brief Largest buffer per file of a k-way merge, 512KB unless set_merge_buffer_bytes was called.
+ */
+int64_t merge_buffer_bytes() {
+    return max_merge_buffer_bytes;
+}
+
+/** set_merge_buffer_bytes
+ * @brief Replaces the largest buffer per file of a k-way merge.
+ */
+void set_merge_buffer_bytes(int64_t bytes) {
+    max_merge_buffer_bytes = max(BLOCK_SIZE, bytes);
+}
+
+/** merge_blocks_per_buffer
+ * @brief Number of blocks each input (and the output) buffer holds during a k-way merge.
+ * @param actual_arity Number of input buffers, the files merged at once (twice that plus
+ * one when reading ahead).
+ * @return Blocks per buffer, at least 1.
+ */
+int64_t merge_blocks_per_buffer(int64_t actual_arity) {
+    // Todo: ver si con menos límite "ram", corre en docker
+    const int64_t buffer_size_per_file =
+        min((int64_t)((memory_limit() * 0.9) / (actual_arity + 1)), merge_buffer_bytes());
+    int64_t blocks_per_buffer = buffer_size_per_file / BLOCK_SIZE;
+    if (blocks_per_buffer == 0)
+        blocks_per_buffer = 1;
+    return blocks_per_buffer;
+}
+
+/** merge_fan_in
+ * @brief Number of files merged at once with the current budget.
+ * @param arity Requested merge arity.
+ * @return arity, lowered while elasticity is enabled so each buffer keeps at least
+ * MIN_MERGE_BUFFER_BYTES, and at least 2.
+ */
+int64_t merge_fan_in(int64_t arity) {
+    if (!memory_elasticity().enabled)
+        return arity;
+    int64_t fitting = (int64_t)(memory_limit() * 0.9) / MIN_MERGE_BUFFER_BYTES - 1;
+    return max(int64_t(2), min(arity, fitting));
+}
+
+/** initial_run_blocks
+ * @brief Number of blocks sorted in memory for each Phase 1 run.
+ * @return Blocks per initial run, at least 1.
+ */
+int64_t initial_run_blocks() {
+    int64_t blocks_per_run = memory_limit() / BLOCK_SIZE;
+    if (blocks_per_run == 0)
+        blocks_per_run = 1;
+    return blocks_per_run;
+}
+
+/** gallop_end
+ * @brief End of the stretch of records of values[begin, size) whose key is at most bound.
+ * @details Records are stride values long and start with their key; values[begin] must be
+ * at most bound. Steps 1, 2, 4, ... records from begin until a key passes bound, then a
+ * binary search in the last step: a stretch of n records costs O(log n) comparisons, a
+ * single record just one.
+ * @return Index of the first record whose key is greater than bound, size if there is none.
+ */
+static int64_t gallop_end(
+    const int64_t *values, int64_t begin, int64_t size, int64_t bound, int64_t stride
+) {
+    if (values[size - stride] <= bound)
+        return size;
+    int64_t low = begin;
+    int64_t step = stride;
+    while (begin + step < size && values[begin + step] <= bound) {
+        low = begin + step;
+        step *= 2;
+    }
+    // Binary search over the records between low (at most bound) and high (greater)
+    int64_t high = min(begin + step, size);
+    int64_t first = 1;
+    int64_t last = (high - low) / stride;
+    while (first < last) {
+        int64_t middle = first + (last - first) / 2;
+        if (values[low + middle * stride] <= bound)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return low + first * stride;
+}
 
 /** k_way_merge
  * @brief Performs a k-way merge of multiple sorted files.
  * @param input_files Vector with paths of input files.
  * @param output_file Path of the merged output file.
  * @param arity The maximum number of files to merge at once.
+ * @param backend Backend holding the input and output files.
  * @return Total number of I/O operations performed.
+ * @details With an I/O engine configured (see io_config), the next chunk of every input is
+ * read ahead and the output is written behind through an AsyncIO, keeping up to its queue
+ * depth of requests in flight. If backend spills to several directories this is done with
+ * threads even without an engine, so the inputs and the output placed on different devices
+ * transfer in parallel. Reading ahead splits the same memory in twice as many buffers.
+ * Stretches of an input that lie below every other head are copied out in bulk, so runs
+ * that barely overlap merge at about the cost of a copy. With an aggregation mode (see
+ * set_aggregation) the inputs hold records and the stretches go through a RecordCollapser
+ * instead, so equal keys of different runs leave as one record.
  */
 // Todo: Esperar la respuesta de los aux
 // Todo: Probablemente para el experimento de la aridad haya que limitar la aridad
 // TOdo: o limitar la cantidad de runs, de momento usar aridad 29 o 62
-int64_t k_way_merge(const vector<string> &input_files, const string &output_file, int64_t arity) {
+int64_t k_way_merge(
+    const vector<string> &input_files, const string &output_file, int64_t arity, StorageBackend &backend
+) {
     int64_t actual_arity = min((int64_t)(input_files.size()), arity);
     // if (actual_arity == (int64_t)input_files.size()) {
     //     cout << "DEBUG: using the imput_files size." << endl;
     // }
     int64_t total_io_operations = 0;
     int64_t total_seeks = 0;
-    // Todo: ver si con menos límite "ram", corre en docker
-    const int64_t MAX_BUFFER_SIZE = 1 * 512 * 1024;
-    const int64_t buffer_size_per_file =
-        min((int64_t)((TOTAL_MEMORY_RAM * 0.9) / (actual_arity + 1)), MAX_BUFFER_SIZE);
-    int64_t blocks_per_buffer = buffer_size_per_file / BLOCK_SIZE;
-    if (blocks_per_buffer == 0)
-        blocks_per_buffer = 1;
-    const int64_t BLOCKS_PER_READ = blocks_per_buffer;
 
-    vector<vector<int64_t>> input_buffers(actual_arity);
+    SpillStorage *spill = dynamic_cast<SpillStorage *>(&backend);
+    IOConfig io = io_config();
+    if (io.engine == IOEngine::SYNC && spill && spill->devices() > 1)
+        io = {IOEngine::THREADS, actual_arity + 1};
+    const bool read_ahead = io.engine != IOEngine::SYNC;
+
+    // A buffer per input plus the output one. Reading ahead adds the chunk in flight of
+    // every input and the output buffer being written, so they share the same memory.
+    const int64_t num_buffers = (actual_arity + 1) * (read_ahead ? 2 : 1);
+    int64_t blocks_per_buffer = merge_blocks_per_buffer(num_buffers - 1);
+    const int64_t BLOCKS_PER_READ = blocks_per_buffer;
+    const int64_t BUFFER_ELEMENTS = blocks_per_buffer * INTS_PER_BLOCK;
+    const int64_t BUFFER_BYTES = BUFFER_ELEMENTS * sizeof(int64_t);
+    MemoryReservation reservation(num_buffers * BUFFER_BYTES, "merge buffers", memory_budget());
+    vector<int64_t> memory(num_buffers * BUFFER_ELEMENTS);
+    vector<int64_t *> input_buffers(actual_arity);
+    vector<int64_t *> next_buffers(actual_arity, nullptr);
+    vector<int64_t> input_sizes(actual_arity, 0);
+    vector<int64_t> next_tickets(actual_arity, -1);
+    for (int64_t i = 0; i < actual_arity; i++) {
+        input_buffers[i] = memory.data() + i * BUFFER_ELEMENTS;
+        if (read_ahead)
+            next_buffers[i] = memory.data() + (actual_arity + 1 + i) * BUFFER_ELEMENTS;
+    }
+    int64_t *output_buffer = memory.data() + actual_arity * BUFFER_ELEMENTS;
+    int64_t *writing_buffer = nullptr;
+    if (read_ahead)
+        writing_buffer = memory.data() + (2 * actual_arity + 1) * BUFFER_ELEMENTS;
+    int64_t output_size = 0;
     priority_queue<HeapNode, vector<HeapNode>, greater<HeapNode>> min_heap;
-    vector<int64_t> output_buffer;
-    output_buffer.reserve(blocks_per_buffer * INTS_PER_BLOCK);
+    const int64_t stride = record_elements();
+    const bool collapse = aggregation() != Aggregation::NONE;
+    RecordCollapser collapser;
 
-    ofstream out_file(output_file, ios::binary);
+    unique_ptr<StorageFile> out_file = backend.open(output_file, StorageMode::WRITE);
     if (!out_file)
         exit(EXIT_FAILURE);
+    int64_t out_offset = 0;
+    int64_t write_ticket = -1;
+
+    vector<unique_ptr<StorageFile>> inputs(actual_arity);
+    for (int64_t i = 0; i < actual_arity; i++) {
+        inputs[i] = backend.open(input_files[i], StorageMode::READ);
+        if (!inputs[i]) {
+            cerr << "Error opening file " << input_files[i] << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Declared after the files and the buffers, so its requests end before they are freed
+    unique_ptr<AsyncIO> engine;
+    if (read_ahead) {
+        engine = make_unique<AsyncIO>(io);
+        engine->register_buffer(memory.data(), memory.size() * sizeof(int64_t));
+    }
+
+    // Loads the chunk of input i starting at block into its buffer, queueing the read of the
+    // chunk after it if reading ahead
+    auto read_chunk = [&](int64_t i, int64_t block) {
+        int64_t bytes;
+        if (!read_ahead) {
+            bytes = inputs[i]->read_at(input_buffers[i], BUFFER_BYTES, block * BLOCK_SIZE);
+        } else {
+            bytes = next_tickets[i] < 0 ? 0 : engine->wait(next_tickets[i]);
+            swap(input_buffers[i], next_buffers[i]);
+            next_tickets[i] = -1;
+            if (bytes == BUFFER_BYTES) {
+                int64_t next_offset = (block + BLOCKS_PER_READ) * BLOCK_SIZE;
+                next_tickets[i] = engine->read(*inputs[i], next_buffers[i], BUFFER_BYTES, next_offset);
+            }
+        }
+        input_sizes[i] = bytes / sizeof(int64_t);
+    };
+
+    // Writes the output buffer at out_offset, in the background if reading ahead
+    auto write_output = [&]() {
+        int64_t bytes = output_size * sizeof(int64_t);
+        if (!read_ahead) {
+            out_file->write_at(output_buffer, bytes, out_offset);
+        } else {
+            if (write_ticket >= 0)
+                engine->wait(write_ticket);
+            swap(output_buffer, writing_buffer);
+            write_ticket = engine->write(*out_file, writing_buffer, bytes, out_offset);
+        }
+        out_offset += bytes;
+        output_size = 0;
+    };
 
     // K-way Merge Algoritm:
     // Flow:
     //  - Initially fill buffers from each input file
     //  - Insert the first element from each buffer into the min heap
     //  - While the heap is not empty:
-    //     Extract minimum element and add to output buffer
+    //     Extract minimum element, its buffer is the one to take from
+    //     Gallop through that buffer up to the new minimum of the heap (the second-smallest
+    //     head) and copy the whole stretch to the output buffer: on clustered runs a full
+    //     buffer goes out with one heap operation, on random runs the stretch is one element
     //     When output buffer is full, write to disk
-    //     Get the next element from the buffer that provided the min element
     //     If buffer is exhausted, refill it from the corresponding file
-    //     Insert the new element into the heap
+    //     Insert the element after the stretch into the heap
+    for (int64_t i = 0; i < actual_arity && read_ahead; i++) {
+        next_tickets[i] = engine->read(*inputs[i], next_buffers[i], BUFFER_BYTES, 0);
+    }
     for (int64_t i = 0; i < actual_arity; i++) {
-        input_buffers[i] = read_multiple_blocks(input_files[i], 0, BLOCKS_PER_READ);
-        total_io_operations += (input_buffers[i].size() + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+        read_chunk(i, 0);
+        total_io_operations += (input_sizes[i] + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
         total_seeks++;
-        if (!input_buffers[i].empty()) {
+        if (input_sizes[i] > 0) {
             min_heap.push({input_buffers[i][0], (int64_t)i, 0, 0});
         }
     }
@@ -79,51 +270,75 @@ int64_t k_way_merge(const vector<string> &input_files, const string &output_file
     while (!min_heap.empty()) {
         HeapNode min_node = min_heap.top();
         min_heap.pop();
-        output_buffer.push_back(min_node.value);
-
-        // If output buffer is full, write to disk
-        if ((int64_t)output_buffer.size() == blocks_per_buffer * INTS_PER_BLOCK) {
-            out_file.write(
-                reinterpret_cast<const char *>(output_buffer.data()), blocks_per_buffer * BLOCK_SIZE
-            );
-            output_buffer.clear();
-            total_io_operations += blocks_per_buffer;
+        const int64_t file_index = min_node.file_index;
+        const int64_t bound = min_heap.empty() ? numeric_limits<int64_t>::max() : min_heap.top().value;
+        const int64_t *input = input_buffers[file_index];
+        int64_t begin = min_node.element_index;
+        const int64_t end = gallop_end(input, begin, input_sizes[file_index], bound, stride);
+
+        // Collapse the stretch record by record. BUFFER_ELEMENTS is a multiple of the stride,
+        // so a full buffer always ends at a record boundary.
+        for (; collapse && begin < end; begin += stride) {
+            int64_t count = stride == 2 ? input[begin + 1] : 1;
+            output_size += collapser.add(input[begin], count, output_buffer + output_size);
+            if (output_size == BUFFER_ELEMENTS) {
+                write_output();
+                total_io_operations += blocks_per_buffer;
+            }
+        }
+
+        // Copy the stretch, writing to disk each time the output buffer fills up
+        while (begin < end) {
+            int64_t count = min(end - begin, BUFFER_ELEMENTS - output_size);
+            copy(input + begin, input + begin + count, output_buffer + output_size);
+            output_size += count;
+            begin += count;
+            if (output_size == BUFFER_ELEMENTS) {
+                write_output();
+                total_io_operations += blocks_per_buffer;
+            }
         }
 
-        min_node.element_index++;
+        min_node.element_index = end;
 
         // If buffer is exhausted, refill
-        if (min_node.element_index >= (int64_t)(input_buffers[min_node.file_index].size())) {
+        if (min_node.element_index >= input_sizes[file_index]) {
             min_node.block_index += BLOCKS_PER_READ;
             min_node.element_index = 0;
-            input_buffers[min_node.file_index] = read_multiple_blocks(
-                input_files[min_node.file_index], min_node.block_index, BLOCKS_PER_READ
-            );
-            int64_t blocks_read =
-                (input_buffers[min_node.file_index].size() + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+            read_chunk(file_index, min_node.block_index);
+            int64_t blocks_read = (input_sizes[file_index] + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
             total_io_operations += blocks_read;
             if (blocks_read > 0)
                 total_seeks++;
-            if (!input_buffers[min_node.file_index].empty()) {
-                min_node.value = input_buffers[min_node.file_index][0];
+            if (input_sizes[file_index] > 0) {
+                min_node.value = input_buffers[file_index][0];
                 min_heap.push(min_node);
             }
         } else {
             // get next element
-            min_node.value = input_buffers[min_node.file_index][min_node.element_index];
+            min_node.value = input[min_node.element_index];
             min_heap.push(min_node);
         }
     }
 
+    if (collapse) {
+        output_size += collapser.flush(output_buffer + output_size);
+        if (output_size == BUFFER_ELEMENTS) {
+            write_output();
+            total_io_operations += blocks_per_buffer;
+        }
+    }
+
     // Write any missing data in output buffer
-    if (!output_buffer.empty()) {
-        out_file.write(
-            reinterpret_cast<const char *>(output_buffer.data()), output_buffer.size() * sizeof(int64_t)
-        );
-        total_io_operations += (output_buffer.size() + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+    if (output_size > 0) {
+        total_io_operations += (output_size + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+        write_output();
     }
+    if (write_ticket >= 0)
+        engine->wait(write_ticket);
 
-    out_file.close();
+    engine.reset();
+    out_file.reset();
     return total_io_operations + total_seeks;
 }
 
@@ -135,79 +350,261 @@ int64_t k_way_merge(const vector<string> &input_files, const string &output_file
  * @return Total number of I/O operations performed.
  */
 int64_t external_mergesort(const string &input_file, const string &output_file, int64_t arity) {
+    FileInputSource input(input_file);
+    return external_mergesort(input, output_file, arity);
+}
+
+/** form_runs
+ * @brief Phase 1: cuts the input into memory-sized chunks, sorts each one and writes it
+ * as a run file in spill.
+ * @param input Source of the data to sort.
+ * @param spill Backend where the run files are created.
+ * @param run_files Names of the created runs are appended here, in input order.
+ * @return Number of I/O operations performed.
+ */
+int64_t form_runs(InputSource &input, StorageBackend &spill, vector<string> &run_files) {
     int64_t total_io_operations = 0;
 
-    cout << "  Input file: " << input_file << endl;
-    cout << "  Output file: " << output_file << endl;
+    // This while:
+    // Pulls the input in chunks that fit into memory (blocks_per_run)
+    // For each chunk:
+    //  - Resize the budget from the memory signals, the chunk takes what it allows
+    //  - Read multiple blocks sequentially into memory (one I/O per block if the
+    //    source is stored, none if it is generated on the fly)
+    //  - Sort the entire chunk and collapse its duplicates if aggregating. With COUNT a
+    //    chunk is half the block, whose other half takes the pairs.
+    //  - Writes the chunk in a temp file
+    while (true) {
+        adapt_memory_limit();
+        int64_t blocks_per_run = initial_run_blocks();
+        MemoryReservation reservation(blocks_per_run * BLOCK_SIZE, "initial runs", memory_budget());
+        vector<int64_t> large_block(blocks_per_run * INTS_PER_BLOCK);
+        int64_t chunk_elements = max(int64_t(1), (int64_t)large_block.size() / record_elements());
+        int64_t elements_read = read_full(input, large_block.data(), chunk_elements);
+        if (elements_read == 0)
+            break;
+        large_block.resize(elements_read);
+        if (input.reads_storage())
+            total_io_operations += (elements_read + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
 
-    string temp_dir = "temp_merge_" + to_string(arity) + "/";
-    create_directories(temp_dir);
+        sort_in_memory(large_block);
+        aggregate_sorted(large_block, elements_read);
 
-    ifstream input(input_file, ios::binary | ios::ate);
-    if (!input) {
-        cerr << "Error opening input file: " << input_file << endl;
-        exit(EXIT_FAILURE);
+        string run_file = "run_" + to_string(run_files.size()) + ".bin";
+        unique_ptr<StorageFile> run_out = spill.open(run_file, StorageMode::WRITE);
+        if (!run_out) {
+            cerr << "Error creating run file: " << run_file << endl;
+            exit(EXIT_FAILURE);
+        }
+        run_out->write_at(large_block.data(), large_block.size() * sizeof(int64_t), 0);
+        run_out.reset();
+        total_io_operations += (large_block.size() + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+
+        run_files.push_back(run_file);
     }
 
-    int64_t file_size = input.tellg();
-    input.seekg(0);
-    int64_t num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    int64_t blocks_per_run = TOTAL_MEMORY_RAM / BLOCK_SIZE;
-    if (blocks_per_run == 0)
-        blocks_per_run = 1;
-    int64_t estimated_runs = num_blocks / blocks_per_run;
-    vector<string> run_files;
+    return total_io_operations;
+}
 
-    cout << "  File size: " << file_size << " bytes" << endl;
-    cout << "  Num blocks to process: " << num_blocks << endl;
-    cout << "  Using " << blocks_per_run << " blocks per initial run" << endl;
-    cout << "  Runs: " << estimated_runs << endl;
-    cout << "  Phase 1: Sorting blocks in memory..." << endl;
+/** form_natural_runs
+ * @brief Phase 1 by replacement selection: streams the input through a memory-sized heap
+ * and extends the current run while the incoming values are not smaller than the last
+ * one written.
+ * @details Random input gives runs of about twice the memory, input with existing
+ * ascending order gives runs much longer than the memory (a single run if it is sorted).
+ * @param input Source of the data to sort.
+ * @param spill Backend where the run files are created.
+ * @param run_files Names of the created runs are appended here.
+ * @return Number of I/O operations performed.
+ */
+int64_t form_natural_runs(InputSource &input, StorageBackend &spill, vector<string> &run_files) {
+    int64_t total_io_operations = 0;
+    // The heap spans every run, so the budget is only adapted once, before it is sized
+    adapt_memory_limit();
+    const int64_t HEAP_ELEMENTS = (memory_limit() - 2 * NATURAL_RUN_BUFFER_BYTES) / sizeof(int64_t);
+    const int64_t BUFFER_ELEMENTS = NATURAL_RUN_BUFFER_BYTES / sizeof(int64_t);
+    const int64_t RESERVED_BYTES = HEAP_ELEMENTS * sizeof(int64_t) + 2 * NATURAL_RUN_BUFFER_BYTES;
+    MemoryReservation reservation(RESERVED_BYTES, "replacement selection", memory_budget());
+    const greater<int64_t> min_heap;
 
-    // This for:
-    // Process the input file in chunks that fit into memory (blocks_per_run)
-    // For each chunk:
-    //  - Read multiple blocks sequentially into memory
-    //  - Sort the entire chunk
-    //  - Writes the chunk in a temp file
-    for (int64_t i = 0; i < num_blocks; i += blocks_per_run) {
-        int64_t blocks_to_read = min(blocks_per_run, num_blocks - i);
-        vector<int64_t> large_block;
-        large_block.reserve(blocks_to_read * INTS_PER_BLOCK);
-
-        for (int64_t j = 0; j < blocks_to_read; j++) {
-            vector<int64_t> block(INTS_PER_BLOCK);
-            input.read(reinterpret_cast<char *>(block.data()), BLOCK_SIZE);
-            int64_t elements_read = input.gcount() / sizeof(int64_t);
-            if (elements_read > 0) {
-                block.resize(elements_read);
-                large_block.insert(large_block.end(), block.begin(), block.end());
-            }
-            total_io_operations++;
+    vector<int64_t> current;
+    vector<int64_t> next;
+    current.reserve(HEAP_ELEMENTS);
+    vector<int64_t> input_buffer(BUFFER_ELEMENTS);
+    vector<int64_t> output_buffer;
+    output_buffer.reserve(BUFFER_ELEMENTS);
+
+    unique_ptr<StorageFile> run_out;
+    int64_t run_offset = 0;
+    const bool collapse = aggregation() != Aggregation::NONE;
+    RecordCollapser collapser;
+    int64_t record[2];
+
+    auto flush_output = [&]() {
+        if (output_buffer.empty())
+            return;
+        run_out->write_at(output_buffer.data(), output_buffer.size() * sizeof(int64_t), run_offset);
+        run_offset += output_buffer.size() * sizeof(int64_t);
+        total_io_operations += (output_buffer.size() + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+        output_buffer.clear();
+    };
+    auto push_output = [&](int64_t value) {
+        output_buffer.push_back(value);
+        if ((int64_t)output_buffer.size() == BUFFER_ELEMENTS)
+            flush_output();
+    };
+    // Lets the record held by the collapser into the current run
+    auto flush_collapser = [&]() {
+        int64_t released = collapser.flush(record);
+        for (int64_t i = 0; i < released; i++) {
+            push_output(record[i]);
+        }
+    };
+    auto start_run = [&]() {
+        flush_collapser();
+        flush_output();
+        string run_file = "run_" + to_string(run_files.size()) + ".bin";
+        run_out = spill.open(run_file, StorageMode::WRITE);
+        if (!run_out) {
+            cerr << "Error creating run file: " << run_file << endl;
+            exit(EXIT_FAILURE);
         }
+        run_offset = 0;
+        run_files.push_back(run_file);
+    };
+    auto emit = [&](int64_t value) {
+        if (!collapse) {
+            push_output(value);
+            return;
+        }
+        int64_t released = collapser.add(value, 1, record);
+        for (int64_t i = 0; i < released; i++) {
+            push_output(record[i]);
+        }
+    };
 
-        sort_in_memory(large_block);
+    // This while:
+    // Pulls the input in chunks of BUFFER_ELEMENTS
+    // For each element:
+    //  - While the heap is not full, the element is just added to it
+    //  - Otherwise the smallest element of the heap is written to the current run. The new
+    //    element replaces it if it can still go in this run, else it waits for the next run
+    //  - When the heap runs out, the current run ends and the waiting elements form the
+    //    heap of the next one
+    int64_t last = 0;
+    while (true) {
+        int64_t elements_read = read_full(input, input_buffer.data(), BUFFER_ELEMENTS);
+        if (elements_read == 0)
+            break;
+        if (input.reads_storage())
+            total_io_operations += (elements_read + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
 
-        string run_file = temp_dir + "run_" + to_string(run_files.size()) + ".bin";
-        ofstream run_out(run_file, ios::binary);
-        run_out.write(
-            reinterpret_cast<const char *>(large_block.data()), large_block.size() * sizeof(int64_t)
-        );
-        run_out.close();
-        total_io_operations += (large_block.size() + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+        for (int64_t i = 0; i < elements_read; i++) {
+            int64_t value = input_buffer[i];
+            if ((int64_t)(current.size() + next.size()) < HEAP_ELEMENTS) {
+                current.push_back(value);
+                continue;
+            }
+            if (!run_out) {
+                make_heap(current.begin(), current.end(), min_heap);
+                start_run();
+            }
 
-        run_files.push_back(run_file);
+            pop_heap(current.begin(), current.end(), min_heap);
+            last = current.back();
+            emit(last);
+            if (value >= last) {
+                current.back() = value;
+                push_heap(current.begin(), current.end(), min_heap);
+            } else {
+                current.pop_back();
+                next.push_back(value);
+            }
+
+            if (current.empty()) {
+                swap(current, next);
+                make_heap(current.begin(), current.end(), min_heap);
+                start_run();
+            }
+        }
     }
 
-    cout << "  Generated " << run_files.size() << " run files." << endl;
-    input.close();
+    // Drains the heap: what is left of the current run, then the waiting elements
+    if (!current.empty() || !next.empty()) {
+        if (!run_out)
+            start_run();
+        sort(current.begin(), current.end());
+        for (int64_t value : current) {
+            emit(value);
+        }
+        if (!next.empty()) {
+            start_run();
+            sort(next.begin(), next.end());
+            for (int64_t value : next) {
+                emit(value);
+            }
+        }
+    }
+    flush_collapser();
+    flush_output();
+    run_out.reset();
 
-    cout << "  Phase 2: Performing k-way merge..." << endl;
+    return total_io_operations;
+}
+
+/** split_into_shards
+ * @brief Copies the sorted run run_file of spill into the shards of output_file, a ShardedOutput
+ * of output_shards() files.
+ * @param run_file Final run, empty if there is nothing to sort (every shard is left empty).
+ */
+static void split_into_shards(const string &run_file, StorageBackend &spill, const string &output_file) {
+    ShardedOutput shards(output_file, output_shards());
+    int64_t size = run_file.empty() ? 0 : spill.file_size(run_file);
+    ShardWriter writer(shards, max(int64_t(0), size) / (int64_t)sizeof(int64_t));
+    if (size > 0) {
+        unique_ptr<StorageFile> source = spill.open(run_file, StorageMode::READ);
+        MemoryReservation reservation(NATURAL_RUN_BUFFER_BYTES, "shard buffer", memory_budget());
+        vector<int64_t> buffer(NATURAL_RUN_BUFFER_BYTES / sizeof(int64_t));
+        int64_t offset = 0;
+        int64_t bytes_read;
+        while ((bytes_read = source->read_at(buffer.data(), NATURAL_RUN_BUFFER_BYTES, offset)) > 0) {
+            writer.write(buffer.data(), bytes_read / sizeof(int64_t));
+            offset += bytes_read;
+        }
+    }
+    writer.finish();
+}
+
+/** merge_run_files
+ * @brief Phase 2: merges sorted run files, arity at a time, until one remains and copies
+ * it to output_file, or splits it into its shards if set_output_shards was called.
+ * @param run_files Sorted runs in spill, they are removed as they get merged.
+ * @param spill Backend holding the runs and the intermediate runs.
+ * @param output_file Path of the sorted output file, in the current storage backend.
+ * @param arity Merge arity (number of files to merge simultaneously).
+ * @param keep_runs If true, run_files are left in spill (for RunCache); only the runs made
+ * by the merge are removed.
+ * @return Number of I/O operations performed.
+ */
+int64_t merge_run_files(
+    vector<string> run_files, StorageBackend &spill, const string &output_file, int64_t arity,
+    bool keep_runs
+) {
+    check_aggregation_shards(aggregation(), output_shards());
+    int64_t total_io_operations = 0;
+    // With keep_runs the given runs are read-only: only the intermediate runs are removed
+    set<string> kept;
+    if (keep_runs)
+        kept.insert(run_files.begin(), run_files.end());
+    auto remove_run = [&](const string &file) {
+        if (!kept.count(file))
+            spill.remove(file);
+    };
 
     // This while:
     // Merges runs
     // In each pass, in groups of 'arity' files:
-    //  - Process runs in groups of 'arity' files
+    //  - Process runs in groups of 'arity' files, fewer if the budget shrank (merge_fan_in)
     //  - For each group, merge all runs into a single sorted output file
     //  - After merging, delete the input run files to save disk space
     //  - The new merged runs become input for the next pass
@@ -220,27 +617,28 @@ int64_t external_mergesort(const string &input_file, const string &output_file,
         cout << "    Pass " << pass_number << ": Merging " << run_files.size() << " files with arity "
              << arity << endl;
 
-        for (size_t i = 0; i < run_files.size(); i += arity) {
+        for (size_t i = 0, group = 0; i < run_files.size(); i += group) {
+            adapt_memory_limit();
+            group = merge_fan_in(arity);
             vector<string> files_to_merge;
-            for (size_t j = i; j < i + arity && j < run_files.size(); j++) {
+            for (size_t j = i; j < i + group && j < run_files.size(); j++) {
                 files_to_merge.push_back(run_files[j]);
             }
             if (files_to_merge.size() == 1) {
-                string new_file = temp_dir + "pass_" + to_string(pass_number) + "_" +
-                                  to_string(new_run_files.size()) + ".bin";
-                copy_file(files_to_merge[0], new_file);
+                string new_file = "pass_" + to_string(pass_number) + "_" + to_string(new_run_files.size()) + ".bin";
+                copy_file(files_to_merge[0], new_file, spill, spill);
                 new_run_files.push_back(new_file);
                 if (files_to_merge[0] != new_file) {
-                    remove(files_to_merge[0].c_str());
+                    remove_run(files_to_merge[0]);
                 }
             } else {
-                string merged_file = temp_dir + "pass_" + to_string(pass_number) + "_" +
-                                     to_string(new_run_files.size()) + ".bin";
-                int64_t merge_io = k_way_merge(files_to_merge, merged_file, files_to_merge.size());
+                string merged_file =
+                    "pass_" + to_string(pass_number) + "_" + to_string(new_run_files.size()) + ".bin";
+                int64_t merge_io = k_way_merge(files_to_merge, merged_file, files_to_merge.size(), spill);
                 total_io_operations += merge_io;
                 new_run_files.push_back(merged_file);
                 for (const string &file : files_to_merge) {
-                    remove(file.c_str());
+                    remove_run(file);
                 }
             }
         }
@@ -249,21 +647,109 @@ int64_t external_mergesort(const string &input_file, const string &output_file,
         run_files = new_run_files;
     }
 
-    // Note: To watch if the file is sorted uncommment this and the remove_directory()
-    // and modify the -make read- rule to verify the file
-    if (!run_files.empty()) {
+    // Note: the caller owns output_file (the experiments remove it once it is verified)
+    if (output_shards() > 1) {
+        // Sharded output: the final run is split instead of copied, with the same I/O
+        cout << "  Splitting final file into " << output_shards() << " shards..." << endl;
+        split_into_shards(run_files.empty() ? "" : run_files[0], spill, output_file);
+    } else if (!run_files.empty()) {
         cout << "  Copying final file to output location..." << endl;
-        copy_file(run_files[0], output_file);
-        ifstream final_file(run_files[0], ios::binary | ios::ate);
-        if (final_file) {
-            int64_t size = final_file.tellg();
+        copy_file(run_files[0], output_file, spill, storage());
+    } else if (!storage().open(output_file, StorageMode::WRITE)) {
+        // An empty input still gets its (empty) output, as with external_quicksort
+        cerr << "Error creating output file: " << output_file << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!run_files.empty()) {
+        int64_t size = spill.file_size(run_files[0]);
+        if (size >= 0) {
             total_io_operations += (size + BLOCK_SIZE - 1) / BLOCK_SIZE * 2;
-            final_file.close();
         }
+        // The spill of a sort goes away with it, a kept one must be left as it was given
+        if (keep_runs)
+            remove_run(run_files[0]);
     }
-    remove_directory(output_file);
 
-    cout << "  Clean temporary files..." << endl;
-    remove_directory(temp_dir);
     return total_io_operations;
 }
+
+/** external_mergesort
+ * @brief External Merge Sort whose Phase 1 pulls the data from an InputSource.
+ * @param input Source of the data to sort, a file or a generated stream.
+ * @param output_file Path of the sorted output file.
+ * @param arity Merge arity (number of files to merge simultaneously).
+ * @return Total number of I/O operations performed.
+ */
+int64_t external_mergesort(InputSource &input, const string &output_file, int64_t arity) {
+    check_aggregation_shards(aggregation(), output_shards());
+    int64_t total_io_operations = 0;
+
+    cout << "  Input: " << input.name() << endl;
+    cout << "  Output file: " << output_file << endl;
+    memory_budget().reset_peak();
+
+    // A stream of unknown length (a pipe) is sorted the same way, the spill grows as runs arrive
+    int64_t file_size = max(int64_t(0), input.size()) * sizeof(int64_t);
+    // Runs and merge passes live as extents of a single spill file, sized for the input
+    SpillStorage spill(storage(), "temp_merge_" + to_string(arity), file_size);
+
+    int64_t num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t blocks_per_run = initial_run_blocks();
+    int64_t estimated_runs = num_blocks / blocks_per_run;
+    vector<string> run_files;
+
+    cout << "  File size: " << file_size << " bytes" << endl;
+    cout << "  Num blocks to process: " << num_blocks << endl;
+    cout << "  Using " << blocks_per_run << " blocks per initial run" << endl;
+    cout << "  Runs: " << estimated_runs << endl;
+    cout << "  Phase 1: Sorting blocks in memory..." << endl;
+
+    total_io_operations += form_runs(input, spill, run_files);
+
+    cout << "  Generated " << run_files.size() << " run files." << endl;
+
+    cout << "  Phase 2: Performing k-way merge..." << endl;
+
+    total_io_operations += merge_run_files(run_files, spill, output_file, arity);
+
+    cout << "  " << spill.summary() << endl;
+    cout << "  " << memory_summary() << endl;
+    return total_io_operations;
+}
+
+RunCache::RunCache(const string &input_file) {
+    FileInputSource input(input_file);
+    int64_t file_size = input.size() * sizeof(int64_t);
+    // Room for the runs plus the runs of one merge
+    spill_ = make_unique<SpillStorage>(storage(), "temp_run_cache", 2 * file_size);
+
+    cout << "  Forming the runs of " << input_file << " once..." << endl;
+    auto start_time = chrono::steady_clock::now();
+    phase1_io_ = form_runs(input, *spill_, runs_);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+    cout << "  Cached " << runs_.size() << " runs, " << phase1_io_ << " I/Os in " << elapsed.count()
+         << " seconds" << endl;
+}
+
+RunCache::~RunCache() {
+    for (const string &run : runs_) {
+        spill_->remove(run);
+    }
+}
+
+int64_t RunCache::merge(const string &output_file, int64_t arity) {
+    cout << "  Output file: " << output_file << endl;
+    cout << "  Phase 2: Performing k-way merge of " << runs_.size() << " cached runs..." << endl;
+    memory_budget().reset_peak();
+    int64_t io = phase1_io_ + merge_run_files(runs_, *spill_, output_file, arity, true);
+    cout << "  " << memory_summary() << endl;
+    return io;
+}
+
+int64_t RunCache::phase1_io() const {
+    return phase1_io_;
+}
+
+const vector<string> &RunCache::runs() const {
+    return runs_;
+}
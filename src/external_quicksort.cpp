@@ -1,22 +1,80 @@
+#include <aggregation.h>
 #include <algorithm>
+#include <atomic>
+#include <block_pool.h>
 #include <calculate_arity.h>
 #include <chrono>
 #include <external_quicksort.h>
 #include <fstream>
+#include <input_source.h>
 #include <iostream>
+#include <memory_budget.h>
+#include <mutex>
 #include <random>
+#include <sharded_output.h>
+#include <spill_storage.h>
+#include <splitter_tree.h>
+#include <storage.h>
 #include <string>
-#include <sys/stat.h>
+#include <task_scheduler.h>
 #include <vector>
 
 using namespace std;
 
 const int64_t BLOCK_SIZE = 4096;
 const int64_t INTS_PER_BLOCK = BLOCK_SIZE / sizeof(int64_t);
-const int64_t TOTAL_MEMORY_RAM = 40 * 1024 * 1024;
-const int64_t CONCAT_BUFFER_SIZE = 256 * 1024;
+/**
+ * @CLASSIFY_BATCH: Elements classified by the splitter tree before being scattered.
+ * @FRAME_BYTES: 16KB. Size of a frame of the partition block pool.
+ * @MAX_WRITE_BYTES: 1MB. Largest partition write, also the writer's gather buffer.
+ * @EQUALITY_SINK_SIZE: Elements of an equality bucket counted per batch (they aren't stored).
+ * @REPEATED_KEY_BUFFER_SIZE: 256KB of int64_t written per request when placing an equality bucket.
+ * @SKEW_FACTOR: A partition bigger than SKEW_FACTOR times its share of the input is skewed.
+ * @RESAMPLE_FACTOR, MAX_SAMPLE_BLOCKS: A skewed partition samples RESAMPLE_FACTOR times more
+ * blocks than its parent when it is split again, up to MAX_SAMPLE_BLOCKS.
+ * @MIN_LEVEL_FRAMES: 4. Frames of the pool each partition keeps when a shrunken budget
+ * lowers the arity of a level (64KB writes).
+ */
+const int64_t CLASSIFY_BATCH = 4096;
+const int64_t FRAME_BYTES = 16 * 1024;
+const int64_t MAX_WRITE_BYTES = 1024 * 1024;
+const int64_t EQUALITY_SINK_SIZE = 512;
+const int64_t REPEATED_KEY_BUFFER_SIZE = 256 * 1024 / sizeof(int64_t);
+const int64_t SKEW_FACTOR = 2;
+const int64_t RESAMPLE_FACTOR = 4;
+const int64_t MAX_SAMPLE_BLOCKS = 640;
+const int64_t MIN_LEVEL_FRAMES = 4;
+
+atomic<int64_t> total_io_operations{0};
+
+// Scheduler and memory budget of the running external_quicksort, null when
+// recursive_external_quicksort is called directly (sequential, no admission)
+static TaskScheduler *active_scheduler = nullptr;
+static MemoryBudget *active_budget = nullptr;
+// Shards of the running external_quicksort when the output is split, null otherwise: the
+// top level routes its partitions to them and ignores its output argument
+static ShardedOutput *active_shards = nullptr;
 
-int64_t total_io_operations = 0;
+/**
+ * @brief Byte ranges of the output written by the leaves of an aggregating quicksort.
+ */
+struct LeafExtents {
+    mutex lock;
+    // Offset and bytes of each leaf
+    vector<pair<int64_t, int64_t>> extents;
+
+    void add(int64_t offset, int64_t bytes) {
+        lock_guard<mutex> guard(lock);
+        extents.push_back({offset, bytes});
+    }
+};
+
+// Leaves of the running external_quicksort when it aggregates, null otherwise. A leaf of
+// n values gets room for n records at output_offset * record_elements() and collapses into
+// the start of it, so the leaves are compacted once the recursion ends.
+static LeafExtents *active_leaves = nullptr;
+static int64_t quicksort_threads = 0;
+static atomic<int64_t> next_partition_file{0};
 
 /**
  * @brief List of vector methods used and their purpose:
@@ -27,33 +85,107 @@ int64_t total_io_operations = 0;
  * - swap(vec): Frees the memory by swapping with an empty vector.
  */
 
-vector<int64_t>
-read_multiple_blocks(const string &filename, int64_t start_block, int64_t num_blocks_to_read);
 void sort_in_memory(vector<int64_t> &data);
-void create_directories(const string &dir);
-void remove_directory(const string &dir);
-void copy_file(const string &src, const string &dst);
+
+/** quicksort_read_buffer_bytes
+ * @brief Size of the read buffer used while partitioning a file.
+ * @return Bytes read from the input per I/O.
+ */
+int64_t quicksort_read_buffer_bytes() {
+    return memory_limit() * 0.2;
+}
+
+/** quicksort_frame_elements
+ * @brief Size of each frame of the partition block pool.
+ * @return Number of int64_t per frame.
+ */
+int64_t quicksort_frame_elements() {
+    return FRAME_BYTES / sizeof(int64_t);
+}
+
+/** quicksort_pool_frames
+ * @brief Number of frames in the partition block pool.
+ * @details 70% of the memory, minus the gather buffer of the write-behind thread.
+ */
+int64_t quicksort_pool_frames() {
+    return max(int64_t(2), (int64_t)(memory_limit() * 0.7 - MAX_WRITE_BYTES) / FRAME_BYTES);
+}
+
+/** quicksort_partition_buffer_elements
+ * @brief Size of each partition write: a partition's chain of frames is written once it
+ * holds this many elements.
+ * @details The pool split evenly among the partitions, between one frame and
+ * MAX_WRITE_BYTES. A skewed partition still writes this much per request, since it
+ * takes the frames the small partitions don't use.
+ * @param arity Number of partitions sharing the memory.
+ * @return Number of int64_t per write.
+ */
+int64_t quicksort_partition_buffer_elements(int64_t arity) {
+    int64_t frames = quicksort_pool_frames() / arity;
+    int64_t max_frames = MAX_WRITE_BYTES / FRAME_BYTES;
+    return max(int64_t(1), min(frames, max_frames)) * quicksort_frame_elements();
+}
+
+/** quicksort_level_arity
+ * @brief Number of partitions of a level with the current budget.
+ * @param arity Requested arity.
+ * @return arity, lowered while memory elasticity is enabled so each partition keeps
+ * MIN_LEVEL_FRAMES frames of the pool, and at least 2.
+ */
+int64_t quicksort_level_arity(int64_t arity) {
+    if (!memory_elasticity().enabled)
+        return arity;
+    return max(int64_t(2), min(arity, quicksort_pool_frames() / MIN_LEVEL_FRAMES));
+}
+
+/** quicksort_partitioning_bytes
+ * @brief Memory held while a file is partitioned: read buffer, block pool and gather buffer.
+ */
+int64_t quicksort_partitioning_bytes() {
+    return quicksort_read_buffer_bytes() + quicksort_pool_frames() * FRAME_BYTES + MAX_WRITE_BYTES;
+}
+
+/** set_quicksort_threads
+ * @brief Number of threads external_quicksort sorts partitions with, 0 uses every core.
+ */
+void set_quicksort_threads(int64_t threads) {
+    quicksort_threads = threads;
+}
+
+/** quicksort_in_memory_threshold
+ * @brief Largest file size (in bytes) that is sorted directly in memory.
+ */
+int64_t quicksort_in_memory_threshold() {
+    return memory_limit() / 2;
+}
 
 /**
  * @brief Simplified pivot selection optimized for aridades entre 20-70
  * @param input_file Path to the input binary file
  * @param arity Number of partitions to create (a-way partitioning)
+ * @param sample_blocks Maximum number of blocks sampled
  * @return Vector of arity-1 sorted pivot values
  */
-vector<int64_t> select_pivots(const string &input_file, int64_t arity) {
-    ifstream in(input_file, ios::binary | ios::ate);
-    if (!in) {
-        cerr << "Error opening file " << input_file << endl;
-        exit(EXIT_FAILURE);
-    }
-    int64_t file_size = in.tellg();
-    in.close();
+vector<int64_t> select_pivots(const string &input_file, int64_t arity, int64_t sample_blocks) {
+    FileInputSource input(input_file);
+    return select_pivots(input, arity, sample_blocks);
+}
+
+/**
+ * @brief Pivot selection over any InputSource with random access
+ * @param input Source to sample, its stream position is not changed
+ * @param arity Number of partitions to create (a-way partitioning)
+ * @param sample_blocks Maximum number of blocks sampled
+ * @return Vector of arity-1 sorted pivot values, repeated if the sample is skewed
+ */
+vector<int64_t> select_pivots(InputSource &input, int64_t arity, int64_t sample_blocks) {
+    int64_t file_size = input.size() * sizeof(int64_t);
     total_io_operations++;
     int64_t num_blocks = file_size / BLOCK_SIZE;
     if (num_blocks == 0)
         return {};
 
-    int64_t sample_blocks = min(int64_t(10), num_blocks);
+    sample_blocks = min(sample_blocks, num_blocks);
 
     vector<int64_t> samples;
     samples.reserve(sample_blocks * INTS_PER_BLOCK / 2);
@@ -73,7 +205,8 @@ vector<int64_t> select_pivots(const string &input_file, int64_t arity) {
     positions.erase(last, positions.end());
 
     for (int64_t block_idx : positions) {
-        vector<int64_t> block = read_multiple_blocks(input_file, block_idx, 1);
+        vector<int64_t> block(INTS_PER_BLOCK);
+        block.resize(max(int64_t(0), input.read_at(block_idx * INTS_PER_BLOCK, block.data(), INTS_PER_BLOCK)));
         total_io_operations++;
 
         for (size_t j = 0; j < block.size(); j += 2) {
@@ -99,274 +232,441 @@ vector<int64_t> select_pivots(const string &input_file, int64_t arity) {
 }
 
 /**
- * @brief Simple concatenation of partition files
- * @param sorted_files Vector of paths to sorted files
- * @param output_file Path to the output file
- * @return Number of I/O operations performed
+ * @brief int64_t values of output reserved per input value: record_elements() when the
+ * running sort aggregates, 1 otherwise
  */
-int64_t
-concatenate_partitions(const vector<string> &sorted_files, const string &output_file, int64_t arity) {
-    int64_t io_count = 0;
-    ofstream output(output_file, ios::binary);
+static int64_t leaf_stride() {
+    return active_leaves ? record_elements() : 1;
+}
 
-    if (!output) {
-        cerr << "Error opening output file: " << output_file << endl;
-        exit(EXIT_FAILURE);
+/**
+ * @brief Writes the sorted values of a leaf into output at output_offset, collapsed into
+ * records at the start of its room if the sort aggregates
+ * @param data Sorted values, replaced by their records when aggregating. It must have
+ * capacity for leaf_stride() values per value, the room the pairs are formed in.
+ * @return Number of I/O operations performed
+ */
+static int64_t write_leaf(StorageFile &output, int64_t output_offset, vector<int64_t> &data) {
+    if (!active_leaves) {
+        output.write_at(data.data(), data.size() * sizeof(int64_t), output_offset);
+        return 1;
     }
+    const int64_t offset = output_offset * leaf_stride();
+    aggregate_sorted(data, data.size());
+    const int64_t bytes = data.size() * sizeof(int64_t);
+    output.write_at(data.data(), bytes, offset);
+    active_leaves->add(offset, bytes);
+    return 1;
+}
 
-    // !
-    int64_t buffer_size = CONCAT_BUFFER_SIZE;
-    if (arity >= 32) {
-        buffer_size = CONCAT_BUFFER_SIZE / 2;
-    }
-    if (arity >= 64) {
-        buffer_size = CONCAT_BUFFER_SIZE / 4;
+/**
+ * @brief Writes count copies of key into output starting at output_offset, or its single
+ * record if the sort aggregates
+ * @return Number of I/O operations performed
+ */
+static int64_t write_repeated_key(StorageFile &output, int64_t output_offset, int64_t key, int64_t count) {
+    if (active_leaves) {
+        const int64_t record[2] = {key, count};
+        const int64_t offset = output_offset * leaf_stride();
+        const int64_t bytes = record_elements() * sizeof(int64_t);
+        output.write_at(record, bytes, offset);
+        active_leaves->add(offset, bytes);
+        return 1;
     }
-
-    vector<char> buffer(CONCAT_BUFFER_SIZE);
-
-    // This for:
-    // Iterates over each sorted partition file.
-    // For each file:
-    //  - Opens and reads it in blocks.
-    //  - Writes each block to the final output file.
-    //  - Counts each read and write as an I/O operation.
-    for (const string &file : sorted_files) {
-        ifstream input(file, ios::binary);
-        if (!input)
-            continue;
-
-        input.seekg(0, ios::end);
-        int64_t file_size = input.tellg();
-        input.seekg(0, ios::beg);
-
-        if (file_size <= 0) {
-            input.close();
-            continue;
-        }
-
-        while (input) {
-            input.read(buffer.data(), buffer.size());
-            std::streamsize bytes_read = input.gcount();
-
-            if (bytes_read > 0) {
-                output.write(buffer.data(), bytes_read);
-                io_count += 2;
-            }
-        }
-
-        input.close();
+    int64_t io_count = 0;
+    vector<int64_t> buffer(min(count, REPEATED_KEY_BUFFER_SIZE), key);
+    for (int64_t written = 0; written < count; written += buffer.size()) {
+        int64_t n = min((int64_t)buffer.size(), count - written);
+        output.write_at(buffer.data(), n * sizeof(int64_t), output_offset + written * sizeof(int64_t));
+        io_count++;
     }
-
-    output.close();
     return io_count;
 }
 
 /**
  * @brief Optimized recursive external quicksort implementation
- * @param input_file File to sort
- * @param output_file File where the sorted result will be saved
+ * @param input_file File of spill to sort
+ * @param output Final output file, already sized to hold the whole sorted input
+ * @param output_offset Byte offset in output where the sorted input_file belongs
+ * @param arity Number of partitions to create
+ * @param spill Backend holding the partition files
+ * @param depth Recursion depth (for naming temporary files)
+ * @param sample_blocks Blocks sampled to choose the pivots
+ * @return Number of I/O operations performed
+ */
+int64_t recursive_external_quicksort(
+    const string &input_file, StorageFile &output, int64_t output_offset, int64_t arity, StorageBackend &spill,
+    int64_t depth, int64_t sample_blocks
+) {
+    FileInputSource input(input_file, spill);
+    return recursive_external_quicksort(input, output, output_offset, arity, spill, depth, sample_blocks);
+}
+
+/**
+ * @brief Recursive external quicksort whose first pass pulls from an InputSource
+ * @param input Source of the data to sort, partitions of deeper levels are files
+ * @param output Final output file, already sized to hold the whole sorted input
+ * @param output_offset Byte offset in output where the sorted input belongs
  * @param arity Number of partitions to create
- * @param temp_dir Directory for temporary files
+ * @param spill Backend holding the partition files
  * @param depth Recursion depth (for naming temporary files)
+ * @param sample_blocks Blocks sampled to choose the pivots
  * @return Number of I/O operations performed
  */
 int64_t recursive_external_quicksort(
-    const string &input_file, const string &output_file, int64_t arity, const string &temp_dir,
-    int64_t depth
+    InputSource &input, StorageFile &output, int64_t output_offset, int64_t arity, StorageBackend &spill,
+    int64_t depth, int64_t sample_blocks
 ) {
     int64_t io_operations = 0;
+    // A generated source costs no reads, only the writes are counted
+    const int64_t read_io = input.reads_storage() ? 1 : 0;
 
-    ifstream in_size(input_file, ios::binary | ios::ate);
-    if (!in_size) {
-        cerr << "Error opening input file: " << input_file << endl;
-        exit(EXIT_FAILURE);
-    }
-    int64_t file_size = in_size.tellg();
-    in_size.close();
-    io_operations++;
+    int64_t file_size = input.size() * sizeof(int64_t);
+    io_operations += read_io;
 
     if (file_size == 0) {
-        ofstream(output_file, ios::binary).close();
         return io_operations;
     }
 
-    if (file_size <= TOTAL_MEMORY_RAM / 2) {
-        vector<int64_t> data(file_size / sizeof(int64_t));
-        ifstream in(input_file, ios::binary);
-        in.read(reinterpret_cast<char *>(data.data()), file_size);
-        in.close();
-        io_operations++;
+    // Each level sizes its leaf threshold, buffers and arity from the budget as it is now;
+    // the children get the requested arity back, so it grows again when memory frees up
+    adapt_memory_limit();
+    int64_t level_arity = quicksort_level_arity(arity);
+    // Sharded output: the top level makes a whole number of partitions per shard
+    const bool sharded = depth == 0 && active_shards;
+    if (sharded) {
+        const int64_t shards = active_shards->shards();
+        level_arity = (level_arity + shards - 1) / shards * shards;
+    }
+
+    if (file_size <= quicksort_in_memory_threshold()) {
+        // Reserved up front, so collapsing into pairs never reallocates beyond the lease
+        MemoryLease lease(active_budget, file_size * leaf_stride());
+        vector<int64_t> data;
+        data.reserve(file_size / sizeof(int64_t) * leaf_stride());
+        data.resize(file_size / sizeof(int64_t));
+        read_full(input, data.data(), data.size());
+        io_operations += read_io;
 
         sort_in_memory(data);
 
-        ofstream out(output_file, ios::binary);
-        out.write(reinterpret_cast<const char *>(data.data()), file_size);
-        out.close();
-        io_operations++;
+        if (sharded) {
+            ShardWriter writer(*active_shards, data.size());
+            writer.write(data.data(), data.size());
+            writer.finish();
+            io_operations++;
+        } else {
+            io_operations += write_leaf(output, output_offset, data);
+        }
 
         vector<int64_t>().swap(data);
 
         return io_operations;
     }
 
-    vector<int64_t> pivots = select_pivots(input_file, arity);
-    io_operations += 2;
-    const int64_t READ_BUFFER_BYTES = TOTAL_MEMORY_RAM * 0.2;
-    const int64_t PARTITION_BUFFER_BYTES = (TOTAL_MEMORY_RAM * 0.7) / arity;
-
-    const int64_t MIN_PARTITION_BUFFER = BLOCK_SIZE;
-    const int64_t PARTITION_BUFFER_SIZE =
-        max(PARTITION_BUFFER_BYTES, MIN_PARTITION_BUFFER) / sizeof(int64_t);
-    const int64_t READ_BUFFER_SIZE = READ_BUFFER_BYTES / sizeof(int64_t);
+    vector<int64_t> pivots = select_pivots(input, level_arity, sample_blocks);
+    io_operations += 2 * read_io;
+    // A lone pivot (arity 2) is never repeated, so a partition holding a single key would
+    // recurse on itself forever: doubling it gives its key an equality bucket
+    if (pivots.size() == 1)
+        pivots.push_back(pivots[0]);
 
-    vector<vector<int64_t>> partition_buffers(arity);
-    for (int64_t i = 0; i < arity; i++) {
-        partition_buffers[i].reserve(PARTITION_BUFFER_SIZE);
+    SplitterTree splitters(pivots);
+    vector<int64_t>().swap(pivots);
+    const int64_t num_partitions = splitters.num_buckets();
+    vector<char> is_equality(num_partitions);
+    vector<string> partition_files(num_partitions);
+    vector<int64_t> partition_bytes(num_partitions, 0);
+    for (int64_t i = 0; i < num_partitions; i++) {
+        is_equality[i] = splitters.is_equality_bucket(i);
     }
 
-    vector<string> partition_files(arity);
-    vector<ofstream> partition_streams(arity);
+    // Partitioning holds the read buffer and the block pool. Both are freed before the
+    // children are sorted, so a task never waits for other tasks while holding memory.
+    {
+        MemoryLease lease(active_budget, quicksort_partitioning_bytes());
+        const int64_t READ_BUFFER_BYTES = quicksort_read_buffer_bytes();
+        const int64_t READ_BUFFER_SIZE = READ_BUFFER_BYTES / sizeof(int64_t);
+
+        // Partitions take frames from a shared pool on demand: cursor/frame_end delimit the
+        // free part of the frame each one is filling, full frames wait in its chain until the
+        // chain is worth a large write. Repeated pivots share one bucket of the tree plus an
+        // equality bucket, so there may be fewer than arity partitions. Equality buckets only
+        // count their elements: they scatter into a small sink that is never written, their
+        // key goes straight to the output later.
+        BlockPool pool(
+            quicksort_frame_elements(), quicksort_pool_frames(), MAX_WRITE_BYTES / sizeof(int64_t)
+        );
+        const int64_t FRAME_ELEMENTS = pool.frame_elements();
+        const int64_t WRITE_FRAMES = quicksort_partition_buffer_elements(level_arity) / FRAME_ELEMENTS;
+
+        vector<int64_t *> frame_begin(num_partitions, nullptr);
+        vector<int64_t *> cursor(num_partitions, nullptr);
+        vector<int64_t *> frame_end(num_partitions, nullptr);
+        vector<vector<int64_t *>> chains(num_partitions);
+        vector<int64_t> equality_sink(EQUALITY_SINK_SIZE);
+
+        vector<unique_ptr<StorageFile>> partition_streams(num_partitions);
+
+        for (int64_t i = 0; i < num_partitions; i++) {
+            if (is_equality[i]) {
+                frame_begin[i] = cursor[i] = equality_sink.data();
+                frame_end[i] = equality_sink.data() + EQUALITY_SINK_SIZE;
+                continue;
+            }
 
-    for (int64_t i = 0; i < arity; i++) {
-        partition_files[i] = temp_dir + "partition_" + to_string(depth) + "_" + to_string(i) + ".bin";
-        partition_streams[i].open(partition_files[i], ios::binary);
+            // Sibling partitions are sorted concurrently, so names come from a global counter
+            partition_files[i] = "partition_" + to_string(depth) + "_" + to_string(next_partition_file++) + ".bin";
+            partition_streams[i] = spill.open(partition_files[i], StorageMode::WRITE);
 
-        if (!partition_streams[i]) {
-            cerr << "Error creating partition file: " << partition_files[i] << endl;
-            exit(EXIT_FAILURE);
+            if (!partition_streams[i]) {
+                cerr << "Error creating partition file: " << partition_files[i] << endl;
+                exit(EXIT_FAILURE);
+            }
         }
-    }
 
-    ifstream input(input_file, ios::binary);
-    vector<int64_t> read_buffer(READ_BUFFER_SIZE);
-    vector<int64_t> total_partition_elements(arity, 0);
-
-    // This while:
-    // Reads the input file in fixed-size blocks (READ_BUFFER_BYTES).
-    // For each block read:
-    //  - For each element in the block:
-    //    - Determines which partition it belongs to using the pivots.
-    //    - Adds the element to the corresponding partition buffer (push_back).
-    //    - If the partition buffer is full, writes it to disk and clears it.
-    // Continues until the entire file has been read and partitioned.
-    while (input) {
-        input.read(reinterpret_cast<char *>(read_buffer.data()), READ_BUFFER_BYTES);
-        int64_t elems_read = input.gcount() / sizeof(int64_t);
-
-        if (elems_read == 0) {
-            break;
-        }
+        // Hands the chain of partition p, plus its current frame if include_current, to the
+        // write-behind thread
+        auto write_chain = [&](int64_t p, bool include_current) {
+            int64_t elements = chains[p].size() * FRAME_ELEMENTS;
+            if (include_current && cursor[p] > frame_begin[p]) {
+                chains[p].push_back(frame_begin[p]);
+                elements += cursor[p] - frame_begin[p];
+                frame_begin[p] = cursor[p] = frame_end[p] = nullptr;
+            }
+            if (elements == 0)
+                return;
+            pool.write_behind(partition_streams[p].get(), partition_bytes[p], chains[p], elements);
+            partition_bytes[p] += elements * sizeof(int64_t);
+            chains[p].clear();
+        };
+
+        // Called when partition p has no room left: chains its full frame, writes the chain
+        // once it reaches WRITE_FRAMES and takes a new frame. If every frame is held by a
+        // partition, the longest chain is written early.
+        auto next_frame = [&](int64_t p) {
+            if (is_equality[p]) {
+                partition_bytes[p] += EQUALITY_SINK_SIZE * sizeof(int64_t);
+                cursor[p] = frame_begin[p];
+                return;
+            }
+            if (frame_begin[p]) {
+                chains[p].push_back(frame_begin[p]);
+                frame_begin[p] = cursor[p] = frame_end[p] = nullptr;
+                if ((int64_t)chains[p].size() >= WRITE_FRAMES)
+                    write_chain(p, false);
+            }
 
-        io_operations++;
-
-        // This for:
-        // Iterates over all elements read from the current block.
-        // For each element:
-        //  - Determines the partition using binary search on the pivots.
-        //  - Adds the element to the corresponding partition buffer.
-        //  - If the buffer is full, writes it to disk and clears it.
-        for (int64_t i = 0; i < elems_read; i++) {
-            int64_t val = read_buffer[i];
-
-            int64_t partition_idx = 0;
-            if (!pivots.empty()) {
-                auto it = upper_bound(pivots.begin(), pivots.end(), val);
-                partition_idx = distance(pivots.begin(), it);
+            int64_t *frame;
+            while ((frame = pool.try_acquire()) == nullptr) {
+                int64_t longest = -1;
+                for (int64_t q = 0; q < num_partitions; q++) {
+                    if (longest < 0 || chains[q].size() > chains[longest].size())
+                        longest = q;
+                }
+                if (!chains[longest].empty()) {
+                    write_chain(longest, false);
+                    continue;
+                }
+                // Only current frames are left (arity close to the number of frames)
+                int64_t fullest = -1;
+                for (int64_t q = 0; q < num_partitions; q++) {
+                    if (!is_equality[q] && frame_begin[q] &&
+                        (fullest < 0 || cursor[q] - frame_begin[q] > cursor[fullest] - frame_begin[fullest]))
+                        fullest = q;
+                }
+                write_chain(fullest, true);
             }
+            frame_begin[p] = cursor[p] = frame;
+            frame_end[p] = frame + FRAME_ELEMENTS;
+        };
+
+        vector<int64_t> read_buffer(READ_BUFFER_SIZE);
+        vector<uint32_t> bucket_ids(CLASSIFY_BATCH);
+
+        // This while:
+        // Pulls the input in fixed-size blocks (READ_BUFFER_BYTES).
+        // For each block read:
+        //  - Classifies a batch of elements with the splitter tree.
+        //  - Scatters the batch into the frames of the partitions.
+        //  - If a partition has no room, queues its frame for writing and takes another.
+        // Continues until the entire file has been read and partitioned.
+        while (true) {
+            int64_t elems_read = read_full(input, read_buffer.data(), READ_BUFFER_SIZE);
+
+            if (elems_read == 0) {
+                break;
+            }
+
+            io_operations += read_io;
 
-            partition_buffers[partition_idx].push_back(val);
-            total_partition_elements[partition_idx]++;
-
-            if ((int64_t)partition_buffers[partition_idx].size() >= PARTITION_BUFFER_SIZE) {
-                partition_streams[partition_idx].write(
-                    reinterpret_cast<const char *>(partition_buffers[partition_idx].data()),
-                    partition_buffers[partition_idx].size() * sizeof(int64_t)
-                );
-                io_operations++;
-                partition_buffers[partition_idx].clear();
-                partition_buffers[partition_idx].reserve(PARTITION_BUFFER_SIZE);
+            for (int64_t start = 0; start < elems_read; start += CLASSIFY_BATCH) {
+                int64_t batch = min(CLASSIFY_BATCH, elems_read - start);
+                const int64_t *values = read_buffer.data() + start;
+                splitters.classify(values, batch, bucket_ids.data());
+
+                for (int64_t i = 0; i < batch; i++) {
+                    int64_t partition_idx = bucket_ids[i];
+                    if (cursor[partition_idx] == frame_end[partition_idx])
+                        next_frame(partition_idx);
+                    *cursor[partition_idx]++ = values[i];
+                }
             }
         }
-    }
 
-    input.close();
+        for (int64_t i = 0; i < num_partitions; i++) {
+            if (is_equality[i]) {
+                partition_bytes[i] += (cursor[i] - frame_begin[i]) * sizeof(int64_t);
+            } else {
+                write_chain(i, true);
+            }
+        }
+        pool.drain();
+        io_operations += pool.writes();
 
-    for (int64_t i = 0; i < arity; i++) {
-        if (!partition_buffers[i].empty()) {
-            partition_streams[i].write(
-                reinterpret_cast<const char *>(partition_buffers[i].data()),
-                partition_buffers[i].size() * sizeof(int64_t)
-            );
-            io_operations++;
+        for (int64_t i = 0; i < num_partitions; i++) {
+            partition_streams[i].reset();
         }
-        partition_streams[i].close();
 
-        vector<int64_t>().swap(partition_buffers[i]);
+        vector<int64_t>().swap(read_buffer);
     }
 
-    vector<int64_t>().swap(pivots);
-    vector<int64_t>().swap(read_buffer);
-
-    vector<string> sorted_partition_files;
-    sorted_partition_files.reserve(arity);
-
-    // This for:
-    // Iterates over each generated partition file.
-    // For each partition:
-    //  - If it is empty, skips.
-    //  - If it is very small, sorts it in memory and write.
-    //  - If it is large, recursively calls quicksort.
-    //  - Removes temporary files after processing.
-    for (int64_t i = 0; i < arity; i++) {
-        ifstream file(partition_files[i], ios::binary | ios::ate);
-        int64_t partition_size = 0;
-        if (file) {
-            partition_size = file.tellg();
-            file.close();
+    const int64_t expected_share = file_size / level_arity;
+    int64_t partition_offset = output_offset;
+    atomic<int64_t> children_io{0};
+    TaskGroup children;
+
+    // Sharded output: each partition goes whole to the shard holding the middle of its byte
+    // range, so shards split the keys at partition boundaries and get about file_size /
+    // shards bytes each. A shard is finished by the task that sorts its last partition.
+    vector<int64_t> partition_shard(num_partitions, 0);
+    vector<int64_t> shard_offset(num_partitions, 0);
+    unique_ptr<atomic<int64_t>[]> pending_partitions;
+    if (sharded) {
+        const int64_t shards = active_shards->shards();
+        vector<int64_t> shard_bytes(shards, 0);
+        pending_partitions = make_unique<atomic<int64_t>[]>(shards);
+        int64_t start = 0;
+        for (int64_t i = 0; i < num_partitions; i++) {
+            if (partition_bytes[i] == 0)
+                continue;
+            int64_t shard = min(shards - 1, (start + partition_bytes[i] / 2) * shards / file_size);
+            partition_shard[i] = shard;
+            shard_offset[i] = shard_bytes[shard];
+            shard_bytes[shard] += partition_bytes[i];
+            pending_partitions[shard]++;
+            start += partition_bytes[i];
+        }
+        for (int64_t shard = 0; shard < shards; shard++) {
+            active_shards->file(shard).preallocate(shard_bytes[shard]);
         }
+    }
 
-        if (partition_size <= 0) {
-            sorted_partition_files.push_back(partition_files[i]);
-            continue;
+    // Sorts partition i into target at offset and removes its file
+    auto sort_partition = [&, depth, sample_blocks](int64_t i, StorageFile &target, int64_t offset) {
+        int64_t partition_size = partition_bytes[i];
+        int64_t io = 0;
+
+        if (is_equality[i]) {
+            io += write_repeated_key(target, offset, splitters.equality_key(i), partition_size / sizeof(int64_t));
+            children_io += io;
+            return;
         }
 
         if (partition_size <= BLOCK_SIZE * 2) {
-            vector<int64_t> sdata(partition_size / sizeof(int64_t));
-            ifstream s_file_in(partition_files[i], ios::binary);
-            s_file_in.read(reinterpret_cast<char *>(sdata.data()), partition_size);
-            s_file_in.close();
-            io_operations++;
+            MemoryLease lease(active_budget, partition_size * leaf_stride());
+            vector<int64_t> sdata;
+            sdata.reserve(partition_size / sizeof(int64_t) * leaf_stride());
+            sdata.resize(partition_size / sizeof(int64_t));
+            spill.open(partition_files[i], StorageMode::READ)->read_at(sdata.data(), partition_size, 0);
+            io++;
             sort_in_memory(sdata);
-            string sorted_file = temp_dir + "sorted_" + to_string(depth) + "_" + to_string(i) + ".bin";
-            ofstream s_file_out(sorted_file, ios::binary);
-            s_file_out.write(reinterpret_cast<const char *>(sdata.data()), partition_size);
-            s_file_out.close();
-            io_operations++;
-            sorted_partition_files.push_back(sorted_file);
-            remove(partition_files[i].c_str());
-            continue;
+            io += write_leaf(target, offset, sdata);
+        } else {
+            int64_t child_sample_blocks = PIVOT_SAMPLE_BLOCKS;
+            if (partition_size > SKEW_FACTOR * expected_share) {
+                child_sample_blocks = min(sample_blocks * RESAMPLE_FACTOR, MAX_SAMPLE_BLOCKS);
+            }
+
+            io += recursive_external_quicksort(
+                partition_files[i], target, offset, arity, spill, depth + 1, child_sample_blocks
+            );
         }
 
-        string sorted_file = temp_dir + "sorted_" + to_string(depth) + "_" + to_string(i) + ".bin";
-        io_operations +=
-            recursive_external_quicksort(partition_files[i], sorted_file, arity, temp_dir, depth + 1);
+        spill.remove(partition_files[i]);
+        children_io += io;
+    };
 
-        sorted_partition_files.push_back(sorted_file);
-        if (partition_files[i] != sorted_file) {
-            remove(partition_files[i].c_str());
+    // This for:
+    // Iterates over each partition in key order. Its sorted contents go to
+    // output at partition_offset, right after the previous partitions (or to its
+    // shard at shard_offset when the output is sharded).
+    // For each partition:
+    //  - If it is an equality bucket, writes its key partition_bytes / 8 times (or its
+    //    record, when aggregating).
+    //  - If it is very small, sorts it in memory and writes it.
+    //  - If it is large, recursively calls quicksort, resampling more blocks if the
+    //    partition got much more than its share of the input.
+    //  - Removes temporary files after processing.
+    // Partitions are independent, so each one is a task of the scheduler when there is one.
+    for (int64_t i = 0; i < num_partitions; i++) {
+        int64_t partition_size = partition_bytes[i];
+        if (partition_size == 0) {
+            if (!is_equality[i])
+                spill.remove(partition_files[i]);
+            continue;
         }
-    }
 
-    io_operations += concatenate_partitions(sorted_partition_files, output_file, arity);
-
-    for (const string &file : sorted_partition_files) {
-        remove(file.c_str());
+        StorageFile *target = sharded ? &active_shards->file(partition_shard[i]) : &output;
+        int64_t offset = sharded ? shard_offset[i] : partition_offset;
+        int64_t shard = partition_shard[i];
+        auto task = [&sort_partition, &pending_partitions, sharded, i, target, offset, shard] {
+            sort_partition(i, *target, offset);
+            if (sharded && --pending_partitions[shard] == 0)
+                active_shards->finish(shard);
+        };
+        if (active_scheduler) {
+            active_scheduler->spawn(children, task);
+        } else {
+            task();
+        }
+        partition_offset += partition_size;
+    }
+    if (active_scheduler) {
+        active_scheduler->wait(children);
     }
 
+    io_operations += children_io;
     return io_operations;
 }
 
+/**
+ * @brief Moves the leaves of an aggregating sort to the front of output, in key order, and
+ * cuts output after them
+ * @details Leaves only move towards the start, so each chunk is read before anything is
+ * written over it.
+ * @return Number of I/O operations performed
+ */
+static int64_t compact_leaves(StorageFile &output, LeafExtents &leaves) {
+    int64_t io_count = 0;
+    MemoryLease lease(active_budget, MAX_WRITE_BYTES);
+    vector<char> buffer(MAX_WRITE_BYTES);
+    sort(leaves.extents.begin(), leaves.extents.end());
+    int64_t written = 0;
+    for (const auto &[offset, bytes] : leaves.extents) {
+        for (int64_t moved = 0; moved < bytes && offset != written;) {
+            int64_t n = min(bytes - moved, MAX_WRITE_BYTES);
+            output.read_at(buffer.data(), n, offset + moved);
+            output.write_at(buffer.data(), n, written + moved);
+            io_count += 2;
+            moved += n;
+        }
+        written += bytes;
+    }
+    output.resize(written);
+    return io_count;
+}
+
 /**
  * @brief Implementa el algoritmo External Quick Sort con aridad configurable
  * @param input_file Path del archivo de entrada a ordenar
@@ -375,38 +675,86 @@ int64_t recursive_external_quicksort(
  * @return Número total de operaciones de E/S realizadas
  */
 int64_t external_quicksort(const string &input_file, const string &output_file, int64_t arity) {
+    FileInputSource input(input_file);
+    return external_quicksort(input, output_file, arity);
+}
+
+/**
+ * @brief External Quick Sort cuya primera pasada consume un InputSource
+ * @param input Fuente de los datos, un archivo o una secuencia generada al vuelo
+ * @param output_file Path del archivo de salida ordenado
+ * @param arity Aridad de particionamiento (número de particiones)
+ * @return Número total de operaciones de E/S realizadas
+ */
+int64_t external_quicksort(InputSource &input, const string &output_file, int64_t arity) {
+    check_aggregation_shards(aggregation(), output_shards());
     total_io_operations = 0;
 
-    cout << "  Input file: " << input_file << endl;
+    cout << "  Input: " << input.name() << endl;
     cout << "  Output file: " << output_file << endl;
 
+    int64_t file_size = input.size() * sizeof(int64_t);
+    // Partitions of every level live as extents of a single spill file, sized for the input
     string timestamp = to_string(chrono::system_clock::now().time_since_epoch().count());
-    string temp_dir = "temp_quick_" + to_string(arity) + "_" + timestamp + "/";
-    create_directories(temp_dir);
-
-    ifstream input(input_file, ios::binary | ios::ate);
-    if (!input) {
-        cerr << "Error opening input file: " << input_file << endl;
-        exit(EXIT_FAILURE);
-    }
-    int64_t file_size = input.tellg();
-    input.close();
+    SpillStorage spill(storage(), "temp_quick_" + to_string(arity) + "_" + timestamp, file_size);
     int64_t num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
     cout << "  File size: " << file_size << " bytes (" << file_size / (1024 * 1024) << " MB)" << endl;
     cout << "  Num blocks to process: " << num_blocks << endl;
-    cout << "  Memory available: " << TOTAL_MEMORY_RAM / (1024 * 1024) << " MB" << endl;
+    cout << "  Memory available: " << memory_limit() / (1024 * 1024) << " MB" << endl;
     cout << "  Block size: " << BLOCK_SIZE << " bytes" << endl;
     cout << "  Arity: " << arity << endl;
     cout << "  Phase 1: Running External Quicksort..." << endl;
 
+    TaskScheduler scheduler(quicksort_threads);
+    MemoryBudget &budget = memory_budget();
+    budget.reset_peak();
+    active_scheduler = &scheduler;
+    active_budget = &budget;
+    cout << "  Threads: " << scheduler.num_threads() << endl;
+
     auto start_time = chrono::high_resolution_clock::now();
-    total_io_operations = recursive_external_quicksort(input_file, output_file, arity, temp_dir, 0);
+    // The output is sized once, every sorted leaf is written at its final offset; a sharded
+    // output is sized shard by shard once the top level knows its partitions
+    unique_ptr<StorageFile> output;
+    unique_ptr<ShardedOutput> shards;
+    if (output_shards() > 1) {
+        cout << "  Output shards: " << output_shards() << endl;
+        shards = make_unique<ShardedOutput>(output_file, output_shards());
+        active_shards = shards.get();
+        total_io_operations = recursive_external_quicksort(input, shards->file(0), 0, arity, spill, 0);
+        // Shards that got no partition are finished empty
+        for (int64_t shard = 0; shard < shards->shards(); shard++) {
+            shards->finish(shard);
+        }
+        active_shards = nullptr;
+    } else {
+        output = storage().open(output_file, StorageMode::WRITE);
+        if (!output) {
+            cerr << "Error opening output file: " << output_file << endl;
+            exit(EXIT_FAILURE);
+        }
+        // Aggregating: every value gets room for its record and the leaves are compacted
+        LeafExtents leaves;
+        if (aggregation() != Aggregation::NONE) {
+            cout << "  Aggregation: " << aggregation_name(aggregation()) << endl;
+            active_leaves = &leaves;
+        }
+        output->preallocate(file_size * leaf_stride());
+        total_io_operations = recursive_external_quicksort(input, *output, 0, arity, spill, 0);
+        if (active_leaves) {
+            total_io_operations += compact_leaves(*output, leaves);
+            active_leaves = nullptr;
+        }
+        output.reset();
+    }
     auto end_time = chrono::high_resolution_clock::now();
+    active_scheduler = nullptr;
+    active_budget = nullptr;
     auto duration = chrono::duration_cast<chrono::milliseconds>(end_time - start_time).count();
 
-    cout << "  Clean temporary files..." << endl;
-    remove_directory(temp_dir);
+    cout << "  " << spill.summary() << endl;
+    cout << "  " << memory_summary() << endl;
     cout << "  Total I/O Operations: " << total_io_operations << endl;
     cout << "  Total time: " << duration / 1000.0 << " seconds" << endl;
 
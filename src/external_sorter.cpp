@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <external_sorter.h>
+#include <functional>
+
+using namespace std;
+
+/**
+ * @MIN_BLOCK_BYTES: 512 bytes. Smallest block_bytes accepted.
+ * @MIN_MEMORY_BYTES: 64KB. Smallest memory_bytes accepted.
+ * @MAX_MERGE_BUFFER_BYTES: 1MB. Largest read buffer of a run while merging.
+ * @DECODE_CHUNK: 512 keys. Keys merged per step before being decoded by read().
+ */
+const int64_t MIN_BLOCK_BYTES = 512;
+const int64_t MIN_MEMORY_BYTES = 64 * 1024;
+const int64_t MAX_MERGE_BUFFER_BYTES = 1024 * 1024;
+const int64_t DECODE_CHUNK = 512;
+
+/** blocks_for_bytes
+ * @brief Number of (possibly partial) blocks of block_bytes needed to store bytes bytes.
+ */
+static int64_t blocks_for_bytes(int64_t bytes, int64_t block_bytes) {
+    return (bytes + block_bytes - 1) / block_bytes;
+}
+
+template <typename Key>
+BasicSortedStream<Key>::BasicSortedStream(
+    shared_ptr<SpillStorage> spill, int64_t buffer_bytes, int64_t block_bytes
+)
+    : spill_(move(spill)), buffer_elements_(max(block_bytes, buffer_bytes) / (int64_t)sizeof(Bits)),
+      block_bytes_(block_bytes) {
+}
+
+/** add_run
+ * @brief Adds a run file of the spill to the merge and reads its first chunk.
+ * @return false if the run can't be opened or read.
+ */
+template <typename Key>
+bool BasicSortedStream<Key>::add_run(const string &name) {
+    Run run;
+    run.name = name;
+    run.file = spill_->open(name, StorageMode::READ);
+    if (!run.file) {
+        status_ = {SortStatus::IO_ERROR, "Error opening run " + name};
+        return false;
+    }
+    run.file_bytes = run.file->size();
+    size_ += run.file_bytes / sizeof(Bits);
+    remaining_ += run.file_bytes / sizeof(Bits);
+    runs_.push_back(move(run));
+
+    Run &added = runs_.back();
+    if (refill(added)) {
+        heap_.push_back({added.buffer[0], (int64_t)runs_.size() - 1});
+        push_heap(heap_.begin(), heap_.end(), greater<pair<Bits, int64_t>>());
+    }
+    return status_.ok();
+}
+
+/** add_memory_run
+ * @brief Adds sorted values kept in memory to the merge.
+ */
+template <typename Key>
+void BasicSortedStream<Key>::add_memory_run(vector<Bits> values) {
+    Run run;
+    run.buffer = move(values);
+    size_ += run.buffer.size();
+    remaining_ += run.buffer.size();
+    runs_.push_back(move(run));
+    if (!runs_.back().buffer.empty()) {
+        heap_.push_back({runs_.back().buffer[0], (int64_t)runs_.size() - 1});
+        push_heap(heap_.begin(), heap_.end(), greater<pair<Bits, int64_t>>());
+    }
+}
+
+/** refill
+ * @brief Reads the next chunk of run into its buffer, or removes the run once consumed.
+ * @return true if the buffer holds new values.
+ */
+template <typename Key>
+bool BasicSortedStream<Key>::refill(Run &run) {
+    if (!run.file || run.read_bytes >= run.file_bytes) {
+        vector<Bits>().swap(run.buffer);
+        if (run.file) {
+            run.file.reset();
+            spill_->remove(run.name);
+        }
+        return false;
+    }
+
+    int64_t bytes = min(buffer_elements_ * (int64_t)sizeof(Bits), run.file_bytes - run.read_bytes);
+    run.buffer.resize(bytes / sizeof(Bits));
+    if (run.file->read_at(run.buffer.data(), bytes, run.read_bytes) != bytes) {
+        status_ = {SortStatus::IO_ERROR, "Error reading run " + run.name};
+        return false;
+    }
+    run.read_bytes += bytes;
+    run.position = 0;
+    io_operations_ += blocks_for_bytes(bytes, block_bytes_) + 1;
+    return true;
+}
+
+/** read_bits
+ * @brief Merges the next values into buffer without decoding them.
+ * @return Number of values stored, 0 at the end, -1 on error.
+ */
+template <typename Key>
+int64_t BasicSortedStream<Key>::read_bits(Bits *buffer, int64_t max_elements) {
+    if (!status_.ok())
+        return -1;
+
+    const greater<pair<Bits, int64_t>> min_heap;
+    int64_t n = 0;
+    while (n < max_elements && !heap_.empty()) {
+        pop_heap(heap_.begin(), heap_.end(), min_heap);
+        int64_t r = heap_.back().second;
+        buffer[n++] = heap_.back().first;
+        heap_.pop_back();
+
+        Run &run = runs_[r];
+        if (++run.position == run.buffer.size() && !refill(run)) {
+            if (!status_.ok())
+                return -1;
+            continue;
+        }
+        heap_.push_back({run.buffer[run.position], r});
+        push_heap(heap_.begin(), heap_.end(), min_heap);
+    }
+    remaining_ -= n;
+    return n;
+}
+
+template <typename Key>
+int64_t BasicSortedStream<Key>::read(Key *buffer, int64_t max_elements) {
+    // The keys are merged as bits a chunk at a time and decoded into buffer
+    Bits bits[DECODE_CHUNK];
+    int64_t n = 0;
+    while (n < max_elements) {
+        int64_t got = read_bits(bits, min(DECODE_CHUNK, max_elements - n));
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+        for (int64_t i = 0; i < got; i++) {
+            buffer[n + i] = KeyTraits<Key>::decode(bits[i]);
+        }
+        n += got;
+    }
+    return n;
+}
+
+template <typename Key>
+bool BasicSortedStream<Key>::next(Key &value) {
+    return read(&value, 1) == 1;
+}
+
+template <typename Key>
+int64_t BasicSortedStream<Key>::size() const {
+    return size_;
+}
+
+template <typename Key>
+int64_t BasicSortedStream<Key>::remaining() const {
+    return remaining_;
+}
+
+template <typename Key>
+const SortStatus &BasicSortedStream<Key>::status() const {
+    return status_;
+}
+
+template <typename Key>
+int64_t BasicSortedStream<Key>::io_operations() const {
+    return io_operations_;
+}
+
+template <typename Key>
+BasicExternalSorter<Key>::BasicExternalSorter(const SorterConfig &config)
+    : config_(config), backend_(config.backend ? *config.backend : storage()) {
+    if (config_.memory_bytes < MIN_MEMORY_BYTES) {
+        status_ = {SortStatus::INVALID_ARGUMENT, "memory_bytes must be at least 64KB"};
+    } else if (config_.block_bytes < MIN_BLOCK_BYTES || config_.block_bytes % sizeof(Bits) != 0 ||
+               config_.block_bytes * 16 > config_.memory_bytes) {
+        status_ = {
+            SortStatus::INVALID_ARGUMENT,
+            "block_bytes must be a multiple of the key size in [512, memory/16]"
+        };
+    } else if (config_.threads < 0) {
+        status_ = {SortStatus::INVALID_ARGUMENT, "threads can't be negative"};
+    } else if (config_.arity < 2) {
+        status_ = {SortStatus::INVALID_ARGUMENT, "arity must be at least 2"};
+    } else if (config_.spill.directories.empty()) {
+        status_ = {SortStatus::INVALID_ARGUMENT, "no spill directories"};
+    }
+}
+
+/** fail
+ * @brief Records an error that ends the sort and returns it.
+ */
+template <typename Key>
+SortStatus BasicExternalSorter<Key>::fail(SortStatus::Code code, const string &message) {
+    if (status_.ok())
+        status_ = {code, message};
+    if (config_.log)
+        *config_.log << "ExternalSorter: " << message << endl;
+    return status_;
+}
+
+template <typename Key>
+SortStatus BasicExternalSorter<Key>::add(const Key *values, int64_t count) {
+    if (!status_.ok())
+        return status_;
+    if (finished_)
+        return {SortStatus::INVALID_STATE, "add after finish"};
+    if (count < 0 || (count > 0 && !values))
+        return {SortStatus::INVALID_ARGUMENT, "invalid values"};
+
+    const int64_t capacity = config_.memory_bytes / sizeof(Bits);
+    if (buffer_.capacity() == 0 && count > 0)
+        buffer_.reserve(capacity);
+
+    int64_t added = 0;
+    while (added < count) {
+        int64_t take = min(count - added, capacity - (int64_t)buffer_.size());
+        for (int64_t i = added; i < added + take; i++) {
+            buffer_.push_back(KeyTraits<Key>::encode(values[i]));
+        }
+        added += take;
+
+        if ((int64_t)buffer_.size() == capacity) {
+            sort_buffer();
+            if (!spill_run(buffer_))
+                return status_;
+            buffer_.clear();
+        }
+    }
+    return status_;
+}
+
+template <typename Key>
+SortStatus BasicExternalSorter<Key>::add(const vector<Key> &values) {
+    return add(values.data(), values.size());
+}
+
+/** sort_buffer
+ * @brief Radix sorts buffer_, on the scheduler's threads if there is more than one.
+ */
+template <typename Key>
+void BasicExternalSorter<Key>::sort_buffer() {
+    if (config_.threads != 1 && !scheduler_)
+        scheduler_ = make_unique<TaskScheduler>(config_.threads);
+    radix_sort(buffer_.data(), buffer_.size(), scheduler_.get());
+}
+
+/** spill_run
+ * @brief Writes sorted values as a new run of the spill, creating the spill the first time.
+ * @return false on error.
+ */
+template <typename Key>
+bool BasicExternalSorter<Key>::spill_run(const vector<Bits> &values) {
+    if (!spill_) {
+        spill_ = make_shared<SpillStorage>(backend_, config_.spill_name, 0, config_.spill, false);
+        if (!spill_->ok()) {
+            fail(SortStatus::IO_ERROR, spill_->error());
+            return false;
+        }
+    }
+
+    string name = "run_" + to_string(next_run_++) + ".bin";
+    int64_t bytes = values.size() * sizeof(Bits);
+    unique_ptr<StorageFile> run = spill_->open(name, StorageMode::WRITE);
+    if (!run || run->write_at(values.data(), bytes, 0) != bytes) {
+        string error = spill_->error();
+        fail(SortStatus::IO_ERROR, error.empty() ? "Error writing run " + name : error);
+        return false;
+    }
+    io_operations_ += blocks_for_bytes(bytes, config_.block_bytes);
+    runs_.push_back(name);
+
+    if (config_.log)
+        *config_.log << "ExternalSorter: spilled " << name << " (" << values.size() << " values)" << endl;
+    return true;
+}
+
+/** merge_buffer_bytes
+ * @brief Read buffer of each run when merging runs runs, plus one output buffer, in
+ * memory_bytes.
+ */
+template <typename Key>
+int64_t BasicExternalSorter<Key>::merge_buffer_bytes(int64_t runs, int64_t memory_bytes) const {
+    const int64_t block = config_.block_bytes;
+    int64_t bytes = memory_bytes / (runs + 1) / block * block;
+    return max(block, min(MAX_MERGE_BUFFER_BYTES / block * block, bytes));
+}
+
+/** merge_runs
+ * @brief Merges runs into a new run named merged and removes them.
+ * @return false on error.
+ */
+template <typename Key>
+bool BasicExternalSorter<Key>::merge_runs(
+    const vector<string> &runs, const string &merged, int64_t buffer_bytes
+) {
+    BasicSortedStream<Key> stream(spill_, buffer_bytes, config_.block_bytes);
+    for (const string &run : runs) {
+        if (!stream.add_run(run)) {
+            fail(stream.status().code, stream.status().message);
+            return false;
+        }
+    }
+
+    unique_ptr<StorageFile> out = spill_->open(merged, StorageMode::WRITE);
+    if (!out) {
+        fail(SortStatus::IO_ERROR, "Error creating run " + merged);
+        return false;
+    }
+    vector<Bits> chunk(buffer_bytes / sizeof(Bits));
+    int64_t offset = 0;
+    int64_t n;
+    while ((n = stream.read_bits(chunk.data(), chunk.size())) > 0) {
+        int64_t bytes = n * sizeof(Bits);
+        if (out->write_at(chunk.data(), bytes, offset) != bytes) {
+            string error = spill_->error();
+            fail(SortStatus::IO_ERROR, error.empty() ? "Error writing run " + merged : error);
+            return false;
+        }
+        offset += bytes;
+        io_operations_ += blocks_for_bytes(bytes, config_.block_bytes);
+    }
+    if (n < 0) {
+        fail(stream.status().code, stream.status().message);
+        return false;
+    }
+    io_operations_ += stream.io_operations();
+    return true;
+}
+
+template <typename Key>
+SortStatus BasicExternalSorter<Key>::finish(unique_ptr<BasicSortedStream<Key>> &output) {
+    if (!status_.ok())
+        return status_;
+    if (finished_)
+        return {SortStatus::INVALID_STATE, "finish called twice"};
+    finished_ = true;
+
+    sort_buffer();
+
+    // Nothing was spilled: the output is the buffer itself
+    if (runs_.empty()) {
+        output.reset(new BasicSortedStream<Key>(nullptr, 0, config_.block_bytes));
+        output->add_memory_run(move(buffer_));
+        return status_;
+    }
+
+    // The last buffer joins the final merge from memory if it leaves room for the buffers
+    int64_t tail_bytes = buffer_.size() * sizeof(Bits);
+    bool keep_tail = !buffer_.empty() && tail_bytes <= config_.memory_bytes / 2;
+    if (!keep_tail && !buffer_.empty() && !spill_run(buffer_))
+        return status_;
+    if (!keep_tail)
+        vector<Bits>().swap(buffer_);
+
+    const int64_t merge_memory = config_.memory_bytes - (keep_tail ? tail_bytes : 0);
+    const int64_t fan_in = max(int64_t(2), config_.arity - (keep_tail ? 1 : 0));
+
+    // Extra passes merge arity runs at a time until the final merge can take them all
+    int64_t pass = 0;
+    while ((int64_t)runs_.size() > fan_in) {
+        pass++;
+        vector<string> merged_runs;
+        for (size_t i = 0; i < runs_.size(); i += config_.arity) {
+            vector<string> group(runs_.begin() + i, runs_.begin() + min(runs_.size(), i + config_.arity));
+            if (group.size() == 1) {
+                merged_runs.push_back(group[0]);
+                continue;
+            }
+            string merged = "run_" + to_string(next_run_++) + ".bin";
+            if (!merge_runs(group, merged, merge_buffer_bytes(group.size(), config_.memory_bytes)))
+                return status_;
+            merged_runs.push_back(merged);
+        }
+        if (config_.log)
+            *config_.log << "ExternalSorter: pass " << pass << " merged " << runs_.size() << " runs into "
+                         << merged_runs.size() << endl;
+        runs_ = merged_runs;
+    }
+
+    int64_t buffer_bytes = merge_buffer_bytes(runs_.size(), merge_memory);
+    unique_ptr<BasicSortedStream<Key>> stream(
+        new BasicSortedStream<Key>(spill_, buffer_bytes, config_.block_bytes)
+    );
+    for (const string &run : runs_) {
+        if (!stream->add_run(run))
+            return fail(stream->status().code, stream->status().message);
+    }
+    if (keep_tail)
+        stream->add_memory_run(move(buffer_));
+    runs_.clear();
+
+    if (config_.log)
+        *config_.log << "ExternalSorter: streaming the final merge of " << stream->runs_.size() << " runs, "
+                     << stream->size() << " values" << endl;
+    output = move(stream);
+    return status_;
+}
+
+template <typename Key>
+const SortStatus &BasicExternalSorter<Key>::status() const {
+    return status_;
+}
+
+template <typename Key>
+int64_t BasicExternalSorter<Key>::io_operations() const {
+    return io_operations_;
+}
+
+template class BasicSortedStream<int32_t>;
+template class BasicSortedStream<int64_t>;
+template class BasicSortedStream<uint32_t>;
+template class BasicSortedStream<uint64_t>;
+template class BasicSortedStream<float>;
+template class BasicSortedStream<double>;
+template class BasicSortedStream<Indexed<int32_t>>;
+template class BasicSortedStream<Indexed<int64_t>>;
+template class BasicSortedStream<Indexed<uint32_t>>;
+template class BasicSortedStream<Indexed<uint64_t>>;
+template class BasicSortedStream<Indexed<float>>;
+template class BasicSortedStream<Indexed<double>>;
+
+template class BasicExternalSorter<int32_t>;
+template class BasicExternalSorter<int64_t>;
+template class BasicExternalSorter<uint32_t>;
+template class BasicExternalSorter<uint64_t>;
+template class BasicExternalSorter<float>;
+template class BasicExternalSorter<double>;
+template class BasicExternalSorter<Indexed<int32_t>>;
+template class BasicExternalSorter<Indexed<int64_t>>;
+template class BasicExternalSorter<Indexed<uint32_t>>;
+template class BasicExternalSorter<Indexed<uint64_t>>;
+template class BasicExternalSorter<Indexed<float>>;
+template class BasicExternalSorter<Indexed<double>>;
@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <input_source.h>
+#include <iostream>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * @VERIFY_BUFFER_ELEMENTS: 1MB of int64_t read per request while verifying or fingerprinting.
+ */
+const int64_t VERIFY_BUFFER_ELEMENTS = 1024 * 1024 / sizeof(int64_t);
+
+/** mix64
+ * @brief SplitMix64 finalizer, a bijective 64-bit hash.
+ */
+static uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+FileInputSource::FileInputSource(const string &path, StorageBackend &backend) : path_(path) {
+    file_ = backend.open(path, StorageMode::READ);
+    if (!file_) {
+        cerr << "Error opening input file: " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    size_ = file_->size() / sizeof(int64_t);
+}
+
+int64_t FileInputSource::read(int64_t *buffer, int64_t max_elements) {
+    int64_t n = read_at(position_, buffer, max_elements);
+    position_ += n;
+    return n;
+}
+
+int64_t FileInputSource::read_at(int64_t index, int64_t *buffer, int64_t count) {
+    int64_t bytes = file_->read_at(buffer, count * sizeof(int64_t), index * sizeof(int64_t));
+    return bytes / sizeof(int64_t);
+}
+
+int64_t FileInputSource::size() const {
+    return size_;
+}
+
+void FileInputSource::rewind() {
+    position_ = 0;
+}
+
+bool FileInputSource::reads_storage() const {
+    return true;
+}
+
+string FileInputSource::name() const {
+    return path_;
+}
+
+GeneratedInputSource::GeneratedInputSource(const SequenceConfig &config, int64_t n)
+    : config_(config), n_(n) {
+}
+
+int64_t GeneratedInputSource::read(int64_t *buffer, int64_t max_elements) {
+    int64_t n = read_at(position_, buffer, max_elements);
+    position_ += n;
+    return n;
+}
+
+int64_t GeneratedInputSource::read_at(int64_t index, int64_t *buffer, int64_t count) {
+    int64_t n = max(int64_t(0), min(count, n_ - index));
+    fill_sequence(config_, index, n, n_, buffer);
+    return n;
+}
+
+int64_t GeneratedInputSource::size() const {
+    return n_;
+}
+
+void GeneratedInputSource::rewind() {
+    position_ = 0;
+}
+
+bool GeneratedInputSource::reads_storage() const {
+    return false;
+}
+
+string GeneratedInputSource::name() const {
+    return "generated(seed=" + to_string(config_.seed) + ", n=" + to_string(n_) + ")";
+}
+
+PipeInputSource::PipeInputSource(int fd, int64_t chunk_bytes, int64_t chunks_ahead, int64_t value_bytes)
+    : fd_(fd), value_bytes_(value_bytes), chunk_bytes_(max(int64_t(1), chunk_bytes / value_bytes) * value_bytes),
+      chunks_ahead_(max(int64_t(1), chunks_ahead)) {
+    reader_ = thread(&PipeInputSource::reader_loop, this);
+}
+
+PipeInputSource::~PipeInputSource() {
+    {
+        lock_guard<mutex> lock(mutex_);
+        stop_ = true;
+    }
+    space_.notify_all();
+    reader_.join();
+}
+
+/** reader_loop
+ * @brief Reads fd_ into chunks until the end of the stream, an error, or the source is destroyed.
+ */
+void PipeInputSource::reader_loop() {
+    // A value split across two reads is completed in the next chunk
+    vector<char> pending;
+    bool end = false;
+    string error;
+    while (!end) {
+        vector<char> chunk(chunk_bytes_);
+        int64_t filled = pending.size();
+        copy(pending.begin(), pending.end(), chunk.begin());
+        while (filled < chunk_bytes_) {
+            ssize_t n = ::read(fd_, chunk.data() + filled, chunk_bytes_ - filled);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                error = string("Error reading input: ") + strerror(errno);
+            if (n <= 0) {
+                end = true;
+                break;
+            }
+            filled += n;
+        }
+
+        int64_t whole = filled / value_bytes_ * value_bytes_;
+        pending.assign(chunk.begin() + whole, chunk.begin() + filled);
+        if (end && !pending.empty() && error.empty())
+            error = "Input ends in the middle of a value (" + to_string(pending.size()) + " extra bytes)";
+        chunk.resize(whole);
+
+        unique_lock<mutex> lock(mutex_);
+        space_.wait(lock, [this] { return stop_ || (int64_t)chunks_.size() < chunks_ahead_; });
+        if (stop_)
+            return;
+        if (!chunk.empty())
+            chunks_.push_back(move(chunk));
+        if (end) {
+            done_ = true;
+            error_ = error;
+        }
+        ready_.notify_one();
+    }
+}
+
+int64_t PipeInputSource::read_values(void *buffer, int64_t max_values) {
+    char *out = static_cast<char *>(buffer);
+    int64_t bytes = max_values * value_bytes_;
+    int64_t n = 0;
+    while (n < bytes) {
+        if (position_ == current_.size()) {
+            unique_lock<mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return done_ || !chunks_.empty(); });
+            if (chunks_.empty())
+                break;
+            current_ = move(chunks_.front());
+            chunks_.pop_front();
+            position_ = 0;
+            space_.notify_one();
+        }
+        int64_t take = min(bytes - n, (int64_t)(current_.size() - position_));
+        copy(current_.begin() + position_, current_.begin() + position_ + take, out + n);
+        position_ += take;
+        n += take;
+    }
+    elements_read_ += n / value_bytes_;
+    return n / value_bytes_;
+}
+
+int64_t PipeInputSource::read(int64_t *buffer, int64_t max_elements) {
+    if (value_bytes_ != sizeof(int64_t)) {
+        cerr << "Error: the pipe holds " << value_bytes_ << "-byte values, not int64_t" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return read_values(buffer, max_elements);
+}
+
+int64_t PipeInputSource::read_at(int64_t, int64_t *, int64_t) {
+    return -1;
+}
+
+int64_t PipeInputSource::size() const {
+    return -1;
+}
+
+void PipeInputSource::rewind() {
+    cerr << "Error: a pipe can't be rewound" << endl;
+    exit(EXIT_FAILURE);
+}
+
+bool PipeInputSource::reads_storage() const {
+    return false;
+}
+
+string PipeInputSource::name() const {
+    return "fd " + to_string(fd_);
+}
+
+string PipeInputSource::error() {
+    lock_guard<mutex> lock(mutex_);
+    return error_;
+}
+
+int64_t PipeInputSource::elements_read() const {
+    return elements_read_;
+}
+
+/** read_full
+ * @brief Reads from input until count elements are stored or the stream ends.
+ * @return Number of elements stored in buffer.
+ */
+int64_t read_full(InputSource &input, int64_t *buffer, int64_t count) {
+    int64_t total = 0;
+    while (total < count) {
+        int64_t n = input.read(buffer + total, count - total);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+void Fingerprint::add(int64_t value) {
+    count++;
+    sum += (uint64_t)value;
+    mixed_sum += mix64((uint64_t)value);
+}
+
+void Fingerprint::add(int64_t value, int64_t times) {
+    count += times;
+    sum += (uint64_t)value * (uint64_t)times;
+    mixed_sum += mix64((uint64_t)value) * (uint64_t)times;
+}
+
+/** fingerprint_source
+ * @brief Fingerprints every element of input and rewinds it.
+ */
+Fingerprint fingerprint_source(InputSource &input) {
+    Fingerprint fingerprint;
+    vector<int64_t> buffer(VERIFY_BUFFER_ELEMENTS);
+    input.rewind();
+    int64_t n;
+    while ((n = input.read(buffer.data(), buffer.size())) > 0) {
+        for (int64_t i = 0; i < n; i++) {
+            fingerprint.add(buffer[i]);
+        }
+    }
+    input.rewind();
+    return fingerprint;
+}
+
+/** verify_sorted_output
+ * @brief Checks that path is in non-decreasing order and has the expected fingerprint.
+ * @return true if both checks pass.
+ */
+bool verify_sorted_output(const string &path, const Fingerprint &expected) {
+    if (storage().file_size(path) < 0) {
+        cerr << "Error opening output file: " << path << endl;
+        return false;
+    }
+    FileInputSource output(path);
+    Fingerprint fingerprint;
+    vector<int64_t> buffer(VERIFY_BUFFER_ELEMENTS);
+    bool sorted = true;
+    bool first = true;
+    int64_t previous = 0;
+    int64_t n;
+    while ((n = output.read(buffer.data(), buffer.size())) > 0) {
+        for (int64_t i = 0; i < n; i++) {
+            if (!first && buffer[i] < previous)
+                sorted = false;
+            previous = buffer[i];
+            first = false;
+            fingerprint.add(buffer[i]);
+        }
+    }
+    if (!sorted)
+        cerr << "Output is not sorted: " << path << endl;
+    if (!(fingerprint == expected))
+        cerr << "Output fingerprint doesn't match the input: " << path << endl;
+    return sorted && fingerprint == expected;
+}
@@ -1,7 +1,17 @@
+#include "adaptive_sort.h"
+#include "aggregation.h"
+#include "async_io.h"
+#include "auto_tune.h"
 #include "calculate_arity.h"
 #include "create_secuences.h"
 #include "external_mergesort.h"
 #include "external_quicksort.h"
+#include "input_source.h"
+#include "memory_budget.h"
+#include "sharded_output.h"
+#include "simulate_io.h"
+#include "spill_storage.h"
+#include "storage.h"
 
 #include <chrono>
 #include <iostream>
@@ -47,36 +57,102 @@ void write_sort_results(
     cout << "   Results written in " << results_file << endl;
 }
 
+/**
+ * @brief Appends the time the cost model predicted for a sort next to the measured one, to
+ * results/tuning_predictions.csv.
+ */
+void write_prediction(
+    const string &algorithm, int64_t m, int64_t sequence_number, int64_t arity, double predicted_seconds,
+    double measured_seconds
+) {
+    const string results_file = "results/tuning_predictions.csv";
+    bool file_exists = ifstream(results_file).good();
+    ofstream results_out(results_file, ios::app);
+    if (!results_out) {
+        cerr << "Error opening results file: " << results_file << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!file_exists) {
+        results_out << "algorithm,m,sequence,arity,predicted_seconds,measured_seconds" << endl;
+    }
+    results_out << algorithm << "," << m << "," << sequence_number << "," << arity << ","
+                << predicted_seconds << "," << measured_seconds << endl;
+}
+
+/**
+ * @brief Runs one algorithm ("mergesort", "quicksort" or "adaptive") over n_secuences
+ * sequences of each size in m_mults.
+ * @param virtual_input If true the sequences are generated on the fly while the sort pulls
+ * them (same values create_and_write_M would write), and every output is checked against
+ * the fingerprint of its input.
+ * @param distribution Distribution of the generated sequences, only used with virtual_input.
+ * @param device If not null, the arity and the merge buffer of each size are picked by
+ * tune_sort for this device instead of using arity, and the predicted times are logged.
+ */
 void run_sorting_experiment(
-    const string &algorithm, int64_t arity, const vector<int64_t> &m_mults, int64_t n_secuences
+    const string &algorithm, int64_t arity, const vector<int64_t> &m_mults, int64_t n_secuences,
+    bool virtual_input, Distribution distribution = Distribution::UNIFORM,
+    const DeviceProbe *device = nullptr
 ) {
+    const int64_t M_SIZE = 50 * 1024 * 1024;
     for (int64_t m : m_mults) {
         cout << "==========================================" << endl;
-        cout << "Running: create_and_write_M with m_mult = " << m << endl;
-        const auto start_create{chrono::steady_clock::now()};
-        create_and_write_M(m, n_secuences);
-        const auto finish_create{chrono::steady_clock::now()};
-        const chrono::duration<double> elapsed_seconds_create{finish_create - start_create};
-        cout << "Time used for M= " << m << " " << elapsed_seconds_create.count() << " seconds" << endl;
+        TunedSort tuned;
+        int64_t sort_arity = arity;
+        double predicted = 0;
+        if (device) {
+            tuned = tune_sort(*device, m * M_SIZE);
+            set_merge_buffer_bytes(tuned.merge_buffer_bytes);
+            sort_arity = algorithm == "quicksort" ? tuned.quicksort_arity : tuned.mergesort_arity;
+            predicted = algorithm == "quicksort" ? tuned.quicksort_seconds : tuned.mergesort_seconds;
+            cout << "Tuned for m = " << m << ": mergesort arity " << tuned.mergesort_arity << " with "
+                 << tuned.merge_buffer_bytes / 1024 << " KB merge buffers (predicted "
+                 << tuned.mergesort_seconds << " s), quicksort arity " << tuned.quicksort_arity
+                 << " (predicted " << tuned.quicksort_seconds << " s)" << endl;
+        }
+        if (!virtual_input) {
+            cout << "Running: create_and_write_M with m_mult = " << m << endl;
+            const auto start_create{chrono::steady_clock::now()};
+            create_and_write_M(m, n_secuences);
+            const auto finish_create{chrono::steady_clock::now()};
+            const chrono::duration<double> elapsed_seconds_create{finish_create - start_create};
+            cout << "Time used for M= " << m << " " << elapsed_seconds_create.count() << " seconds" << endl;
+        } else {
+            create_directories("dist/m_" + to_string(m));
+        }
 
         for (int64_t i = 0; i < n_secuences; i++) {
             string input_file = "dist/m_" + to_string(m) + "/secuence_" + to_string(i + 1) + ".bin";
             string output_file = "dist/m_" + to_string(m) + "/sorted_" + to_string(i + 1) + ".bin";
 
+            // Same seeds as create_and_write_M(m, n_secuences)
+            SequenceConfig config;
+            config.seed = m + i;
+            config.distribution = distribution;
+            GeneratedInputSource generated(config, m * M_SIZE / sizeof(int64_t));
+            Fingerprint fingerprint;
+            if (virtual_input)
+                fingerprint = fingerprint_source(generated);
+
             cout << "       Running external " << algorithm << endl;
-            cout << "       Using m_mult = " << m
-                 << (algorithm == "mergesort" ? " and arity = " + to_string(arity) : "") << endl;
+            cout << "       Using m_mult = " << m << " and arity = " << sort_arity << endl;
 
+            SimulatedStorage *simulated = dynamic_cast<SimulatedStorage *>(&storage());
+            if (simulated)
+                simulated->reset_clock();
             const auto start_sort{chrono::steady_clock::now()};
             int64_t total_io = 0;
 
             if (algorithm == "mergesort") {
                 // ! Explicarlo en el informe
-                int64_t mergesort_arity = 10;
-                total_io = external_mergesort(input_file, output_file, mergesort_arity);
+                total_io = virtual_input ? external_mergesort(generated, output_file, sort_arity)
+                                         : external_mergesort(input_file, output_file, sort_arity);
             } else if (algorithm == "quicksort") {
-                int64_t quicksort_arity = 10;
-                total_io = external_quicksort(input_file, output_file, quicksort_arity);
+                total_io = virtual_input ? external_quicksort(generated, output_file, sort_arity)
+                                         : external_quicksort(input_file, output_file, sort_arity);
+            } else if (algorithm == "adaptive") {
+                total_io = virtual_input ? adaptive_sort(generated, output_file, sort_arity)
+                                         : adaptive_sort(input_file, output_file, sort_arity);
             }
 
             const auto finish_sort{chrono::steady_clock::now()};
@@ -84,8 +160,37 @@ void run_sorting_experiment(
 
             double time_seconds = elapsed_seconds_sort.count();
             cout << "       Time: " << time_seconds << " seconds, I/O: " << total_io << endl;
+            // On a simulated device the virtual clock is the time that matters
+            if (simulated) {
+                time_seconds = simulated->elapsed_seconds();
+                cout << "       Simulated " << storage().name() << " time: " << time_seconds
+                     << " seconds, seeks: " << simulated->seeks() << endl;
+            }
 
             write_sort_results(algorithm, m, i + 1, total_io, time_seconds);
+            // Only a tuned run has a prediction to compare against
+            if (device) {
+                cout << "       Predicted " << predicted << " seconds, measured " << time_seconds
+                     << endl;
+                write_prediction(algorithm, m, i + 1, sort_arity, predicted, time_seconds);
+            }
+
+            // The sorts shard their output when asked to
+            bool sharded = storage().file_size(shard_manifest_path(output_file)) >= 0;
+            if (virtual_input) {
+                bool verified;
+                if (sharded)
+                    verified = verify_sharded_output(output_file, output_shards(), fingerprint);
+                else if (aggregation() != Aggregation::NONE)
+                    verified = verify_aggregated_output(output_file, fingerprint);
+                else
+                    verified = verify_sorted_output(output_file, fingerprint);
+                cout << "       Output verified: " << (verified ? "yes" : "NO") << endl;
+            }
+            if (sharded)
+                remove_sharded_output(output_file, output_shards());
+            else
+                storage().remove(output_file);
         }
 
         // Limpiamos los archivos temporales después de procesar cada tamaño m
@@ -97,10 +202,193 @@ void run_sorting_experiment(
     }
 }
 
+/**
+ * @brief Settings of bin/main, given as flags after the experiment and algorithms arguments.
+ */
+struct MainOptions {
+    string backend;
+    bool virtual_input = false;
+    Distribution distribution = Distribution::UNIFORM;
+    bool spill_set = false;
+    SpillConfig spill;
+    bool io_set = false;
+    IOConfig io;
+    int64_t memory_mb = 0;
+    MemoryElasticity elasticity;
+    bool tune = false;
+    int64_t shards = 1;
+    Aggregation aggregation = Aggregation::NONE;
+};
+
+/** usage
+ * @brief Prints the arguments and exits with error.
+ */
+static void usage(const char *program) {
+    cerr << "Usage: " << program << " EXPERIMENT ALGORITHMS [options]" << endl
+         << "  EXPERIMENT           1 arity experiment, 2 simulated sweep, 0 neither" << endl
+         << "  ALGORITHMS           1 mergesort, 2 adaptive_sort picks the plan, 0 neither" << endl
+         << "  --backend B          file, mmap, memory, hdd, ssd or nvme (default file)" << endl
+         << "  --virtual            generate the inputs while sorting instead of writing dist/" << endl
+         << "  --distribution D     uniform, sorted, reverse, nearly_sorted, few_unique, zipf or" << endl
+         << "                       all_equal (default uniform)" << endl
+         << "  --temp-dirs SPEC     spill directories, path[:capacity_mb[:weight]],..." << endl
+         << "  --placement P        round_robin or free_space (default round_robin)" << endl
+         << "  --io-engine E        sync, threads, io_uring or auto (default sync)" << endl
+         << "  --queue-depth N      requests the I/O engine keeps in flight (default 8)" << endl
+         << "  --memory-mb N        memory budget (default 40, less if the cgroup limit is low)" << endl
+         << "  --elastic            resize the budget from the cgroup usage and memory pressure" << endl
+         << "  --memory-file PATH   resize the budget to the MB written in PATH" << endl
+         << "  --tune               pick arity and merge buffers from a device probe" << endl
+         << "  --shards N           split the output in N key ranges with a manifest (default 1)" << endl
+         << "  --aggregation A      none, distinct or count (default none)" << endl;
+    exit(EXIT_FAILURE);
+}
+
+/** parse_number
+ * @brief Parses a non-negative integer flag value, exits with error if it isn't one.
+ */
+static int64_t parse_number(const string &flag, const string &value) {
+    size_t used = 0;
+    int64_t number = -1;
+    try {
+        number = stoll(value, &used);
+    } catch (const exception &) {
+    }
+    if (used != value.size() || number < 0) {
+        cerr << "Invalid value for " << flag << ": " << value << endl;
+        exit(EXIT_FAILURE);
+    }
+    return number;
+}
+
+/** parse_options
+ * @brief Reads the flags of argv that follow the experiment and algorithms arguments.
+ * @warning Exits with error if a flag is unknown or has a bad value.
+ */
+static MainOptions parse_options(int argc, char *argv[]) {
+    MainOptions options;
+    for (int i = 3; i < argc; i++) {
+        string flag = argv[i];
+        if (flag == "--virtual") {
+            options.virtual_input = true;
+            continue;
+        }
+        if (flag == "--elastic") {
+            options.elasticity.enabled = true;
+            continue;
+        }
+        if (flag == "--tune") {
+            options.tune = true;
+            continue;
+        }
+        if (flag == "--help" || i + 1 >= argc)
+            usage(argv[0]);
+        string value = argv[++i];
+        if (flag == "--backend") {
+            options.backend = value;
+        } else if (flag == "--distribution") {
+            options.distribution = parse_distribution(value);
+        } else if (flag == "--temp-dirs") {
+            options.spill.directories = parse_spill_directories(value);
+            options.spill_set = true;
+        } else if (flag == "--placement") {
+            options.spill.placement = parse_spill_placement(value);
+            options.spill_set = true;
+        } else if (flag == "--io-engine") {
+            options.io.engine = parse_io_engine(value);
+            options.io_set = true;
+        } else if (flag == "--queue-depth") {
+            options.io.queue_depth = parse_number(flag, value);
+            options.io_set = true;
+        } else if (flag == "--memory-mb") {
+            options.memory_mb = parse_number(flag, value);
+        } else if (flag == "--memory-file") {
+            options.elasticity.enabled = true;
+            options.elasticity.control_file = value;
+        } else if (flag == "--shards") {
+            options.shards = parse_number(flag, value);
+        } else if (flag == "--aggregation") {
+            options.aggregation = parse_aggregation(value);
+        } else {
+            cerr << "Unknown option: " << flag << endl;
+            usage(argv[0]);
+        }
+    }
+    check_aggregation_shards(options.aggregation, options.shards);
+    return options;
+}
+
+/**
+ * @details Usage: main EXPERIMENT ALGORITHMS [--backend B] [--virtual] [--distribution D]
+ * [--temp-dirs SPEC] [--placement P] [--io-engine E] [--queue-depth N] [--memory-mb N]
+ * [--elastic | --memory-file PATH] [--tune] [--shards N] [--aggregation A]
+ */
 int main(int argc, char *argv[]) {
-    (void)argc;
-    int experiment = stoi(argv[1]);
-    int algorithms = stoi(argv[2]);
+    if (argc < 3 || string(argv[1]) == "--help")
+        usage(argv[0]);
+    int experiment = parse_number("EXPERIMENT", argv[1]);
+    int algorithms = parse_number("ALGORITHMS", argv[2]);
+    MainOptions options = parse_options(argc, argv);
+    if (!options.backend.empty()) {
+        set_storage_backend(make_storage_backend(options.backend));
+        cout << "Using storage backend: " << storage().name() << endl;
+    }
+    // --virtual generates the inputs on the fly instead of writing them to dist/
+    bool virtual_input = options.virtual_input;
+    Distribution distribution = options.distribution;
+    if (options.spill_set) {
+        set_spill_config(options.spill);
+        cout << "Spilling to " << options.spill.directories.size() << " directories" << endl;
+    }
+    // The I/O engine of the merge reads and partition writes
+    if (options.io_set) {
+        set_io_config(options.io);
+        AsyncIO probe(options.io);
+        cout << "I/O engine: " << io_engine_name(probe.engine()) << ", queue depth "
+             << probe.queue_depth() << endl;
+    }
+    if (options.memory_mb > 0)
+        set_memory_limit(options.memory_mb * 1024 * 1024);
+    // Elasticity resizes the budget between runs, merge groups and partitioning levels from
+    // the cgroup usage and memory pressure, or from the MB written in a control file
+    if (options.elasticity.enabled)
+        set_memory_elasticity(options.elasticity);
+    int64_t cgroup_limit = cgroup_memory_limit();
+    cout << "Memory budget: " << memory_limit() / (1024 * 1024) << " MB";
+    if (cgroup_limit > 0)
+        cout << " (cgroup limit " << cgroup_limit / (1024 * 1024) << " MB)";
+    if (memory_elasticity().enabled)
+        cout << ", elastic";
+    cout << endl;
+    // --tune probes the device of the first spill directory (once, the result is cached in
+    // results/device_profiles.csv) and picks the arity and the merge buffer of every input
+    // size with its cost model instead of results/best_arity.txt
+    DeviceProbe device;
+    bool tune = options.tune;
+    // --shards splits the output of the sorts in contiguous key ranges listed in
+    // output_file.manifest, --aggregation collapses their repeated keys
+    set_output_shards(options.shards);
+    set_aggregation(options.aggregation);
+    if (tune) {
+        SimulatedStorage *simulated = dynamic_cast<SimulatedStorage *>(&storage());
+        if (simulated) {
+            device = simulated_device_probe(simulated->profile());
+        } else if (storage().name() == "memory") {
+            cout << "No device to tune for with the memory backend, using the configured arity" << endl;
+            tune = false;
+        } else {
+            device = device_probe(spill_config().directories[0].path);
+        }
+    }
+    if (tune) {
+        cout << "Device " << device.device << (device.cached ? " (cached)" : "") << ": random request "
+             << device.profile.seek_seconds * 1e3 << " ms, read " << device.profile.bandwidth_bytes / 1e6
+             << " MB/s, write " << device.write_bandwidth_bytes / 1e6 << " MB/s" << endl;
+        for (const ProbePoint &point : device.random_reads) {
+            cout << "  Random read of " << point.request_bytes / 1024 << " KB: " << point.seconds * 1e3
+                 << " ms" << endl;
+        }
+    }
     // There is a rule to skip the experiment
     // if argv[1] is 1, run the experiment
     if (experiment == 1) {
@@ -114,6 +402,26 @@ int main(int argc, char *argv[]) {
         cout << "Time used for calculate_arity: " << elapsed_seconds_create.count() << "seconds" << endl;
         cout << "==========================================" << endl;
     }
+    // if argv[1] is 2, run the simulated sweep and validate it against a few real sorts
+    if (experiment == 2) {
+        cout << "==========================================" << endl;
+        cout << "Running: simulated arity sweep between [2, 512]" << endl;
+        const int64_t M_SIZE = 50 * 1024 * 1024;
+        const auto start_sim{chrono::steady_clock::now()};
+        int64_t best_arity = simulated_arity_sweep(60 * M_SIZE, 2, 512, "results/arity_simulated.csv");
+        const auto finish_sim{chrono::steady_clock::now()};
+        const chrono::duration<double> elapsed_seconds_sim{finish_sim - start_sim};
+        cout << "Best simulated arity: " << best_arity << " (" << elapsed_seconds_sim.count() * 1000
+             << " ms)" << endl;
+        ofstream("results/best_arity.txt") << best_arity << endl;
+
+        string input_file = "dist/m_60/secuence_1.bin";
+        if (ifstream(input_file).good()) {
+            create_directories("dist/arity_exp");
+            validate_mergesort_model(input_file, {2, best_arity, 512});
+        }
+        cout << "==========================================" << endl;
+    }
     if (algorithms == 1) {
 
         int64_t n_secuences = 5;
@@ -134,10 +442,28 @@ int main(int argc, char *argv[]) {
         }
 
         // Run quicksort experiment first
-        // run_sorting_experiment("quicksort", arity, m_mults, n_secuences);
+        // run_sorting_experiment("quicksort", arity, m_mults, n_secuences, virtual_input);
 
         // Run mergesort experiment second
-        run_sorting_experiment("mergesort", arity, m_mults, n_secuences);
+        run_sorting_experiment(
+            "mergesort", arity, m_mults, n_secuences, virtual_input, distribution,
+            tune ? &device : nullptr
+        );
+    }
+    // if argv[2] is 2, let adaptive_sort pick the plan for every sequence
+    if (algorithms == 2) {
+        int64_t n_secuences = 5;
+        const vector<int64_t> m_mults{4, 12, 20, 28, 36, 44, 52, 60};
+        int64_t arity = 10;
+        ifstream best_arity_file("results/best_arity.txt");
+        if (best_arity_file) {
+            best_arity_file >> arity;
+            best_arity_file.close();
+        }
+        run_sorting_experiment(
+            "adaptive", arity, m_mults, n_secuences, virtual_input, distribution,
+            tune ? &device : nullptr
+        );
     }
     return 0;
 }
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <memory_budget.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/**
+ * @DEFAULT_MEMORY_BYTES: 40MB. Budget of the sorts, the memory of the assignment (M = 50MB)
+ * minus room for the program itself.
+ * @CGROUP_MEMORY_SHARE: 0.8. Share of a cgroup limit the budget may take, the same 40 of 50MB.
+ * @UNLIMITED_BYTES: 2^60. cgroup v1 reports no limit as a huge number, anything above this.
+ * @MIN_ELASTIC_BYTES: 4MB. Smallest budget adapt_memory_limit leaves, below it the merge
+ * buffers and partition frames would be a few blocks each.
+ */
+const int64_t DEFAULT_MEMORY_BYTES = 40 * 1024 * 1024;
+const double CGROUP_MEMORY_SHARE = 0.8;
+const int64_t UNLIMITED_BYTES = int64_t(1) << 60;
+const int64_t MIN_ELASTIC_BYTES = 4 * 1024 * 1024;
+
+static unique_ptr<MemoryBudget> sorts_budget;
+// Size the budget was created with, the ceiling adapt_memory_limit grows back to
+static int64_t sorts_limit = 0;
+static MemoryElasticity elasticity;
+static mutex adapt_mutex;
+
+MemoryBudget::MemoryBudget(int64_t total_bytes) : total_(total_bytes) {
+}
+
+int64_t MemoryBudget::acquire(int64_t bytes) {
+    unique_lock<mutex> lock(mutex_);
+    bytes = min(bytes, total_);
+    // in_use_ == 0: the budget may have shrunk below bytes after it was capped
+    released_.wait(lock, [&] { return in_use_ + bytes <= total_ || in_use_ == 0; });
+    in_use_ += bytes;
+    peak_ = max(peak_, in_use_);
+    return bytes;
+}
+
+void MemoryBudget::release(int64_t bytes) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        in_use_ -= bytes;
+    }
+    released_.notify_all();
+}
+
+void MemoryBudget::reserve(int64_t bytes, const string &what) {
+    lock_guard<mutex> lock(mutex_);
+    if (in_use_ + bytes > total_) {
+        cerr << "Memory budget exceeded: " << what << " needs " << bytes << " bytes, "
+             << total_ - in_use_ << " of " << total_ << " are free" << endl;
+        exit(EXIT_FAILURE);
+    }
+    in_use_ += bytes;
+    peak_ = max(peak_, in_use_);
+}
+
+void MemoryBudget::resize(int64_t total_bytes) {
+    {
+        lock_guard<mutex> lock(mutex_);
+        total_ = total_bytes;
+    }
+    released_.notify_all();
+}
+
+int64_t MemoryBudget::total() const {
+    lock_guard<mutex> lock(mutex_);
+    return total_;
+}
+
+int64_t MemoryBudget::in_use() {
+    lock_guard<mutex> lock(mutex_);
+    return in_use_;
+}
+
+int64_t MemoryBudget::peak() {
+    lock_guard<mutex> lock(mutex_);
+    return peak_;
+}
+
+void MemoryBudget::reset_peak() {
+    lock_guard<mutex> lock(mutex_);
+    peak_ = in_use_;
+}
+
+MemoryLease::MemoryLease(MemoryBudget *budget, int64_t bytes) : budget_(budget), bytes_(0) {
+    if (budget_)
+        bytes_ = budget_->acquire(bytes);
+}
+
+MemoryLease::~MemoryLease() {
+    if (budget_)
+        budget_->release(bytes_);
+}
+
+MemoryReservation::MemoryReservation(int64_t bytes, const string &what, MemoryBudget &budget)
+    : budget_(budget), bytes_(bytes) {
+    budget_.reserve(bytes_, what);
+}
+
+MemoryReservation::~MemoryReservation() {
+    budget_.release(bytes_);
+}
+
+MemoryBudget &memory_budget() {
+    if (!sorts_budget) {
+        sorts_limit = default_memory_limit();
+        sorts_budget = make_unique<MemoryBudget>(sorts_limit);
+    }
+    return *sorts_budget;
+}
+
+void set_memory_limit(int64_t bytes) {
+    if (sorts_budget && sorts_budget->in_use() > 0) {
+        cerr << "Can't change the memory limit while " << sorts_budget->in_use() << " bytes are leased"
+             << endl;
+        exit(EXIT_FAILURE);
+    }
+    sorts_limit = bytes;
+    sorts_budget = make_unique<MemoryBudget>(bytes);
+}
+
+int64_t memory_limit() {
+    return memory_budget().total();
+}
+
+/** read_limit
+ * @brief Reads a cgroup limit file, -1 if it is missing, says "max" or is too large to be one.
+ */
+static int64_t read_limit(const string &path) {
+    ifstream in(path);
+    string value;
+    if (!(in >> value) || value == "max")
+        return -1;
+    int64_t bytes = stoll(value);
+    return bytes >= UNLIMITED_BYTES ? -1 : bytes;
+}
+
+/** cgroup_v2_dir
+ * @brief Directory of the process' own cgroup v2 group, listed in /proc/self/cgroup as
+ * "0::/path" (just "/" inside a container), empty if there is none.
+ */
+static string cgroup_v2_dir() {
+    ifstream groups("/proc/self/cgroup");
+    string line;
+    while (getline(groups, line)) {
+        if (line.rfind("0::", 0) == 0) {
+            string dir = "/sys/fs/cgroup" + line.substr(3);
+            struct stat info;
+            if (stat((dir + "/memory.current").c_str(), &info) == 0)
+                return dir;
+        }
+    }
+    struct stat info;
+    if (stat("/sys/fs/cgroup/memory.current", &info) == 0)
+        return "/sys/fs/cgroup";
+    return "";
+}
+
+/** read_stat
+ * @brief Value of key in a memory.stat file, -1 if it is missing.
+ */
+static int64_t read_stat(const string &path, const string &key) {
+    ifstream in(path);
+    string name;
+    int64_t value;
+    while (in >> name >> value) {
+        if (name == key)
+            return value;
+    }
+    return -1;
+}
+
+/** read_pressure
+ * @brief "some avg10" of a PSI file, the percentage of the last 10 seconds in which some
+ * task stalled on memory, -1 if it can't be read.
+ */
+static double read_pressure(const string &path) {
+    ifstream in(path);
+    string line;
+    while (getline(in, line)) {
+        size_t avg10 = line.find("avg10=");
+        if (line.rfind("some", 0) == 0 && avg10 != string::npos)
+            return stod(line.substr(avg10 + 6));
+    }
+    return -1;
+}
+
+int64_t cgroup_memory_limit() {
+    string dir = cgroup_v2_dir();
+    if (!dir.empty()) {
+        int64_t limit = read_limit(dir + "/memory.max");
+        if (limit > 0)
+            return limit;
+    }
+    int64_t limit = read_limit("/sys/fs/cgroup/memory.max");
+    if (limit > 0)
+        return limit;
+    return read_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+}
+
+int64_t default_memory_limit() {
+    int64_t cgroup = cgroup_memory_limit();
+    if (cgroup > 0)
+        return min(DEFAULT_MEMORY_BYTES, (int64_t)(cgroup * CGROUP_MEMORY_SHARE));
+    return DEFAULT_MEMORY_BYTES;
+}
+
+const MemoryElasticity &memory_elasticity() {
+    return elasticity;
+}
+
+void set_memory_elasticity(const MemoryElasticity &config) {
+    elasticity = config;
+}
+
+int64_t adapt_memory_limit() {
+    const int64_t MB = 1024 * 1024;
+    MemoryBudget &budget = memory_budget();
+    if (!elasticity.enabled)
+        return budget.total();
+
+    lock_guard<mutex> lock(adapt_mutex);
+    const int64_t current = budget.total();
+    int64_t target = min(sorts_limit, current * 2);
+    string reason = "memory freed";
+
+    if (!elasticity.control_file.empty()) {
+        ifstream control(elasticity.control_file);
+        int64_t mb;
+        if (control >> mb && mb > 0 && mb * MB < target) {
+            target = mb * MB;
+            reason = "control file " + elasticity.control_file;
+        }
+    }
+
+    // The budget may hold what it already has plus a share of the room left under the
+    // cgroup's limit. Usage counts the working set only: page cache of the spill files is
+    // charged to the cgroup too, but the kernel reclaims it before killing anyone.
+    string dir = cgroup_v2_dir();
+    int64_t limit, usage, inactive_file;
+    if (!dir.empty()) {
+        int64_t high = read_limit(dir + "/memory.high");
+        limit = read_limit(dir + "/memory.max");
+        if (high > 0 && (limit < 0 || high < limit))
+            limit = high;
+        usage = read_limit(dir + "/memory.current");
+        inactive_file = read_stat(dir + "/memory.stat", "inactive_file");
+    } else {
+        limit = read_limit("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        usage = read_limit("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+        inactive_file = read_stat("/sys/fs/cgroup/memory/memory.stat", "total_inactive_file");
+    }
+    if (limit > 0 && usage > 0) {
+        int64_t working_set = usage - max(int64_t(0), inactive_file);
+        int64_t room = budget.in_use() + (int64_t)(limit * CGROUP_MEMORY_SHARE) - working_set;
+        if (room < target) {
+            target = room;
+            reason = "cgroup working set " + to_string(working_set / MB) + " of " + to_string(limit / MB)
+                     + " MB";
+        }
+    }
+
+    double pressure = read_pressure(dir.empty() ? "/proc/pressure/memory" : dir + "/memory.pressure");
+    if (pressure > elasticity.psi_threshold && current / 2 < target) {
+        target = current / 2;
+        ostringstream stalled;
+        stalled << "memory pressure " << pressure << "%";
+        reason = stalled.str();
+    }
+
+    // Whole MB, so the room wobbling by a few pages doesn't resize the budget at every call
+    target = max(target / MB * MB, min(MIN_ELASTIC_BYTES, sorts_limit));
+    if (target != current) {
+        cout << "    Memory budget: " << current / MB << " MB -> " << target / MB << " MB (" << reason
+             << ")" << endl;
+        budget.resize(target);
+    }
+    return target;
+}
+
+int64_t peak_rss_bytes() {
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.rfind("VmHWM:", 0) == 0)
+            return stoll(line.substr(6)) * 1024;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return -1;
+    // Linux reports kilobytes, macOS bytes
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * 1024;
+#endif
+}
+
+string memory_summary() {
+    const int64_t MB = 1024 * 1024;
+    MemoryBudget &budget = memory_budget();
+    ostringstream line;
+    line << "Memory: budget " << budget.total() / MB << " MB, peak leased " << budget.peak() / MB
+         << " MB, peak RSS ";
+    int64_t rss = peak_rss_bytes();
+    if (rss < 0)
+        line << "unknown";
+    else
+        line << rss / MB << " MB";
+    return line.str();
+}
@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <iostream>
+#include <set>
+#include <sharded_output.h>
+#include <sstream>
+
+using namespace std;
+
+/**
+ * @VERIFY_BUFFER_ELEMENTS: 1MB of int64_t read per request while verifying.
+ */
+const int64_t VERIFY_BUFFER_ELEMENTS = 1024 * 1024 / sizeof(int64_t);
+
+static int64_t sorts_output_shards = 1;
+
+int64_t output_shards() {
+    return sorts_output_shards;
+}
+
+void set_output_shards(int64_t shards) {
+    if (shards < 1) {
+        cerr << "Invalid number of output shards: " << shards << endl;
+        exit(EXIT_FAILURE);
+    }
+    sorts_output_shards = shards;
+}
+
+string shard_path(const string &output_file, int64_t shard) {
+    return output_file + "." + to_string(shard);
+}
+
+string shard_manifest_path(const string &output_file) {
+    return output_file + ".manifest";
+}
+
+ShardedOutput::ShardedOutput(const string &output_file, int64_t shards)
+    : output_file_(output_file), files_(shards) {
+    for (int64_t i = 0; i < shards; i++) {
+        files_[i] = storage().open(shard_path(output_file, i), StorageMode::WRITE);
+        if (!files_[i]) {
+            cerr << "Error creating output shard: " << shard_path(output_file, i) << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    manifest_ = storage().open(shard_manifest_path(output_file), StorageMode::WRITE);
+    if (!manifest_) {
+        cerr << "Error creating shard manifest: " << shard_manifest_path(output_file) << endl;
+        exit(EXIT_FAILURE);
+    }
+    string header = "shard,path,elements,first_key,last_key\n";
+    manifest_size_ = manifest_->write_at(header.data(), header.size(), 0);
+}
+
+int64_t ShardedOutput::shards() const {
+    return files_.size();
+}
+
+StorageFile &ShardedOutput::file(int64_t shard) {
+    return *files_[shard];
+}
+
+void ShardedOutput::finish(int64_t shard) {
+    lock_guard<mutex> lock(mutex_);
+    if (!files_[shard])
+        return;
+    StorageFile &file = *files_[shard];
+    int64_t elements = file.size() / sizeof(int64_t);
+    ostringstream line;
+    line << shard << "," << shard_path(output_file_, shard) << "," << elements << ",";
+    if (elements > 0) {
+        int64_t first_key, last_key;
+        file.read_at(&first_key, sizeof(int64_t), 0);
+        file.read_at(&last_key, sizeof(int64_t), (elements - 1) * sizeof(int64_t));
+        line << first_key << "," << last_key;
+    } else {
+        line << ",";
+    }
+    line << "\n";
+    files_[shard].reset();
+    string text = line.str();
+    manifest_size_ += manifest_->write_at(text.data(), text.size(), manifest_size_);
+}
+
+ShardWriter::ShardWriter(ShardedOutput &output, int64_t total_elements)
+    : output_(output), total_elements_(total_elements) {
+}
+
+void ShardWriter::write(const int64_t *values, int64_t count) {
+    const int64_t shards = output_.shards();
+    while (count > 0) {
+        int64_t take = count;
+        if (shard_ < shards - 1) {
+            int64_t end = (shard_ + 1) * total_elements_ / shards;
+            if (written_ < end) {
+                take = min(count, end - written_);
+            } else if (shard_elements_ == 0) {
+                // An empty shard whose end is already passed stays empty
+                next_shard();
+                continue;
+            } else {
+                // Past the end of the shard: it keeps the values equal to its last key
+                take = upper_bound(values, values + count, last_value_) - values;
+                if (take == 0) {
+                    next_shard();
+                    continue;
+                }
+            }
+        }
+        output_.file(shard_).write_at(values, take * sizeof(int64_t), shard_elements_ * sizeof(int64_t));
+        shard_elements_ += take;
+        written_ += take;
+        last_value_ = values[take - 1];
+        values += take;
+        count -= take;
+    }
+}
+
+void ShardWriter::next_shard() {
+    const int64_t shards = output_.shards();
+    output_.finish(shard_++);
+    shard_elements_ = 0;
+    while (shard_ < shards - 1 && (shard_ + 1) * total_elements_ / shards <= written_) {
+        output_.finish(shard_++);
+    }
+}
+
+void ShardWriter::finish() {
+    for (; shard_ < output_.shards(); shard_++) {
+        output_.finish(shard_);
+    }
+}
+
+/** read_manifest_shards
+ * @brief Shards listed in the manifest of output_file, empty if it can't be read.
+ */
+static set<int64_t> read_manifest_shards(const string &output_file) {
+    set<int64_t> listed;
+    unique_ptr<StorageFile> manifest =
+        storage().open(shard_manifest_path(output_file), StorageMode::READ);
+    if (!manifest)
+        return listed;
+    string text(manifest->size(), '\0');
+    manifest->read_at(text.data(), text.size(), 0);
+    istringstream lines(text);
+    string line;
+    getline(lines, line);
+    while (getline(lines, line)) {
+        if (!line.empty())
+            listed.insert(stoll(line.substr(0, line.find(','))));
+    }
+    return listed;
+}
+
+bool verify_sharded_output(const string &output_file, int64_t shards, const Fingerprint &expected) {
+    set<int64_t> listed = read_manifest_shards(output_file);
+    if ((int64_t)listed.size() != shards) {
+        cerr << "Manifest lists " << listed.size() << " of " << shards << " shards: "
+             << shard_manifest_path(output_file) << endl;
+        return false;
+    }
+
+    Fingerprint fingerprint;
+    vector<int64_t> buffer(VERIFY_BUFFER_ELEMENTS);
+    bool ordered = true;
+    bool first = true;
+    int64_t previous = 0;
+    for (int64_t shard = 0; shard < shards; shard++) {
+        string path = shard_path(output_file, shard);
+        if (storage().file_size(path) < 0) {
+            cerr << "Error opening output shard: " << path << endl;
+            return false;
+        }
+        FileInputSource input(path);
+        bool shard_start = true;
+        int64_t n;
+        while ((n = input.read(buffer.data(), buffer.size())) > 0) {
+            for (int64_t i = 0; i < n; i++) {
+                // Inside a shard keys may repeat, across shards they may not
+                if (!first && (buffer[i] < previous || (shard_start && buffer[i] == previous))) {
+                    if (ordered)
+                        cerr << "Output shard out of order: " << path << endl;
+                    ordered = false;
+                }
+                previous = buffer[i];
+                first = false;
+                shard_start = false;
+                fingerprint.add(buffer[i]);
+            }
+        }
+    }
+    if (!(fingerprint == expected))
+        cerr << "Output shards' fingerprint doesn't match the input: " << output_file << endl;
+    return ordered && fingerprint == expected;
+}
+
+void remove_sharded_output(const string &output_file, int64_t shards) {
+    for (int64_t shard = 0; shard < shards; shard++) {
+        storage().remove(shard_path(output_file, shard));
+    }
+    storage().remove(shard_manifest_path(output_file));
+}
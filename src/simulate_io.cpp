@@ -0,0 +1,280 @@
+#include <algorithm>
+#include <chrono>
+#include <external_mergesort.h>
+#include <external_quicksort.h>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <simulate_io.h>
+#include <storage.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// simulate_io repite el flujo de control de los sorts externos sin leer ni escribir datos,
+// así el barrido de aridades [2, 512] toma milisegundos en vez de horas.
+
+/**
+ * @BLOCK_SIZE: 4096 bytes. Size of a disk block.
+ * @INTS_PER_BLOCK: 512. Number of int64_t that fit in a block.
+ * @M_SIZE: 50MB. Value of M used by create_secuences.
+ */
+const int64_t BLOCK_SIZE = 4096;
+const int64_t INTS_PER_BLOCK = BLOCK_SIZE / sizeof(int64_t);
+const int64_t M_SIZE = 50 * 1024 * 1024;
+
+/** blocks_for_elements
+ * @brief Number of (possibly partial) blocks needed to store n int64_t.
+ */
+static int64_t blocks_for_elements(int64_t n) {
+    return (n + INTS_PER_BLOCK - 1) / INTS_PER_BLOCK;
+}
+
+/** simulate_k_way_merge
+ * @brief Adds to sim the I/O k_way_merge performs when merging runs of the given sizes.
+ * @param run_elements Number of int64_t in each input run.
+ * @param sim Counters to update.
+ * @return Number of int64_t in the merged run.
+ */
+static int64_t simulate_k_way_merge(const vector<int64_t> &run_elements, SimulatedIO &sim) {
+    int64_t blocks_per_buffer = merge_blocks_per_buffer(run_elements.size());
+    int64_t total_elements = 0;
+
+    // Every run is read in chunks of blocks_per_buffer blocks. The first read always counts
+    // as a seek, refills only when they return data.
+    for (int64_t elements : run_elements) {
+        int64_t blocks = blocks_for_elements(elements);
+        int64_t chunks = (blocks + blocks_per_buffer - 1) / blocks_per_buffer;
+        sim.blocks_read += blocks;
+        sim.seeks += max(int64_t(1), chunks);
+        total_elements += elements;
+    }
+
+    // The output buffer is flushed whenever it holds blocks_per_buffer full blocks
+    int64_t elements_per_flush = blocks_per_buffer * INTS_PER_BLOCK;
+    sim.blocks_written += (total_elements / elements_per_flush) * blocks_per_buffer;
+    sim.blocks_written += blocks_for_elements(total_elements % elements_per_flush);
+    return total_elements;
+}
+
+/** simulate_external_mergesort
+ * @brief Replays the Phase 1/Phase 2 control flow of external_mergesort without touching data.
+ * @param file_size Size in bytes of the input file.
+ * @param arity Merge arity (number of files to merge simultaneously).
+ * @return Exact block, seek and pass counts of the real sort.
+ */
+SimulatedIO simulate_external_mergesort(int64_t file_size, int64_t arity) {
+    SimulatedIO sim;
+    int64_t num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int64_t blocks_per_run = initial_run_blocks();
+    vector<int64_t> runs;
+
+    // Phase 1: each run reads blocks_per_run blocks one at a time and writes them back sorted
+    for (int64_t i = 0; i < num_blocks; i += blocks_per_run) {
+        int64_t blocks_to_read = min(blocks_per_run, num_blocks - i);
+        int64_t bytes = min(blocks_to_read * BLOCK_SIZE, file_size - i * BLOCK_SIZE);
+        int64_t elements = bytes / sizeof(int64_t);
+        sim.blocks_read += blocks_to_read;
+        sim.blocks_written += blocks_for_elements(elements);
+        runs.push_back(elements);
+    }
+
+    // Phase 2: groups of 'arity' runs are merged until one remains. A group with a single
+    // run is copied with copy_file, which the real sort does not count as I/O.
+    while (runs.size() > 1) {
+        sim.passes++;
+        vector<int64_t> new_runs;
+        for (size_t i = 0; i < runs.size(); i += arity) {
+            vector<int64_t> group;
+            for (size_t j = i; j < i + arity && j < runs.size(); j++) {
+                group.push_back(runs[j]);
+            }
+            if (group.size() == 1) {
+                new_runs.push_back(group[0]);
+            } else {
+                new_runs.push_back(simulate_k_way_merge(group, sim));
+            }
+        }
+        runs = new_runs;
+    }
+
+    // Final copy to the output location is counted as one read and one write per block
+    if (!runs.empty()) {
+        int64_t blocks = (runs[0] * (int64_t)sizeof(int64_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        sim.blocks_read += blocks;
+        sim.blocks_written += blocks;
+    }
+
+    sim.levels = sim.passes;
+    sim.total_io = sim.blocks_read + sim.blocks_written + sim.seeks;
+    return sim;
+}
+
+/** simulate_quicksort_level
+ * @brief Adds to sim the I/O of one call of recursive_external_quicksort on n elements.
+ * @details Assumes the pivots split the input in equal parts. Like the real sort, total_io
+ * counts requests (one per buffer read or flushed) instead of blocks. Sorted leaves are
+ * written straight to the output, there is no concatenation pass.
+ */
+static void simulate_quicksort_level(int64_t elements, int64_t arity, int64_t depth, SimulatedIO &sim) {
+    int64_t bytes = elements * sizeof(int64_t);
+    sim.total_io++;
+
+    if (elements == 0) {
+        return;
+    }
+
+    if (bytes <= quicksort_in_memory_threshold()) {
+        sim.blocks_read += blocks_for_elements(elements);
+        sim.blocks_written += blocks_for_elements(elements);
+        sim.seeks += 2;
+        sim.total_io += 2;
+        return;
+    }
+
+    sim.levels = max(sim.levels, depth + 1);
+
+    // select_pivots samples up to 10 blocks
+    int64_t sample_blocks = min(int64_t(10), bytes / BLOCK_SIZE);
+    sim.blocks_read += sample_blocks;
+    sim.seeks += sample_blocks;
+    sim.total_io += 2;
+
+    int64_t read_chunks = (bytes + quicksort_read_buffer_bytes() - 1) / quicksort_read_buffer_bytes();
+    sim.blocks_read += blocks_for_elements(elements);
+    sim.seeks += read_chunks;
+    sim.total_io += read_chunks;
+
+    int64_t partition_buffer = quicksort_partition_buffer_elements(arity);
+    for (int64_t i = 0; i < arity; i++) {
+        int64_t part = elements * (i + 1) / arity - elements * i / arity;
+        int64_t flushes = (part + partition_buffer - 1) / partition_buffer;
+        sim.blocks_written += blocks_for_elements(part);
+        sim.seeks += flushes;
+        sim.total_io += flushes;
+    }
+
+    for (int64_t i = 0; i < arity; i++) {
+        int64_t part = elements * (i + 1) / arity - elements * i / arity;
+        if (part == 0) {
+            continue;
+        }
+        if (part * (int64_t)sizeof(int64_t) <= BLOCK_SIZE * 2) {
+            sim.blocks_read += blocks_for_elements(part);
+            sim.blocks_written += blocks_for_elements(part);
+            sim.seeks += 2;
+            sim.total_io += 2;
+        } else {
+            simulate_quicksort_level(part, arity, depth + 1, sim);
+        }
+    }
+}
+
+/** simulate_external_quicksort
+ * @brief Analytic model of external_quicksort assuming the pivots split evenly.
+ * @param file_size Size in bytes of the input file.
+ * @param arity Partitioning arity (number of partitions to create).
+ * @return Estimated block counts and number of partition levels.
+ */
+SimulatedIO simulate_external_quicksort(int64_t file_size, int64_t arity) {
+    SimulatedIO sim;
+    simulate_quicksort_level(file_size / sizeof(int64_t), arity, 0, sim);
+    sim.passes = sim.levels;
+    return sim;
+}
+
+/** simulated_arity_sweep
+ * @brief Simulates external_mergesort for every arity in [min_arity, max_arity].
+ * @param file_size Size in bytes of the input file.
+ * @param min_arity Minimum arity to test.
+ * @param max_arity Maximum arity to test.
+ * @param results_path CSV file where one row per arity is written.
+ * @return The arity with the lowest simulated I/O count.
+ */
+int64_t simulated_arity_sweep(
+    int64_t file_size, int64_t min_arity, int64_t max_arity, const string &results_path
+) {
+    ofstream results_out(results_path);
+    if (!results_out) {
+        cerr << "Error opening results file: " << results_path << endl;
+        exit(EXIT_FAILURE);
+    }
+    results_out << "arity,blocks_read,blocks_written,seeks,passes,IO_operations,quicksort_levels,"
+                   "quicksort_IO_operations"
+                << endl;
+
+    int64_t optimal_arity = min_arity;
+    int64_t min_io = numeric_limits<int64_t>::max();
+    for (int64_t arity = min_arity; arity <= max_arity; arity++) {
+        SimulatedIO merge = simulate_external_mergesort(file_size, arity);
+        SimulatedIO quick = simulate_external_quicksort(file_size, arity);
+        results_out << arity << "," << merge.blocks_read << "," << merge.blocks_written << ","
+                    << merge.seeks << "," << merge.passes << "," << merge.total_io << ","
+                    << quick.levels << "," << quick.total_io << endl;
+        if (merge.total_io < min_io) {
+            min_io = merge.total_io;
+            optimal_arity = arity;
+        }
+    }
+    results_out.close();
+    return optimal_arity;
+}
+
+/** validate_mergesort_model
+ * @brief Runs the real external_mergesort at a few arities and compares it with the simulation.
+ * @param input_file Path of the input file to sort.
+ * @param arities Arities to validate.
+ * @return Number of arities where the simulated and the measured I/O differ.
+ */
+int64_t validate_mergesort_model(const string &input_file, const vector<int64_t> &arities) {
+    int64_t file_size = storage().file_size(input_file);
+    if (file_size < 0) {
+        cerr << "Error opening input file: " << input_file << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    int64_t mismatches = 0;
+    RunCache runs(input_file);
+    for (int64_t arity : arities) {
+        string output_file = "dist/arity_exp/sorted_" + to_string(arity) + ".bin";
+        int64_t measured = runs.merge(output_file, arity);
+        storage().remove(output_file);
+        int64_t simulated = simulate_external_mergesort(file_size, arity).total_io;
+        cout << "  Arity " << arity << ": measured " << measured << " I/Os, simulated " << simulated
+             << (measured == simulated ? " (OK)" : " (MISMATCH)") << endl;
+        if (measured != simulated)
+            mismatches++;
+    }
+    return mismatches;
+}
+
+#ifdef SIMULATE_IO_MAIN
+/**
+ * @brief Sweeps the arity range for an input of m_mult * M bytes.
+ * @details Usage: simulate_io <m_mult> [min_arity] [max_arity]
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <m_mult> [min_arity] [max_arity]" << endl;
+        return EXIT_FAILURE;
+    }
+    int64_t m_mult = stoll(argv[1]);
+    int64_t min_arity = argc > 2 ? stoll(argv[2]) : 2;
+    int64_t max_arity = argc > 3 ? stoll(argv[3]) : 512;
+    int64_t file_size = m_mult * M_SIZE;
+
+    const auto start{chrono::steady_clock::now()};
+    int64_t best = simulated_arity_sweep(file_size, min_arity, max_arity, "results/arity_simulated.csv");
+    const auto finish{chrono::steady_clock::now()};
+    const chrono::duration<double> elapsed{finish - start};
+
+    SimulatedIO sim = simulate_external_mergesort(file_size, best);
+    cout << "Simulated arities [" << min_arity << ", " << max_arity << "] for M=" << m_mult << " in "
+         << elapsed.count() * 1000 << " ms" << endl;
+    cout << "Best arity: " << best << " (" << sim.total_io << " I/Os, " << sim.passes << " passes, "
+         << sim.seeks << " seeks)" << endl;
+    cout << "Results saved to results/arity_simulated.csv" << endl;
+    return 0;
+}
+#endif
@@ -0,0 +1,555 @@
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <column_gather.h>
+#include <cstring>
+#include <external_sorter.h>
+#include <input_source.h>
+#include <iostream>
+#include <sort_keys.h>
+#include <spill_storage.h>
+#include <splitter_tree.h>
+#include <stdexcept>
+#include <string>
+#include <task_scheduler.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// sort_cli ordena un stream binario de claves (int64_t por defecto) de stdin a stdout, sin
+// archivos de entrada ni de salida, para usarlo dentro de pipelines. Con --argsort escribe
+// la permutación (la posición de entrada de cada clave, en orden) en vez de las claves.
+
+/**
+ * @READ_CHUNK_BYTES: 1MB. Largest chunk the reader thread fills from stdin, at most 1/16 of
+ * the memory.
+ * @READ_AHEAD_CHUNKS: 4. Chunks read ahead of the sort.
+ * @GATHER_MEMORY_SHARE: 4. With --gather, 1/4 of the memory holds the batches of the gather.
+ */
+const int64_t READ_CHUNK_BYTES = 1024 * 1024;
+const int64_t READ_AHEAD_CHUNKS = 4;
+const int64_t GATHER_MEMORY_SHARE = 4;
+
+/**
+ * @brief Settings taken from the command line.
+ */
+struct CliOptions {
+    int64_t memory_bytes = 40 * 1024 * 1024;
+    int64_t block_bytes = 4096;
+    int64_t threads = 1;
+    int64_t arity = 64;
+    int64_t chunk_bytes = READ_CHUNK_BYTES;
+    string algorithm = "merge";
+    string key_type = "i64";
+    SpillConfig spill = spill_config();
+    bool verbose = false;
+    bool argsort = false;
+    vector<GatherColumn> gather;
+};
+
+// Gather of the running --argsort, null without --gather
+static ColumnGather *active_gather = nullptr;
+
+/** usage
+ * @brief Prints the flags and exits with error.
+ */
+static void usage(const char *program) {
+    cerr << "Usage: " << program << " [options] < input.bin > sorted.bin" << endl
+         << "  --memory-mb N        memory for buffers (default 40)" << endl
+         << "  --block-size BYTES   disk block size (default 4096)" << endl
+         << "  --temp-dirs SPEC     spill directories, path[:capacity_mb[:weight]],... (default .)" << endl
+         << "  --placement P        round_robin or free_space (default round_robin)" << endl
+         << "  --algorithm A        merge or quick (default merge)" << endl
+         << "  --key-type T         i32, i64, u32, u64, f32 or f64 (default i64)" << endl
+         << "  --threads N          threads sorting in memory, 0 uses every core (default 1)" << endl
+         << "  --arity N            runs merged or partitions made at once (default 64)" << endl
+         << "  --argsort            write the input position (u64) of each key in sorted order" << endl
+         << "  --gather SPEC        with --argsort, reorder columns, input:width:output,..." << endl
+         << "  --verbose            progress on stderr" << endl;
+    exit(EXIT_FAILURE);
+}
+
+/** parse_number
+ * @brief Parses a non-negative integer flag value, exits with error if it isn't one.
+ */
+static int64_t parse_number(const string &flag, const string &value) {
+    size_t used = 0;
+    int64_t number = -1;
+    try {
+        number = stoll(value, &used);
+    } catch (const exception &) {
+    }
+    if (used != value.size() || number < 0) {
+        cerr << "Invalid value for " << flag << ": " << value << endl;
+        exit(EXIT_FAILURE);
+    }
+    return number;
+}
+
+/** parse_options
+ * @brief Reads the flags of argv.
+ * @warning Exits with error if a flag is unknown or has a bad value.
+ */
+static CliOptions parse_options(int argc, char *argv[]) {
+    CliOptions options;
+    for (int i = 1; i < argc; i++) {
+        string flag = argv[i];
+        if (flag == "--verbose") {
+            options.verbose = true;
+            continue;
+        }
+        if (flag == "--argsort") {
+            options.argsort = true;
+            continue;
+        }
+        if (flag == "--help" || i + 1 >= argc)
+            usage(argv[0]);
+        string value = argv[++i];
+        if (flag == "--memory-mb") {
+            options.memory_bytes = parse_number(flag, value) * 1024 * 1024;
+        } else if (flag == "--block-size") {
+            options.block_bytes = parse_number(flag, value);
+        } else if (flag == "--temp-dirs") {
+            options.spill.directories = parse_spill_directories(value);
+        } else if (flag == "--placement") {
+            options.spill.placement = parse_spill_placement(value);
+        } else if (flag == "--algorithm") {
+            options.algorithm = value;
+            if (value != "merge" && value != "quick") {
+                cerr << "Unknown algorithm: " << value << endl;
+                exit(EXIT_FAILURE);
+            }
+        } else if (flag == "--key-type") {
+            options.key_type = value;
+            if (value != "i32" && value != "i64" && value != "u32" && value != "u64" && value != "f32" &&
+                value != "f64") {
+                cerr << "Unknown key type: " << value << endl;
+                exit(EXIT_FAILURE);
+            }
+        } else if (flag == "--threads") {
+            options.threads = parse_number(flag, value);
+        } else if (flag == "--arity") {
+            options.arity = parse_number(flag, value);
+        } else if (flag == "--gather") {
+            options.gather = parse_gather_columns(value);
+        } else {
+            cerr << "Unknown option: " << flag << endl;
+            usage(argv[0]);
+        }
+    }
+    return options;
+}
+
+/**
+ * @brief Error that ends the sort. Thrown instead of exiting so the spill files are removed
+ * on the way out.
+ */
+struct SortError : runtime_error {
+    using runtime_error::runtime_error;
+};
+
+/** write_all
+ * @brief Writes bytes bytes to stdout, retrying short writes.
+ * @warning Throws SortError if stdout fails (for example, the reader of the pipe went away).
+ */
+static void write_all(const void *values, int64_t bytes) {
+    const char *data = static_cast<const char *>(values);
+    while (bytes > 0) {
+        ssize_t n = ::write(STDOUT_FILENO, data, bytes);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            throw SortError(string("can't write the output: ") + strerror(errno));
+        data += n;
+        bytes -= n;
+    }
+}
+
+/** sorter_config
+ * @brief ExternalSorter settings for the options, with memory_bytes of memory.
+ */
+static SorterConfig sorter_config(const CliOptions &options, int64_t memory_bytes, const string &name) {
+    SorterConfig config;
+    config.memory_bytes = memory_bytes;
+    config.arity = options.arity;
+    config.block_bytes = options.block_bytes;
+    config.threads = options.threads;
+    config.spill = options.spill;
+    config.spill_name = name;
+    config.log = options.verbose ? &cerr : nullptr;
+    return config;
+}
+
+/** check
+ * @brief Throws SortError if status is not OK.
+ */
+static void check(const SortStatus &status) {
+    if (!status.ok())
+        throw SortError(status.message);
+}
+
+/** check_input
+ * @brief Throws SortError if stdin failed or ended in the middle of a value, before
+ * anything that depends on the whole input is written.
+ */
+static void check_input(PipeInputSource &input) {
+    check({input.error().empty() ? SortStatus::OK : SortStatus::IO_ERROR, input.error()});
+}
+
+/**
+ * @brief What sort_cli reads and writes for a key type: Raw keys come in, Output values go
+ * out. A plain key is both; an Indexed key reads its key, takes its position from the
+ * order of the input and writes only the position.
+ */
+template <typename Key> struct CliKey {
+    using Raw = Key;
+    using Output = Key;
+    static constexpr bool INDEXED = false;
+
+    static Key from_raw(Raw raw, uint64_t) {
+        return raw;
+    }
+    static Output output(Key key) {
+        return key;
+    }
+};
+
+template <typename Key> struct CliKey<Indexed<Key>> {
+    using Raw = Key;
+    using Output = uint64_t;
+    static constexpr bool INDEXED = true;
+
+    static Indexed<Key> from_raw(Raw raw, uint64_t position) {
+        return {raw, position};
+    }
+    static Output output(Indexed<Key> key) {
+        return key.position;
+    }
+};
+
+/** encode_raw
+ * @brief Replaces the n raw keys read to the start of values by their KeyTraits bits, in
+ * place. Bits may be wider than the raw keys, so they are converted from the last one.
+ * @param position Position in the input of the first key.
+ */
+template <typename Key>
+static void encode_raw(typename KeyTraits<Key>::Bits *values, int64_t n, int64_t position) {
+    using Raw = typename CliKey<Key>::Raw;
+    for (int64_t i = n - 1; i >= 0; i--) {
+        Raw raw;
+        memcpy(&raw, reinterpret_cast<const char *>(values) + i * sizeof(Raw), sizeof(raw));
+        values[i] = KeyTraits<Key>::encode(CliKey<Key>::from_raw(raw, position + i));
+    }
+}
+
+/** decode_raw
+ * @brief Replaces KeyTraits bits by the output values to write, packed from the start of
+ * values, in place.
+ * @return Bytes of output.
+ */
+template <typename Key> static int64_t decode_raw(typename KeyTraits<Key>::Bits *values, int64_t n) {
+    using Output = typename CliKey<Key>::Output;
+    for (int64_t i = 0; i < n; i++) {
+        Output value = CliKey<Key>::output(KeyTraits<Key>::decode(values[i]));
+        memcpy(reinterpret_cast<char *>(values) + i * sizeof(Output), &value, sizeof(value));
+    }
+    return n * sizeof(Output);
+}
+
+/** write_output
+ * @brief Writes output values to stdout and, for an argsort with --gather, hands the
+ * positions to the gather.
+ */
+template <typename Key> static void write_output(const void *values, int64_t bytes) {
+    write_all(values, bytes);
+    if (CliKey<Key>::INDEXED && active_gather)
+        check(active_gather->add(static_cast<const uint64_t *>(values), bytes / sizeof(uint64_t)));
+}
+
+/** drain
+ * @brief Writes a sorted stream to stdout.
+ * @return I/O operations of the stream.
+ */
+template <typename Key> static int64_t drain(BasicSortedStream<Key> &sorted, int64_t chunk_bytes) {
+    using Output = typename CliKey<Key>::Output;
+    vector<Key> chunk(chunk_bytes / sizeof(Key));
+    vector<Output> output(chunk.size());
+    int64_t n;
+    while ((n = sorted.read(chunk.data(), chunk.size())) > 0) {
+        for (int64_t i = 0; i < n; i++)
+            output[i] = CliKey<Key>::output(chunk[i]);
+        write_output<Key>(output.data(), n * sizeof(Output));
+    }
+    check(sorted.status());
+    return sorted.io_operations();
+}
+
+/** sort_by_merging
+ * @brief Pushes the input into an ExternalSorter and streams the final merge to stdout.
+ * @return Number of I/O operations.
+ */
+template <typename Key>
+static int64_t sort_by_merging(PipeInputSource &input, const CliOptions &options) {
+    using Raw = typename CliKey<Key>::Raw;
+    BasicExternalSorter<Key> sorter(sorter_config(options, options.memory_bytes, "temp_sort_cli"));
+    check(sorter.status());
+
+    vector<Raw> chunk(options.chunk_bytes / sizeof(Raw));
+    vector<Key> keys(chunk.size());
+    int64_t position = 0;
+    int64_t n;
+    while ((n = input.read_values(chunk.data(), chunk.size())) > 0) {
+        for (int64_t i = 0; i < n; i++)
+            keys[i] = CliKey<Key>::from_raw(chunk[i], position + i);
+        check(sorter.add(keys.data(), n));
+        position += n;
+    }
+    check_input(input);
+
+    unique_ptr<BasicSortedStream<Key>> sorted;
+    check(sorter.finish(sorted));
+    return sorter.io_operations() + drain(*sorted, options.chunk_bytes);
+}
+
+/** sort_by_partitioning
+ * @brief One quicksort partitioning pass over a stream of unknown length.
+ * @details The pivots come from the first half of the memory worth of input, since the
+ * input can't be sampled ahead. Keys are classified by their KeyTraits bits with the
+ * SplitterTree of their width and appended to the spill file of their bucket, then the
+ * buckets are sorted in order: radix sorted in memory when they fit, copied as they are
+ * when they hold a single repeated key, or merged by an ExternalSorter when the first
+ * buffer was a poor sample and one grew too large.
+ * @return Number of I/O operations.
+ */
+template <typename Key>
+static int64_t sort_by_partitioning(PipeInputSource &input, const CliOptions &options) {
+    using Bits = typename KeyTraits<Key>::Bits;
+    const int64_t block = options.block_bytes;
+    TaskScheduler scheduler(options.threads);
+
+    vector<Bits> buffer(options.memory_bytes / 2 / sizeof(Bits));
+    int64_t first = input.read_values(buffer.data(), buffer.size());
+    encode_raw<Key>(buffer.data(), first, 0);
+    buffer.resize(first);
+    radix_sort(buffer.data(), buffer.size(), &scheduler);
+    if (first < (int64_t)buffer.capacity()) {
+        check_input(input);
+        if (options.verbose)
+            cerr << "sort_cli: " << first << " values sorted in memory" << endl;
+        write_output<Key>(buffer.data(), decode_raw<Key>(buffer.data(), buffer.size()));
+        return 0;
+    }
+
+    // Each bucket gets a write buffer of whole blocks in the other half of the memory
+    int64_t arity = max(int64_t(2), min(options.arity, options.memory_bytes / 2 / block));
+    vector<Bits> pivots;
+    for (int64_t i = 1; i < arity; i++)
+        pivots.push_back(buffer[first * i / arity]);
+    BasicSplitterTree<Bits> splitters(pivots);
+    const int64_t buckets = splitters.num_buckets();
+    const int64_t bucket_elements = options.memory_bytes / 2 / buckets / block * block / sizeof(Bits);
+
+    SpillStorage spill(storage(), "temp_sort_cli_partitions", 0, options.spill, false);
+    if (!spill.ok())
+        check({SortStatus::IO_ERROR, spill.error()});
+
+    int64_t io = 0;
+    vector<unique_ptr<StorageFile>> partitions(buckets);
+    vector<vector<Bits>> pending(buckets);
+    vector<int64_t> written(buckets, 0);
+    auto flush = [&](int64_t b) {
+        int64_t bytes = pending[b].size() * sizeof(Bits);
+        if (!partitions[b])
+            partitions[b] = spill.open("partition_" + to_string(b) + ".bin", StorageMode::WRITE);
+        if (!partitions[b] || partitions[b]->write_at(pending[b].data(), bytes, written[b]) != bytes) {
+            string error = spill.error();
+            check({SortStatus::IO_ERROR, error.empty() ? "Error writing a partition" : error});
+        }
+        written[b] += bytes;
+        io += (bytes + block - 1) / block;
+        pending[b].clear();
+    };
+    vector<uint32_t> classes(buffer.size());
+    auto distribute = [&](const Bits *values, int64_t n) {
+        splitters.classify(values, n, classes.data());
+        for (int64_t i = 0; i < n; i++) {
+            uint32_t b = classes[i];
+            pending[b].push_back(values[i]);
+            if ((int64_t)pending[b].size() == bucket_elements)
+                flush(b);
+        }
+    };
+
+    for (int64_t b = 0; b < buckets; b++)
+        pending[b].reserve(bucket_elements);
+    int64_t n = first;
+    int64_t position = first;
+    do {
+        distribute(buffer.data(), n);
+        buffer.resize(buffer.capacity());
+        n = input.read_values(buffer.data(), buffer.size());
+        encode_raw<Key>(buffer.data(), n, position);
+        position += n;
+    } while (n > 0);
+    check_input(input);
+    vector<uint32_t>().swap(classes);
+    for (int64_t b = 0; b < buckets; b++) {
+        if (!pending[b].empty())
+            flush(b);
+        vector<Bits>().swap(pending[b]);
+        partitions[b].reset();
+    }
+    if (options.verbose)
+        cerr << "sort_cli: partitioned into " << buckets << " buckets, " << spill.summary() << endl;
+
+    for (int64_t b = 0; b < buckets; b++) {
+        if (written[b] == 0)
+            continue;
+        string name = "partition_" + to_string(b) + ".bin";
+        unique_ptr<StorageFile> partition = spill.open(name, StorageMode::READ);
+        if (!partition)
+            check({SortStatus::IO_ERROR, "Error opening " + name});
+
+        if (written[b] <= options.memory_bytes || splitters.is_equality_bucket(b)) {
+            // Read a memory worth at a time: it is either the whole bucket or a repeated key
+            buffer.resize(min(written[b], options.memory_bytes) / sizeof(Bits));
+            for (int64_t offset = 0; offset < written[b]; offset += buffer.size() * sizeof(Bits)) {
+                int64_t bytes = min(written[b] - offset, (int64_t)(buffer.size() * sizeof(Bits)));
+                if (partition->read_at(buffer.data(), bytes, offset) != bytes)
+                    check({SortStatus::IO_ERROR, "Error reading " + name});
+                io += (bytes + block - 1) / block;
+                if (!splitters.is_equality_bucket(b))
+                    radix_sort(buffer.data(), bytes / sizeof(Bits), &scheduler);
+                write_output<Key>(buffer.data(), decode_raw<Key>(buffer.data(), bytes / sizeof(Bits)));
+            }
+        } else {
+            if (options.verbose)
+                cerr << "sort_cli: bucket " << b << " has " << written[b] << " bytes, merging it" << endl;
+            vector<Bits>().swap(buffer);
+            BasicExternalSorter<Key> sorter(sorter_config(options, options.memory_bytes, "temp_sort_cli"));
+            check(sorter.status());
+            vector<Bits> chunk(options.chunk_bytes / sizeof(Bits));
+            vector<Key> keys(chunk.size());
+            for (int64_t offset = 0; offset < written[b]; offset += options.chunk_bytes) {
+                int64_t bytes = min(options.chunk_bytes, written[b] - offset);
+                if (partition->read_at(chunk.data(), bytes, offset) != bytes)
+                    check({SortStatus::IO_ERROR, "Error reading " + name});
+                io += (bytes + block - 1) / block;
+                int64_t count = bytes / sizeof(Bits);
+                for (int64_t i = 0; i < count; i++)
+                    keys[i] = KeyTraits<Key>::decode(chunk[i]);
+                check(sorter.add(keys.data(), count));
+            }
+            unique_ptr<BasicSortedStream<Key>> sorted;
+            check(sorter.finish(sorted));
+            io += sorter.io_operations() + drain(*sorted, options.chunk_bytes);
+            buffer.reserve(options.memory_bytes / 2 / sizeof(Bits));
+        }
+        partition.reset();
+        spill.remove(name);
+    }
+    return io;
+}
+
+/** run_sort
+ * @brief Sorts stdin into stdout as keys of type Key.
+ * @return Number of I/O operations.
+ */
+template <typename Key> static int64_t run_sort(const CliOptions &options, int64_t &values) {
+    using Raw = typename CliKey<Key>::Raw;
+    PipeInputSource input(STDIN_FILENO, options.chunk_bytes, READ_AHEAD_CHUNKS, sizeof(Raw));
+    int64_t io = 0;
+    try {
+        io = options.algorithm == "quick" ? sort_by_partitioning<Key>(input, options)
+                                          : sort_by_merging<Key>(input, options);
+    } catch (const SortError &error) {
+        // exit() skips the input's destructor, which could wait for a stalled writer
+        cerr << "Error: " << error.what() << endl;
+        exit(EXIT_FAILURE);
+    }
+    values = input.elements_read();
+    return io;
+}
+
+/** run_key_type
+ * @brief Sorts stdin into stdout as keys of type Key, or as Indexed<Key> with --argsort.
+ * @return Number of I/O operations.
+ */
+template <typename Key> static int64_t run_key_type(const CliOptions &options, int64_t &values) {
+    return options.argsort ? run_sort<Indexed<Key>>(options, values) : run_sort<Key>(options, values);
+}
+
+/**
+ * @brief Sorts the keys of stdin into stdout.
+ * @details Usage: sort_cli [--memory-mb N] [--block-size BYTES] [--temp-dirs SPEC]
+ * [--placement P] [--algorithm merge|quick] [--key-type T] [--threads N] [--arity N]
+ * [--argsort [--gather SPEC]] [--verbose]
+ */
+int main(int argc, char *argv[]) {
+    CliOptions options = parse_options(argc, argv);
+    if (options.memory_bytes < 1024 * 1024 || options.arity < 2 || options.block_bytes < 512 ||
+        options.block_bytes % sizeof(int64_t) != 0 || options.block_bytes * 16 > options.memory_bytes) {
+        cerr << "Need --memory-mb >= 1, --arity >= 2 and a --block-size multiple of 8 in [512, memory/16]"
+             << endl;
+        return EXIT_FAILURE;
+    }
+    if (!options.gather.empty() && !options.argsort) {
+        cerr << "--gather needs --argsort" << endl;
+        return EXIT_FAILURE;
+    }
+    // A closed stdout shows up as a write error instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // The reader thread's chunks, and the chunk being added, come out of the memory of the sort
+    options.chunk_bytes = min(READ_CHUNK_BYTES, options.memory_bytes / 16 / 4096 * 4096);
+    options.memory_bytes -= options.chunk_bytes * (READ_AHEAD_CHUNKS + 2);
+
+    // A batch of the gather holds a position, its sort record and a row of the widest column
+    unique_ptr<ColumnGather> gather;
+    if (!options.gather.empty()) {
+        int64_t gather_bytes = options.memory_bytes / GATHER_MEMORY_SHARE;
+        options.memory_bytes -= gather_bytes;
+        int64_t widest = 0;
+        for (const GatherColumn &column : options.gather)
+            widest = max(widest, column.width);
+        int64_t row_bytes = sizeof(uint64_t) + sizeof(uint128_t) + widest;
+        gather = make_unique<ColumnGather>(options.gather, gather_bytes / row_bytes);
+        if (!gather->status().ok()) {
+            cerr << "Error: " << gather->status().message << endl;
+            return EXIT_FAILURE;
+        }
+        active_gather = gather.get();
+    }
+
+    int64_t values = 0;
+    int64_t io = 0;
+    if (options.key_type == "i32")
+        io = run_key_type<int32_t>(options, values);
+    else if (options.key_type == "i64")
+        io = run_key_type<int64_t>(options, values);
+    else if (options.key_type == "u32")
+        io = run_key_type<uint32_t>(options, values);
+    else if (options.key_type == "u64")
+        io = run_key_type<uint64_t>(options, values);
+    else if (options.key_type == "f32")
+        io = run_key_type<float>(options, values);
+    else
+        io = run_key_type<double>(options, values);
+
+    if (gather) {
+        active_gather = nullptr;
+        if (!gather->finish().ok()) {
+            cerr << "Error: " << gather->status().message << endl;
+            return EXIT_FAILURE;
+        }
+        if (options.verbose)
+            cerr << "sort_cli: gathered " << gather->rows() << " rows of " << options.gather.size()
+                 << " columns with " << gather->io_operations() << " I/Os" << endl;
+    }
+
+    if (options.verbose)
+        cerr << "sort_cli: sorted " << values << " " << options.key_type << " keys with " << io << " I/Os"
+             << endl;
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include <sort_keys.h>
+
+using namespace std;
+
+/**
+ * @RADIX_SORT_CUTOFF: 64 keys. Buckets this small are finished with std::sort.
+ * @RADIX_TASK_GRAIN: 64K keys. Smallest bucket sorted as a task of its own.
+ */
+const int64_t RADIX_SORT_CUTOFF = 64;
+const int64_t RADIX_TASK_GRAIN = 64 * 1024;
+
+/** radix_sort_level
+ * @brief Distributes data[0, n) by the byte at shift and sorts every bucket by the next
+ * byte, spawning the large buckets into group when there is a scheduler.
+ */
+template <typename Bits>
+static void
+radix_sort_level(Bits *data, int64_t n, int shift, TaskScheduler *scheduler, TaskGroup *group) {
+    while (true) {
+        if (n <= RADIX_SORT_CUTOFF) {
+            sort(data, data + n);
+            return;
+        }
+
+        int64_t count[256] = {0};
+        for (int64_t i = 0; i < n; i++) {
+            count[(data[i] >> shift) & 0xFF]++;
+        }
+        // Every key has the same byte here, go straight to the next one
+        if (count[(data[0] >> shift) & 0xFF] == n) {
+            if (shift == 0)
+                return;
+            shift -= 8;
+            continue;
+        }
+
+        int64_t next[256];
+        int64_t end[256];
+        int64_t offset = 0;
+        for (int b = 0; b < 256; b++) {
+            next[b] = offset;
+            offset += count[b];
+            end[b] = offset;
+        }
+
+        // Each key is swapped straight into its bucket, following the cycle it starts
+        for (int b = 0; b < 256; b++) {
+            while (next[b] < end[b]) {
+                Bits value = data[next[b]];
+                int digit = (value >> shift) & 0xFF;
+                while (digit != b) {
+                    swap(value, data[next[digit]++]);
+                    digit = (value >> shift) & 0xFF;
+                }
+                data[next[b]++] = value;
+            }
+        }
+        if (shift == 0)
+            return;
+
+        for (int b = 0; b < 256; b++) {
+            Bits *bucket = data + end[b] - count[b];
+            if (count[b] < 2)
+                continue;
+            if (scheduler && count[b] >= RADIX_TASK_GRAIN) {
+                int64_t size = count[b];
+                int next_shift = shift - 8;
+                scheduler->spawn(*group, [bucket, size, next_shift, scheduler, group]() {
+                    radix_sort_level(bucket, size, next_shift, scheduler, group);
+                });
+            } else {
+                radix_sort_level(bucket, count[b], shift - 8, scheduler, group);
+            }
+        }
+        return;
+    }
+}
+
+template <typename Bits> void radix_sort(Bits *data, int64_t n, TaskScheduler *scheduler) {
+    TaskGroup group;
+    radix_sort_level(data, n, sizeof(Bits) * 8 - 8, scheduler, &group);
+    if (scheduler)
+        scheduler->wait(group);
+}
+
+template void radix_sort<uint32_t>(uint32_t *data, int64_t n, TaskScheduler *scheduler);
+template void radix_sort<uint64_t>(uint64_t *data, int64_t n, TaskScheduler *scheduler);
+template void radix_sort<uint128_t>(uint128_t *data, int64_t n, TaskScheduler *scheduler);
@@ -0,0 +1,591 @@
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <spill_storage.h>
+#include <sstream>
+
+using namespace std;
+
+/**
+ * @SPILL_ALIGNMENT: 4096 bytes. Extents start and end on block boundaries.
+ * @MIN_EXTENT_BYTES: 256KB. Smallest extent handed to a file.
+ * @MAX_EXTENT_BYTES: 64MB. A growing file asks for extents as big as its capacity (so its
+ * extent list grows logarithmically), up to this size.
+ */
+const int64_t SPILL_ALIGNMENT = 4096;
+const int64_t MIN_EXTENT_BYTES = 256 * 1024;
+const int64_t MAX_EXTENT_BYTES = 64 * 1024 * 1024;
+
+static SpillConfig current_spill_config;
+
+/** spill_config
+ * @brief Spill configuration of the sorts, the current directory unless another one was set.
+ */
+const SpillConfig &spill_config() {
+    return current_spill_config;
+}
+
+/** set_spill_config
+ * @brief Replaces the spill configuration of the sorts.
+ */
+void set_spill_config(const SpillConfig &config) {
+    current_spill_config = config;
+}
+
+/** parse_spill_directories
+ * @brief Parses a comma separated list of path[:capacity_mb[:weight]].
+ * @warning Exits with error if an entry is malformed.
+ */
+vector<SpillDirectory> parse_spill_directories(const string &spec) {
+    vector<SpillDirectory> directories;
+    stringstream entries(spec);
+    string entry;
+    while (getline(entries, entry, ',')) {
+        stringstream fields(entry);
+        string path, capacity, weight;
+        getline(fields, path, ':');
+        getline(fields, capacity, ':');
+        getline(fields, weight, ':');
+        SpillDirectory directory;
+        directory.path = path;
+        try {
+            directory.capacity_bytes = capacity.empty() ? 0 : stoll(capacity) * 1024 * 1024;
+            directory.weight = weight.empty() ? 1 : stoll(weight);
+        } catch (const exception &) {
+            directory.weight = 0;
+        }
+        if (path.empty() || directory.capacity_bytes < 0 || directory.weight <= 0) {
+            cerr << "Invalid spill directory: " << entry << endl;
+            exit(EXIT_FAILURE);
+        }
+        directories.push_back(directory);
+    }
+    if (directories.empty()) {
+        cerr << "No spill directories in: " << spec << endl;
+        exit(EXIT_FAILURE);
+    }
+    return directories;
+}
+
+/** parse_spill_placement
+ * @brief Parses a placement name: "round_robin" or "free_space".
+ * @warning Exits with error if the name is unknown.
+ */
+SpillPlacement parse_spill_placement(const string &name) {
+    if (name == "round_robin")
+        return SpillPlacement::ROUND_ROBIN;
+    if (name == "free_space")
+        return SpillPlacement::FREE_SPACE;
+    cerr << "Unknown spill placement: " << name << endl;
+    exit(EXIT_FAILURE);
+}
+
+/** align_up
+ * @brief Rounds bytes up to a multiple of SPILL_ALIGNMENT.
+ */
+static int64_t align_up(int64_t bytes) {
+    return (bytes + SPILL_ALIGNMENT - 1) / SPILL_ALIGNMENT * SPILL_ALIGNMENT;
+}
+
+/**
+ * @brief File of SpillStorage, translates requests to the extents holding it.
+ * @details The extent table is only locked to map a request, the reads and writes of the
+ * spill files run concurrently.
+ */
+class SpillFile : public StorageFile {
+  public:
+    SpillFile(SpillStorage &spill, shared_ptr<SpillFileData> data) : spill_(spill), data_(move(data)) {
+    }
+
+    int64_t read_at(void *buffer, int64_t bytes, int64_t offset) override {
+        int64_t done = 0;
+        for (const SpillStorage::Slice &slice : spill_.map_read(*data_, offset, bytes)) {
+            StorageFile &file = *spill_.devices_[slice.device].file;
+            int64_t n = file.read_at(static_cast<char *>(buffer) + slice.buffer_offset, slice.bytes, slice.physical);
+            done += n;
+            if (n < slice.bytes)
+                break;
+        }
+        return done;
+    }
+
+    int64_t write_at(const void *buffer, int64_t bytes, int64_t offset) override {
+        int64_t done = 0;
+        for (const SpillStorage::Slice &slice : spill_.map_write(*data_, offset, bytes)) {
+            StorageFile &file = *spill_.devices_[slice.device].file;
+            int64_t n =
+                file.write_at(static_cast<const char *>(buffer) + slice.buffer_offset, slice.bytes, slice.physical);
+            done += n;
+            if (n < slice.bytes)
+                break;
+        }
+        return done;
+    }
+
+    int64_t size() override {
+        return spill_.size_of(*data_);
+    }
+
+    void resize(int64_t bytes) override {
+        spill_.resize_file(*data_, bytes);
+    }
+
+    void preallocate(int64_t bytes) override {
+        spill_.reserve_file(*data_, bytes);
+    }
+
+    bool native_ranges(int64_t offset, int64_t bytes, bool write, vector<NativeRange> &ranges) override {
+        vector<SpillStorage::Slice> slices =
+            write ? spill_.map_write(*data_, offset, bytes) : spill_.map_read(*data_, offset, bytes);
+        vector<NativeRange> device_ranges;
+        for (const SpillStorage::Slice &slice : slices) {
+            device_ranges.clear();
+            StorageFile &file = *spill_.devices_[slice.device].file;
+            if (!file.native_ranges(slice.physical, slice.bytes, write, device_ranges))
+                return false;
+            for (NativeRange &range : device_ranges) {
+                range.buffer_offset += slice.buffer_offset;
+                ranges.push_back(range);
+            }
+        }
+        return true;
+    }
+
+  private:
+    SpillStorage &spill_;
+    shared_ptr<SpillFileData> data_;
+};
+
+SpillStorage::SpillStorage(
+    StorageBackend &backing, const string &name, int64_t expected_bytes, const SpillConfig &config,
+    bool exit_on_error
+)
+    : backing_(backing), placement_(config.placement), devices_(config.directories.size()),
+      exit_on_error_(exit_on_error) {
+    int64_t total_weight = 0;
+    for (const SpillDirectory &directory : config.directories) {
+        total_weight += directory.weight;
+    }
+
+    for (size_t d = 0; d < devices_.size(); d++) {
+        Device &device = devices_[d];
+        device.directory = config.directories[d];
+        device.path = device.directory.path + "/" + name + ".spill";
+        backing_.create_directories(device.directory.path);
+        device.file = backing_.open(device.path, StorageMode::WRITE);
+        if (!device.file) {
+            fail("Error creating spill file: " + device.path);
+            return;
+        }
+
+        // Each directory is preallocated its share of the expected data
+        int64_t share = expected_bytes > 0 ? expected_bytes / total_weight * device.directory.weight : 0;
+        if (device.directory.capacity_bytes > 0)
+            share = min(share, device.directory.capacity_bytes);
+        if (share > 0) {
+            device.file_capacity = align_up(share);
+            device.file->preallocate(device.file_capacity);
+        }
+    }
+}
+
+SpillStorage::~SpillStorage() {
+    for (Device &device : devices_) {
+        if (!device.file)
+            continue;
+        device.file.reset();
+        backing_.remove(device.path);
+    }
+}
+
+/** fail
+ * @brief Ends the program with message, or records it if the storage doesn't exit on errors.
+ */
+void SpillStorage::fail(const string &message) {
+    if (exit_on_error_) {
+        cerr << message << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (error_.empty())
+        error_ = message;
+}
+
+bool SpillStorage::ok() {
+    lock_guard<mutex> lock(mutex_);
+    return error_.empty();
+}
+
+string SpillStorage::error() {
+    lock_guard<mutex> lock(mutex_);
+    return error_;
+}
+
+unique_ptr<StorageFile> SpillStorage::open(const string &path, StorageMode mode) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+        if (mode == StorageMode::READ)
+            return nullptr;
+        it = files_.emplace(path, make_shared<SpillFileData>()).first;
+    } else if (mode == StorageMode::WRITE) {
+        release(*it->second);
+    } else if (mode == StorageMode::READ) {
+        trim(*it->second);
+    }
+    return make_unique<SpillFile>(*this, it->second);
+}
+
+int64_t SpillStorage::file_size(const string &path) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end())
+        return -1;
+    return it->second->size;
+}
+
+bool SpillStorage::remove(const string &path) {
+    lock_guard<mutex> lock(mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end())
+        return false;
+    release(*it->second);
+    files_.erase(it);
+    return true;
+}
+
+void SpillStorage::create_directories(const string &dir) {
+    (void)dir;
+}
+
+void SpillStorage::remove_directory(const string &dir) {
+    string prefix = dir;
+    if (!prefix.empty() && prefix.back() != '/')
+        prefix += '/';
+    lock_guard<mutex> lock(mutex_);
+    for (auto it = files_.lower_bound(prefix); it != files_.end();) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0)
+            break;
+        release(*it->second);
+        it = files_.erase(it);
+    }
+}
+
+string SpillStorage::name() const {
+    return "spill:" + backing_.name() + "x" + to_string(devices_.size());
+}
+
+int64_t SpillStorage::devices() const {
+    return devices_.size();
+}
+
+int64_t SpillStorage::peak_bytes() {
+    lock_guard<mutex> lock(mutex_);
+    return peak_;
+}
+
+int64_t SpillStorage::device_peak_bytes(int64_t device) {
+    lock_guard<mutex> lock(mutex_);
+    return devices_[device].peak;
+}
+
+int64_t SpillStorage::file_bytes() {
+    lock_guard<mutex> lock(mutex_);
+    int64_t bytes = 0;
+    for (const Device &device : devices_) {
+        bytes += device.file_capacity;
+    }
+    return bytes;
+}
+
+int64_t SpillStorage::extents_allocated() {
+    lock_guard<mutex> lock(mutex_);
+    return extents_;
+}
+
+string SpillStorage::summary() {
+    lock_guard<mutex> lock(mutex_);
+    string line = "Spill peaked at " + to_string(peak_ / (1024 * 1024)) + " MB in " + to_string(extents_) + " extents";
+    if (devices_.size() > 1) {
+        line += " (";
+        for (size_t d = 0; d < devices_.size(); d++) {
+            line += (d ? ", " : "") + devices_[d].directory.path + ": " +
+                    to_string(devices_[d].peak / (1024 * 1024)) + " MB";
+        }
+        line += ")";
+    }
+    return line;
+}
+
+vector<SpillStorage::Slice> SpillStorage::map_read(SpillFileData &file, int64_t offset, int64_t bytes) {
+    lock_guard<mutex> lock(mutex_);
+    if (offset >= file.size)
+        return {};
+    return slices(file, offset, min(bytes, file.size - offset));
+}
+
+vector<SpillStorage::Slice> SpillStorage::map_write(SpillFileData &file, int64_t offset, int64_t bytes) {
+    lock_guard<mutex> lock(mutex_);
+    grow(file, offset + bytes);
+    file.size = max(file.size, min(offset + bytes, file.capacity));
+    return slices(file, offset, bytes);
+}
+
+int64_t SpillStorage::size_of(SpillFileData &file) {
+    lock_guard<mutex> lock(mutex_);
+    return file.size;
+}
+
+void SpillStorage::resize_file(SpillFileData &file, int64_t bytes) {
+    lock_guard<mutex> lock(mutex_);
+    grow(file, bytes);
+    file.size = min(bytes, file.capacity);
+}
+
+void SpillStorage::reserve_file(SpillFileData &file, int64_t bytes) {
+    lock_guard<mutex> lock(mutex_);
+    grow(file, bytes);
+}
+
+/** grow
+ * @brief Adds extents to file until it can hold capacity bytes.
+ * @details In order of preference: grows its last extent in place, takes a new extent in
+ * the directory of its last extent, or in the directory picked by the placement policy.
+ * @warning If every directory is full, fails: file is left with less than capacity bytes.
+ */
+void SpillStorage::grow(SpillFileData &file, int64_t capacity) {
+    while (file.capacity < capacity) {
+        int64_t step = min(max(file.capacity, MIN_EXTENT_BYTES), MAX_EXTENT_BYTES);
+        int64_t want = align_up(max(capacity - file.capacity, step));
+        SpillExtent extent;
+
+        bool found = !file.extents.empty() && extend_last(file, want, extent);
+        if (!found && !file.extents.empty())
+            found = allocate(file.extents.back().device, want, extent);
+        if (!found) {
+            int64_t device = place(want);
+            found = device >= 0 && allocate(device, want, extent);
+        }
+        if (!found) {
+            fail("Spill directories are full");
+            return;
+        }
+
+        Device &device = devices_[extent.device];
+        if (device.end > device.file_capacity) {
+            device.file_capacity = align_up(max(device.end, device.file_capacity + device.file_capacity / 2));
+            if (device.directory.capacity_bytes > 0)
+                device.file_capacity = max(device.end, min(device.file_capacity, device.directory.capacity_bytes));
+            device.file->preallocate(device.file_capacity);
+        }
+
+        SpillExtent *last = file.extents.empty() ? nullptr : &file.extents.back();
+        if (last && last->device == extent.device && last->offset + last->bytes == extent.offset) {
+            last->bytes += extent.bytes;
+        } else {
+            file.extents.push_back(extent);
+            extents_++;
+        }
+        file.capacity += extent.bytes;
+        device.in_use += extent.bytes;
+        device.peak = max(device.peak, device.in_use);
+        in_use_ += extent.bytes;
+        peak_ = max(peak_, in_use_);
+    }
+}
+
+/** room
+ * @brief Bytes that can still be allocated in a directory, capped at want.
+ */
+static int64_t room(const SpillDirectory &directory, int64_t in_use, int64_t want) {
+    if (directory.capacity_bytes == 0)
+        return want;
+    return max(int64_t(0), min(want, directory.capacity_bytes - in_use));
+}
+
+/** extend_last
+ * @brief Takes up to want bytes right after the last extent of file, if they are free or
+ * at the end of its spill file.
+ */
+bool SpillStorage::extend_last(SpillFileData &file, int64_t want, SpillExtent &extent) {
+    const SpillExtent &last = file.extents.back();
+    Device &device = devices_[last.device];
+    int64_t last_end = last.offset + last.bytes;
+    int64_t take = room(device.directory, device.in_use, want);
+    if (take == 0)
+        return false;
+
+    auto next = device.free.find(last_end);
+    if (next != device.free.end()) {
+        take = min(take, next->second);
+        if (take < next->second)
+            device.free[last_end + take] = next->second - take;
+        device.free.erase(next);
+    } else if (last_end == device.end) {
+        device.end += take;
+    } else {
+        return false;
+    }
+    extent = {last.device, last_end, take};
+    return true;
+}
+
+/** allocate
+ * @brief Takes up to want bytes from a directory: the first free extent of at least
+ * min(want, MIN_EXTENT_BYTES), or the end of its spill file.
+ * @return false if the directory is full.
+ */
+bool SpillStorage::allocate(int64_t d, int64_t want, SpillExtent &extent) {
+    Device &device = devices_[d];
+    int64_t take = room(device.directory, device.in_use, want);
+    if (take == 0)
+        return false;
+
+    int64_t usable = min(take, MIN_EXTENT_BYTES);
+    auto it = device.free.begin();
+    while (it != device.free.end() && it->second < usable)
+        ++it;
+    if (it != device.free.end()) {
+        extent = {d, it->first, min(take, it->second)};
+        if (extent.bytes < it->second)
+            device.free[it->first + extent.bytes] = it->second - extent.bytes;
+        device.free.erase(it);
+    } else {
+        extent = {d, device.end, take};
+        device.end += take;
+    }
+    return true;
+}
+
+/** place
+ * @brief Picks the directory of a new extent among those that aren't full.
+ * @details ROUND_ROBIN is a smooth weighted round robin: every candidate earns its weight
+ * in credit and the richest one pays the total. FREE_SPACE takes the directory with the
+ * most free bytes, the lowest of its capacity left and the free space of its file system
+ * (unknown for in-memory backends), breaking ties by the lowest usage per unit of weight.
+ * @return Index of the directory, -1 if all of them are full.
+ */
+int64_t SpillStorage::place(int64_t want) {
+    int64_t best = -1;
+    int64_t total_weight = 0;
+    int64_t best_free = -1;
+
+    for (size_t d = 0; d < devices_.size(); d++) {
+        Device &device = devices_[d];
+        if (room(device.directory, device.in_use, want) == 0)
+            continue;
+
+        if (placement_ == SpillPlacement::ROUND_ROBIN) {
+            device.credit += device.directory.weight;
+            total_weight += device.directory.weight;
+            if (best < 0 || device.credit > devices_[best].credit)
+                best = d;
+            continue;
+        }
+
+        int64_t free = numeric_limits<int64_t>::max();
+        int64_t file_system_free = backing_.free_bytes(device.directory.path);
+        if (file_system_free >= 0)
+            free = file_system_free + (device.file_capacity - device.in_use);
+        if (device.directory.capacity_bytes > 0)
+            free = min(free, device.directory.capacity_bytes - device.in_use);
+
+        bool better = best < 0 || free > best_free;
+        if (!better && free == best_free) {
+            const Device &other = devices_[best];
+            better = (double)device.in_use / device.directory.weight < (double)other.in_use / other.directory.weight;
+        }
+        if (better) {
+            best = d;
+            best_free = free;
+        }
+    }
+
+    if (best >= 0 && placement_ == SpillPlacement::ROUND_ROBIN)
+        devices_[best].credit -= total_weight;
+    return best;
+}
+
+/** free_extent
+ * @brief Returns an extent to the free list of its directory, merged with its free
+ * neighbours.
+ * @details An extent that ends at the end of the spill file lowers its end instead, so the
+ * next appended extent reuses it.
+ */
+void SpillStorage::free_extent(const SpillExtent &extent) {
+    Device &device = devices_[extent.device];
+    int64_t offset = extent.offset;
+    int64_t bytes = extent.bytes;
+
+    auto next = device.free.find(offset + bytes);
+    if (next != device.free.end()) {
+        bytes += next->second;
+        device.free.erase(next);
+    }
+    auto prev = device.free.lower_bound(offset);
+    if (prev != device.free.begin()) {
+        --prev;
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            bytes += prev->second;
+            device.free.erase(prev);
+        }
+    }
+
+    if (offset + bytes == device.end) {
+        device.end = offset;
+    } else {
+        device.free[offset] = bytes;
+    }
+    device.in_use -= extent.bytes;
+    in_use_ -= extent.bytes;
+}
+
+/** release
+ * @brief Frees every extent of file and empties it.
+ */
+void SpillStorage::release(SpillFileData &file) {
+    for (const SpillExtent &extent : file.extents) {
+        free_extent(extent);
+    }
+    file.extents.clear();
+    file.capacity = 0;
+    file.size = 0;
+}
+
+/** trim
+ * @brief Frees the capacity of file past its size, rounded up to SPILL_ALIGNMENT.
+ */
+void SpillStorage::trim(SpillFileData &file) {
+    int64_t keep = align_up(file.size);
+    while (file.capacity > keep) {
+        SpillExtent &last = file.extents.back();
+        int64_t excess = min(last.bytes, file.capacity - keep);
+        free_extent({last.device, last.offset + last.bytes - excess, excess});
+        last.bytes -= excess;
+        file.capacity -= excess;
+        if (last.bytes == 0)
+            file.extents.pop_back();
+    }
+}
+
+/** slices
+ * @brief Splits the logical range [offset, offset + bytes) of file at extent boundaries.
+ */
+vector<SpillStorage::Slice> SpillStorage::slices(const SpillFileData &file, int64_t offset, int64_t bytes) {
+    vector<Slice> result;
+    const int64_t begin = offset;
+    int64_t position = 0;
+    for (const SpillExtent &extent : file.extents) {
+        if (bytes == 0)
+            break;
+        int64_t extent_end = position + extent.bytes;
+        if (offset < extent_end) {
+            int64_t n = min(bytes, extent_end - offset);
+            result.push_back({extent.device, extent.offset + (offset - position), n, offset - begin});
+            offset += n;
+            bytes -= n;
+        }
+        position = extent_end;
+    }
+    return result;
+}
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <limits>
+#include <sort_keys.h>
+#include <splitter_tree.h>
+
+using namespace std;
+
+/**
+ * @UNROLL: Number of values walked down the tree together in classify.
+ */
+const int64_t UNROLL = 8;
+
+template <typename Value>
+BasicSplitterTree<Value>::BasicSplitterTree(const vector<Value> &pivots) : levels_(0), leaves_(1) {
+    vector<Value> distinct;
+    vector<bool> repeated;
+    for (size_t i = 0; i < pivots.size(); i++) {
+        if (!distinct.empty() && pivots[i] == distinct.back()) {
+            repeated.back() = true;
+        } else {
+            distinct.push_back(pivots[i]);
+            repeated.push_back(false);
+        }
+    }
+
+    // Leaf b gets the range bucket of [distinct[b-1], distinct[b]), preceded by the
+    // equality bucket of distinct[b-1] when that pivot was repeated
+    int64_t num_leaves = distinct.size() + 1;
+    lower_.assign(num_leaves, numeric_limits<Value>::min());
+    equal_bucket_.assign(num_leaves, 0);
+    range_bucket_.assign(num_leaves, 0);
+    int64_t next_bucket = 0;
+    for (int64_t leaf = 0; leaf < num_leaves; leaf++) {
+        if (leaf > 0 && repeated[leaf - 1]) {
+            lower_[leaf] = distinct[leaf - 1];
+            equal_bucket_[leaf] = next_bucket++;
+            equality_.push_back(true);
+            bucket_key_.push_back(distinct[leaf - 1]);
+        }
+        range_bucket_[leaf] = next_bucket++;
+        equality_.push_back(false);
+        bucket_key_.push_back(0);
+        if (!(leaf > 0 && repeated[leaf - 1]))
+            equal_bucket_[leaf] = range_bucket_[leaf];
+    }
+    num_buckets_ = next_bucket;
+
+    while (leaves_ < num_leaves) {
+        leaves_ *= 2;
+        levels_++;
+    }
+
+    // Missing pivots are padded with the largest value. Only that value itself can reach
+    // a padding leaf, and bucket_of/classify clamp it back to the last real one.
+    vector<Value> padded(distinct);
+    padded.resize(leaves_ - 1, numeric_limits<Value>::max());
+
+    // tree_[1] is the root, the children of node j are 2j and 2j+1. An in-order walk of
+    // the tree visits the padded pivots in sorted order.
+    tree_.assign(leaves_, 0);
+    int64_t next = 0;
+    vector<int64_t> stack;
+    int64_t node = 1;
+    while (node < leaves_ || !stack.empty()) {
+        while (node < leaves_) {
+            stack.push_back(node);
+            node = 2 * node;
+        }
+        node = stack.back();
+        stack.pop_back();
+        tree_[node] = padded[next++];
+        node = 2 * node + 1;
+    }
+}
+
+template <typename Value>
+int64_t BasicSplitterTree<Value>::num_buckets() const {
+    return num_buckets_;
+}
+
+template <typename Value>
+bool BasicSplitterTree<Value>::is_equality_bucket(int64_t bucket) const {
+    return equality_[bucket];
+}
+
+template <typename Value>
+Value BasicSplitterTree<Value>::equality_key(int64_t bucket) const {
+    return bucket_key_[bucket];
+}
+
+template <typename Value>
+int64_t BasicSplitterTree<Value>::bucket_of(Value value) const {
+    int64_t j = 1;
+    for (int64_t level = 0; level < levels_; level++) {
+        j = 2 * j + (value >= tree_[j]);
+    }
+    int64_t leaf = min(j - leaves_, (int64_t)lower_.size() - 1);
+    return value == lower_[leaf] ? equal_bucket_[leaf] : range_bucket_[leaf];
+}
+
+template <typename Value>
+void BasicSplitterTree<Value>::classify(const Value *values, int64_t n, uint32_t *buckets) const {
+    const Value *tree = tree_.data();
+    const int64_t last = lower_.size() - 1;
+    int64_t i = 0;
+
+    for (; i + UNROLL <= n; i += UNROLL) {
+        int64_t j[UNROLL];
+        for (int64_t u = 0; u < UNROLL; u++) {
+            j[u] = 1;
+        }
+        for (int64_t level = 0; level < levels_; level++) {
+            for (int64_t u = 0; u < UNROLL; u++) {
+                j[u] = 2 * j[u] + (values[i + u] >= tree[j[u]]);
+            }
+        }
+        for (int64_t u = 0; u < UNROLL; u++) {
+            int64_t leaf = min(j[u] - leaves_, last);
+            buckets[i + u] = values[i + u] == lower_[leaf] ? equal_bucket_[leaf] : range_bucket_[leaf];
+        }
+    }
+
+    for (; i < n; i++) {
+        buckets[i] = bucket_of(values[i]);
+    }
+}
+
+template class BasicSplitterTree<int64_t>;
+template class BasicSplitterTree<uint32_t>;
+template class BasicSplitterTree<uint64_t>;
+template class BasicSplitterTree<uint128_t>;
@@ -0,0 +1,517 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <iostream>
+#include <shared_mutex>
+#include <storage.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+#include <vector>
+
+// Windows support
+#ifdef _WIN32
+#include <direct.h>
+#define MKDIR(dir) _mkdir(dir)
+#else
+#define MKDIR(dir) mkdir(dir, 0755)
+#endif
+
+using namespace std;
+
+/**
+ * @MMAP_GROW_BYTES: 1MB. Minimum growth of a memory-mapped file opened for writing.
+ */
+const int64_t MMAP_GROW_BYTES = 1024 * 1024;
+
+/** open_flags
+ * @brief Translates a StorageMode to open(2) flags.
+ */
+static int open_flags(StorageMode mode) {
+    switch (mode) {
+    case StorageMode::READ:
+        return O_RDONLY;
+    case StorageMode::WRITE:
+        return O_RDWR | O_CREAT | O_TRUNC;
+    case StorageMode::READ_WRITE:
+        return O_RDWR | O_CREAT;
+    }
+    return O_RDONLY;
+}
+
+/**
+ * @brief File of FileStorage, a file descriptor used with pread/pwrite.
+ */
+class PosixFile : public StorageFile {
+  public:
+    explicit PosixFile(int fd) : fd_(fd) {
+    }
+
+    ~PosixFile() override {
+        close(fd_);
+    }
+
+    int64_t read_at(void *buffer, int64_t bytes, int64_t offset) override {
+        int64_t done = 0;
+        while (done < bytes) {
+            ssize_t n = pread(fd_, static_cast<char *>(buffer) + done, bytes - done, offset + done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        return done;
+    }
+
+    int64_t write_at(const void *buffer, int64_t bytes, int64_t offset) override {
+        int64_t done = 0;
+        while (done < bytes) {
+            ssize_t n =
+                pwrite(fd_, static_cast<const char *>(buffer) + done, bytes - done, offset + done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        return done;
+    }
+
+    int64_t size() override {
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+            return 0;
+        return st.st_size;
+    }
+
+    void resize(int64_t bytes) override {
+        // On failure the file keeps its size: the writes that needed the space come short
+        int result = ftruncate(fd_, bytes);
+        (void)result;
+    }
+
+    void preallocate(int64_t bytes) override {
+        if (posix_fallocate(fd_, 0, bytes) != 0)
+            StorageFile::preallocate(bytes);
+    }
+
+    bool native_ranges(int64_t offset, int64_t bytes, bool write, vector<NativeRange> &ranges) override {
+        (void)write;
+        ranges.push_back({fd_, offset, bytes, 0});
+        return true;
+    }
+
+  private:
+    int fd_;
+};
+
+/**
+ * @brief File of MmapStorage, a mapping grown on demand for writes.
+ * @details Reads and writes inside the mapping run concurrently, growing the mapping
+ * takes the lock exclusively since it moves data_.
+ */
+class MmapFile : public StorageFile {
+  public:
+    MmapFile(int fd, bool writable) : fd_(fd), writable_(writable) {
+        struct stat st;
+        fstat(fd_, &st);
+        size_ = st.st_size;
+        remap(size_);
+    }
+
+    ~MmapFile() override {
+        if (data_)
+            munmap(data_, capacity_);
+        // A failed truncation only leaves the unused capacity at the end of the file
+        if (writable_) {
+            int result = ftruncate(fd_, size_);
+            (void)result;
+        }
+        close(fd_);
+    }
+
+    int64_t read_at(void *buffer, int64_t bytes, int64_t offset) override {
+        shared_lock<shared_mutex> lock(mutex_);
+        if (offset >= size_)
+            return 0;
+        int64_t n = min(bytes, size_ - offset);
+        memcpy(buffer, data_ + offset, n);
+        return n;
+    }
+
+    int64_t write_at(const void *buffer, int64_t bytes, int64_t offset) override {
+        if (!writable_)
+            return 0;
+        {
+            shared_lock<shared_mutex> lock(mutex_);
+            if (offset + bytes <= capacity_) {
+                memcpy(data_ + offset, buffer, bytes);
+                int64_t size = size_;
+                while (size < offset + bytes && !size_.compare_exchange_weak(size, offset + bytes)) {
+                }
+                return bytes;
+            }
+        }
+        unique_lock<shared_mutex> lock(mutex_);
+        if (offset + bytes > capacity_) {
+            int64_t capacity = max(offset + bytes, max(capacity_ * 2, MMAP_GROW_BYTES));
+            if (ftruncate(fd_, capacity) != 0)
+                return 0;
+            remap(capacity);
+        }
+        memcpy(data_ + offset, buffer, bytes);
+        size_ = max(size_.load(), offset + bytes);
+        return bytes;
+    }
+
+    int64_t size() override {
+        return size_;
+    }
+
+    void resize(int64_t bytes) override {
+        if (!writable_)
+            return;
+        unique_lock<shared_mutex> lock(mutex_);
+        if (bytes > capacity_) {
+            if (ftruncate(fd_, bytes) != 0)
+                return;
+            remap(bytes);
+        } else if (bytes < size_) {
+            memset(data_ + bytes, 0, size_ - bytes);
+        }
+        size_ = bytes;
+    }
+
+  private:
+    void remap(int64_t capacity) {
+        if (data_)
+            munmap(data_, capacity_);
+        data_ = nullptr;
+        capacity_ = capacity;
+        if (capacity_ == 0)
+            return;
+        int prot = writable_ ? PROT_READ | PROT_WRITE : PROT_READ;
+        void *p = mmap(nullptr, capacity_, prot, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED) {
+            cerr << "Error mapping file descriptor " << fd_ << endl;
+            exit(EXIT_FAILURE);
+        }
+        data_ = static_cast<char *>(p);
+    }
+
+    int fd_;
+    bool writable_;
+    char *data_ = nullptr;
+    atomic<int64_t> size_{0};
+    int64_t capacity_ = 0;
+    shared_mutex mutex_;
+};
+
+/**
+ * @brief File of MemoryStorage, shares its bytes with the backend's table.
+ */
+class MemoryFile : public StorageFile {
+  public:
+    explicit MemoryFile(shared_ptr<MemoryFileData> data) : data_(move(data)) {
+    }
+
+    int64_t read_at(void *buffer, int64_t bytes, int64_t offset) override {
+        lock_guard<mutex> lock(data_->mutex);
+        int64_t size = data_->bytes.size();
+        if (offset >= size)
+            return 0;
+        int64_t n = min(bytes, size - offset);
+        memcpy(buffer, data_->bytes.data() + offset, n);
+        return n;
+    }
+
+    int64_t write_at(const void *buffer, int64_t bytes, int64_t offset) override {
+        lock_guard<mutex> lock(data_->mutex);
+        if (offset + bytes > (int64_t)data_->bytes.size())
+            data_->bytes.resize(offset + bytes);
+        memcpy(data_->bytes.data() + offset, buffer, bytes);
+        return bytes;
+    }
+
+    int64_t size() override {
+        lock_guard<mutex> lock(data_->mutex);
+        return data_->bytes.size();
+    }
+
+    void resize(int64_t bytes) override {
+        lock_guard<mutex> lock(data_->mutex);
+        data_->bytes.resize(bytes);
+    }
+
+  private:
+    shared_ptr<MemoryFileData> data_;
+};
+
+/**
+ * @brief File of SimulatedStorage, charges every request to the device clock.
+ */
+class SimulatedFile : public StorageFile {
+  public:
+    SimulatedFile(unique_ptr<StorageFile> file, SimulatedStorage *device, int64_t file_id)
+        : file_(move(file)), device_(device), file_id_(file_id) {
+    }
+
+    int64_t read_at(void *buffer, int64_t bytes, int64_t offset) override {
+        int64_t n = file_->read_at(buffer, bytes, offset);
+        if (n > 0)
+            device_->account(file_id_, offset, n);
+        return n;
+    }
+
+    int64_t write_at(const void *buffer, int64_t bytes, int64_t offset) override {
+        int64_t n = file_->write_at(buffer, bytes, offset);
+        device_->account(file_id_, offset, n);
+        return n;
+    }
+
+    int64_t size() override {
+        return file_->size();
+    }
+
+    void resize(int64_t bytes) override {
+        file_->resize(bytes);
+    }
+
+  private:
+    unique_ptr<StorageFile> file_;
+    SimulatedStorage *device_;
+    int64_t file_id_;
+};
+
+unique_ptr<StorageFile> FileStorage::open(const string &path, StorageMode mode) {
+    int fd = ::open(path.c_str(), open_flags(mode), 0644);
+    if (fd < 0)
+        return nullptr;
+    return make_unique<PosixFile>(fd);
+}
+
+int64_t FileStorage::file_size(const string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+bool FileStorage::remove(const string &path) {
+    return ::remove(path.c_str()) == 0;
+}
+
+void FileStorage::create_directories(const string &dir) {
+    size_t pos = 0;
+    string path;
+    while ((pos = dir.find('/', pos)) != string::npos) {
+        path = dir.substr(0, pos++);
+        if (path.length() > 0) {
+            MKDIR(path.c_str());
+        }
+    }
+    MKDIR(dir.c_str());
+}
+
+/** remove_entry
+ * @brief nftw callback of FileStorage::remove_directory, entries arrive children first.
+ */
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return ::remove(path);
+}
+
+void FileStorage::remove_directory(const string &dir) {
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0)
+        return;
+    if (nftw(dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) != 0) {
+        cerr << "Error removing directory: " << dir << endl;
+    }
+}
+
+int64_t FileStorage::free_bytes(const string &dir) {
+    struct statvfs st;
+    if (statvfs(dir.c_str(), &st) != 0)
+        return -1;
+    return (int64_t)st.f_bavail * st.f_frsize;
+}
+
+string FileStorage::name() const {
+    return "file";
+}
+
+unique_ptr<StorageFile> MmapStorage::open(const string &path, StorageMode mode) {
+    int fd = ::open(path.c_str(), open_flags(mode), 0644);
+    if (fd < 0)
+        return nullptr;
+    return make_unique<MmapFile>(fd, mode != StorageMode::READ);
+}
+
+string MmapStorage::name() const {
+    return "mmap";
+}
+
+unique_ptr<StorageFile> MemoryStorage::open(const string &path, StorageMode mode) {
+    lock_guard<mutex> lock(files_mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+        if (mode == StorageMode::READ)
+            return nullptr;
+        it = files_.emplace(path, make_shared<MemoryFileData>()).first;
+    } else if (mode == StorageMode::WRITE) {
+        lock_guard<mutex> file_lock(it->second->mutex);
+        it->second->bytes.clear();
+    }
+    return make_unique<MemoryFile>(it->second);
+}
+
+int64_t MemoryStorage::file_size(const string &path) {
+    lock_guard<mutex> lock(files_mutex_);
+    auto it = files_.find(path);
+    if (it == files_.end())
+        return -1;
+    lock_guard<mutex> file_lock(it->second->mutex);
+    return it->second->bytes.size();
+}
+
+bool MemoryStorage::remove(const string &path) {
+    lock_guard<mutex> lock(files_mutex_);
+    return files_.erase(path) > 0;
+}
+
+void MemoryStorage::create_directories(const string &dir) {
+    (void)dir;
+}
+
+void MemoryStorage::remove_directory(const string &dir) {
+    string prefix = dir;
+    if (!prefix.empty() && prefix.back() != '/')
+        prefix += '/';
+    lock_guard<mutex> lock(files_mutex_);
+    for (auto it = files_.lower_bound(prefix); it != files_.end();) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0)
+            break;
+        it = files_.erase(it);
+    }
+}
+
+string MemoryStorage::name() const {
+    return "memory";
+}
+
+/** device_profile
+ * @brief Predefined profiles: "hdd", "ssd" (SATA) and "nvme".
+ * @warning Exits with error if the name is unknown.
+ */
+DeviceProfile device_profile(const string &name) {
+    if (name == "hdd")
+        return {"hdd", 8e-3, 1e-4, 150e6, 1};
+    if (name == "ssd")
+        return {"ssd", 5e-5, 1e-4, 500e6, 32};
+    if (name == "nvme")
+        return {"nvme", 0, 2e-5, 3000e6, 64};
+    cerr << "Unknown device profile: " << name << endl;
+    exit(EXIT_FAILURE);
+}
+
+SimulatedStorage::SimulatedStorage(const DeviceProfile &profile)
+    : profile_(profile), slot_free_(max(int64_t(1), profile.queue_depth), 0.0) {
+}
+
+unique_ptr<StorageFile> SimulatedStorage::open(const string &path, StorageMode mode) {
+    unique_ptr<StorageFile> file = MemoryStorage::open(path, mode);
+    if (!file)
+        return nullptr;
+    lock_guard<mutex> lock(clock_mutex_);
+    auto it = file_ids_.find(path);
+    if (it == file_ids_.end())
+        it = file_ids_.emplace(path, file_ids_.size()).first;
+    return make_unique<SimulatedFile>(move(file), this, it->second);
+}
+
+string SimulatedStorage::name() const {
+    return "sim:" + profile_.name;
+}
+
+void SimulatedStorage::account(int64_t file_id, int64_t offset, int64_t bytes) {
+    lock_guard<mutex> lock(clock_mutex_);
+    double &issue = thread_clock_[this_thread::get_id()];
+    auto slot = min_element(slot_free_.begin(), slot_free_.end());
+    double start = max(issue, *slot);
+
+    double latency = profile_.request_seconds;
+    if (file_id != last_file_ || offset != last_end_) {
+        latency += profile_.seek_seconds;
+        seeks_++;
+    }
+    double transfer_start = max(start + latency, bus_free_);
+    double finish = transfer_start + bytes / profile_.bandwidth_bytes;
+
+    bus_free_ = finish;
+    *slot = finish;
+    issue = finish;
+    elapsed_ = max(elapsed_, finish);
+    last_file_ = file_id;
+    last_end_ = offset + bytes;
+}
+
+double SimulatedStorage::elapsed_seconds() {
+    lock_guard<mutex> lock(clock_mutex_);
+    return elapsed_;
+}
+
+int64_t SimulatedStorage::seeks() {
+    lock_guard<mutex> lock(clock_mutex_);
+    return seeks_;
+}
+
+void SimulatedStorage::reset_clock() {
+    lock_guard<mutex> lock(clock_mutex_);
+    fill(slot_free_.begin(), slot_free_.end(), 0.0);
+    thread_clock_.clear();
+    bus_free_ = 0;
+    elapsed_ = 0;
+    last_file_ = -1;
+    last_end_ = -1;
+    seeks_ = 0;
+}
+
+const DeviceProfile &SimulatedStorage::profile() const {
+    return profile_;
+}
+
+static unique_ptr<StorageBackend> current_backend;
+
+/** storage
+ * @brief Backend used by the sorts, FileStorage unless another one was set.
+ */
+StorageBackend &storage() {
+    if (!current_backend)
+        current_backend = make_unique<FileStorage>();
+    return *current_backend;
+}
+
+/** set_storage_backend
+ * @brief Replaces the backend used by the sorts.
+ */
+void set_storage_backend(unique_ptr<StorageBackend> backend) {
+    current_backend = move(backend);
+}
+
+/** make_storage_backend
+ * @brief Creates a backend by name: "file", "mmap", "memory" or a device profile name.
+ * @warning Exits with error if the name is unknown.
+ */
+unique_ptr<StorageBackend> make_storage_backend(const string &name) {
+    if (name == "file")
+        return make_unique<FileStorage>();
+    if (name == "mmap")
+        return make_unique<MmapStorage>();
+    if (name == "memory")
+        return make_unique<MemoryStorage>();
+    return make_unique<SimulatedStorage>(device_profile(name));
+}
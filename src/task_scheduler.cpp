@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <chrono>
+#include <task_scheduler.h>
+
+using namespace std;
+
+/**
+ * @IDLE_WAIT: Longest sleep of an idle thread before looking for work again.
+ */
+const chrono::milliseconds IDLE_WAIT(1);
+
+// Queue owned by the current thread, -1 outside every scheduler
+static thread_local int64_t current_queue = -1;
+static thread_local const TaskScheduler *current_scheduler = nullptr;
+
+TaskScheduler::TaskScheduler(int64_t num_threads) {
+    num_threads_ = num_threads > 0 ? num_threads : max(1u, thread::hardware_concurrency());
+    for (int64_t i = 0; i <= num_threads_; i++) {
+        queues_.push_back(make_unique<WorkQueue>());
+    }
+    for (int64_t i = 0; i < num_threads_; i++) {
+        workers_.emplace_back(&TaskScheduler::worker_loop, this, i);
+    }
+}
+
+TaskScheduler::~TaskScheduler() {
+    stop_ = true;
+    wake_.notify_all();
+    for (thread &worker : workers_) {
+        worker.join();
+    }
+}
+
+int64_t TaskScheduler::num_threads() const {
+    return num_threads_;
+}
+
+/** queue_index
+ * @brief Queue of the calling thread: its own for a worker, the shared last one otherwise.
+ */
+int64_t TaskScheduler::queue_index() {
+    if (current_scheduler == this)
+        return current_queue;
+    return num_threads_;
+}
+
+void TaskScheduler::spawn(TaskGroup &group, function<void()> task) {
+    group.pending++;
+    WorkQueue &queue = *queues_[queue_index()];
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        queue.tasks.push_back({&group, move(task)});
+    }
+    wake_.notify_one();
+}
+
+/** run_one
+ * @brief Runs the newest task of queue index, or else steals the oldest task of another.
+ * @return true if a task was run.
+ */
+bool TaskScheduler::run_one(int64_t index) {
+    Task task;
+    bool found = false;
+    {
+        WorkQueue &own = *queues_[index];
+        lock_guard<mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = move(own.tasks.back());
+            own.tasks.pop_back();
+            found = true;
+        }
+    }
+    for (size_t k = 1; !found && k < queues_.size(); k++) {
+        WorkQueue &victim = *queues_[(index + k) % queues_.size()];
+        lock_guard<mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = move(victim.tasks.front());
+            victim.tasks.pop_front();
+            found = true;
+        }
+    }
+    if (!found)
+        return false;
+
+    task.run();
+    if (--task.group->pending == 0) {
+        // Take the lock so a waiter between its check and its sleep doesn't miss this
+        lock_guard<mutex> lock(sleep_mutex_);
+        wake_.notify_all();
+    }
+    return true;
+}
+
+void TaskScheduler::worker_loop(int64_t index) {
+    current_queue = index;
+    current_scheduler = this;
+    while (!stop_) {
+        if (!run_one(index)) {
+            unique_lock<mutex> lock(sleep_mutex_);
+            wake_.wait_for(lock, IDLE_WAIT);
+        }
+    }
+}
+
+void TaskScheduler::wait(TaskGroup &group) {
+    int64_t index = queue_index();
+    while (group.pending > 0) {
+        if (!run_one(index)) {
+            unique_lock<mutex> lock(sleep_mutex_);
+            if (group.pending > 0)
+                wake_.wait_for(lock, IDLE_WAIT);
+        }
+    }
+}